@@ -0,0 +1,8 @@
+#include "kernel/kernel.h"
+#include "kernel/clock.h"
+
+// The generic timer's frequency is fixed and given by the firmware in CNTFRQ_EL0, so there's nothing to calibrate
+void InitializeClock(void)
+{
+    SetClockFrequency("CNTFRQ_EL0", mainCPUInfo.counterFrequency);
+}
@@ -0,0 +1,315 @@
+#include "kernel/kernel.h"
+#include "kernel/cpu.h"
+#include "kernel/graphics.h"
+
+// Keeps GCC from turning the byte loops below back into calls to memcpy/memset, which don't exist in the kernel
+#define NO_LIBCALLS __attribute__((optimize("no-tree-loop-distribute-patterns")))
+
+#define READ_SYSTEM_REGISTER(name, dest) asm volatile("mrs %[reg], " #name : [reg] "=r" (dest))
+
+
+static void CopyMemoryPaired(void * dest, const void * src, uint64_t length);
+static void SetMemoryPaired(void * dest, uint8_t value, uint64_t length);
+static int16_t CompareMemoryWords(const void * addr1, const void * addr2, uint64_t length);
+static void FillMemory32Paired(uint32_t * dest, uint32_t value, uint64_t count);
+static void StreamMemoryPaired(void * dest, const void * src, uint64_t length);
+static uint8_t Checksum8Words(const void * data, uint64_t length);
+
+CPUInfo mainCPUInfo = {0};
+
+// ldp/stp are part of the base ISA, so these run anywhere
+CPURoutines mainCPURoutines = {
+    CopyMemoryPaired,
+    SetMemoryPaired,
+    CompareMemoryWords,
+    FillMemory32Paired,
+    StreamMemoryPaired,
+    Checksum8Words
+};
+
+// The kernel is built with -mstrict-align, so the paired loads/stores are only used once both pointers are 8-byte aligned
+
+NO_LIBCALLS static void CopyMemoryPaired(void * addr1, const void * addr2, uint64_t length)
+{
+    uint8_t * dest = addr1;
+    const uint8_t * src = addr2;
+
+    if(!(((uint64_t)dest ^ (uint64_t)src) & 7))
+    {
+        for(; (length > 0) && ((uint64_t)dest & 7); length--)
+            *dest++ = *src++;
+
+        while(length >= 64)
+        {
+            asm volatile("ldp x9, x10, [%[src]]\n"
+                         "ldp x11, x12, [%[src], #16]\n"
+                         "ldp x13, x14, [%[src], #32]\n"
+                         "ldp x15, x16, [%[src], #48]\n"
+                         "stp x9, x10, [%[dest]]\n"
+                         "stp x11, x12, [%[dest], #16]\n"
+                         "stp x13, x14, [%[dest], #32]\n"
+                         "stp x15, x16, [%[dest], #48]"
+                : // Outputs
+                : [dest] "r" (dest), [src] "r" (src) // Inputs
+                : "x9", "x10", "x11", "x12", "x13", "x14", "x15", "x16", "memory" // Clobbers
+            );
+            dest += 64;
+            src += 64;
+            length -= 64;
+        }
+
+        for(; length >= 8; length -= 8, dest += 8, src += 8)
+            *(uint64_t *)dest = *(const uint64_t *)src;
+    }
+
+    for(; length > 0; length--)
+        *dest++ = *src++;
+}
+
+// Same as CopyMemoryPaired, but with stnp so the destination doesn't get cached
+static void StreamMemoryPaired(void * addr1, const void * addr2, uint64_t length)
+{
+    uint8_t * dest = addr1;
+    const uint8_t * src = addr2;
+
+    if(((uint64_t)dest ^ (uint64_t)src) & 7)
+    {
+        CopyMemoryPaired(addr1, addr2, length);
+        return;
+    }
+
+    uint64_t head = (-(uint64_t)dest) & 7;
+    if(head > length)
+        head = length;
+
+    CopyMemoryPaired(dest, src, head);
+    dest += head;
+    src += head;
+    length -= head;
+
+    while(length >= 64)
+    {
+        asm volatile("ldp x9, x10, [%[src]]\n"
+                     "ldp x11, x12, [%[src], #16]\n"
+                     "ldp x13, x14, [%[src], #32]\n"
+                     "ldp x15, x16, [%[src], #48]\n"
+                     "stnp x9, x10, [%[dest]]\n"
+                     "stnp x11, x12, [%[dest], #16]\n"
+                     "stnp x13, x14, [%[dest], #32]\n"
+                     "stnp x15, x16, [%[dest], #48]"
+            : // Outputs
+            : [dest] "r" (dest), [src] "r" (src) // Inputs
+            : "x9", "x10", "x11", "x12", "x13", "x14", "x15", "x16", "memory" // Clobbers
+        );
+        dest += 64;
+        src += 64;
+        length -= 64;
+    }
+
+    CopyMemoryPaired(dest, src, length);
+}
+
+NO_LIBCALLS static void SetMemoryPaired(void * addr, uint8_t value, uint64_t length)
+{
+    uint8_t * dest = addr;
+    uint64_t pattern = value * 0x0101010101010101ULL;
+
+    for(; (length > 0) && ((uint64_t)dest & 7); length--)
+        *dest++ = value;
+
+    while(length >= 64)
+    {
+        asm volatile("stp %[pattern], %[pattern], [%[dest]]\n"
+                     "stp %[pattern], %[pattern], [%[dest], #16]\n"
+                     "stp %[pattern], %[pattern], [%[dest], #32]\n"
+                     "stp %[pattern], %[pattern], [%[dest], #48]"
+            : // Outputs
+            : [dest] "r" (dest), [pattern] "r" (pattern) // Inputs
+            : "memory" // Clobbers
+        );
+        dest += 64;
+        length -= 64;
+    }
+
+    for(; length >= 8; length -= 8, dest += 8)
+        *(uint64_t *)dest = pattern;
+
+    for(; length > 0; length--)
+        *dest++ = value;
+}
+
+// Zeroing clears whole blocks at a time with dc zva, which doesn't have to read the lines in first
+static void SetMemoryZVA(void * addr, uint8_t value, uint64_t length)
+{
+    uint8_t * dest = addr;
+    uint64_t blockSize = mainCPUInfo.zeroBlockSize;
+
+    if(value || (length < 2 * blockSize))
+    {
+        SetMemoryPaired(addr, value, length);
+        return;
+    }
+
+    uint64_t head = (-(uint64_t)dest) & (blockSize - 1);
+    SetMemoryPaired(dest, 0, head);
+    dest += head;
+    length -= head;
+
+    for(; length >= blockSize; length -= blockSize, dest += blockSize)
+        asm volatile("dc zva, %[dest]" : : [dest] "r" (dest) : "memory");
+
+    SetMemoryPaired(dest, 0, length);
+}
+
+static void FillMemory32Paired(uint32_t * dest, uint32_t value, uint64_t count)
+{
+    uint64_t pattern = ((uint64_t)value << 32) | value;
+
+    if((count > 0) && ((uint64_t)dest & 7))
+    {
+        *dest++ = value;
+        count--;
+    }
+
+    while(count >= 16)
+    {
+        asm volatile("stp %[pattern], %[pattern], [%[dest]]\n"
+                     "stp %[pattern], %[pattern], [%[dest], #16]\n"
+                     "stp %[pattern], %[pattern], [%[dest], #32]\n"
+                     "stp %[pattern], %[pattern], [%[dest], #48]"
+            : // Outputs
+            : [dest] "r" (dest), [pattern] "r" (pattern) // Inputs
+            : "memory" // Clobbers
+        );
+        dest += 16;
+        count -= 16;
+    }
+
+    for(; count >= 2; count -= 2, dest += 2)
+        *(uint64_t *)dest = pattern;
+
+    if(count)
+        *dest = value;
+}
+
+NO_LIBCALLS static int16_t CompareMemoryWords(const void * addr1, const void * addr2, uint64_t length)
+{
+    const uint8_t * p1 = addr1;
+    const uint8_t * p2 = addr2;
+
+    if(!(((uint64_t)p1 ^ (uint64_t)p2) & 7))
+    {
+        for(; (length > 0) && ((uint64_t)p1 & 7); length--, p1++, p2++)
+        {
+            if(*p1 != *p2)
+                return *p2 - *p1;
+        }
+
+        // Skip over equal words; the byte loop below finds the differing byte if there is one
+        for(; (length >= 8) && (*(const uint64_t *)p1 == *(const uint64_t *)p2); length -= 8, p1 += 8, p2 += 8);
+    }
+
+    for(; length > 0; length--, p1++, p2++)
+    {
+        if(*p1 != *p2)
+            return *p2 - *p1;
+    }
+    return 0;
+}
+
+static uint8_t Checksum8Words(const void * data, uint64_t length)
+{
+    const uint8_t * p = data;
+    uint64_t sum = 0;
+
+    for(; (length > 0) && ((uint64_t)p & 7); length--)
+        sum += *p++;
+
+    while(length >= 8)
+    {
+        // Four 16-bit sums of byte pairs. Each word adds at most 510 to a lane, so they're folded into sum before one can carry into the next.
+        uint64_t lanes = 0;
+
+        for(uint16_t words = 0; (words < 128) && (length >= 8); words++, length -= 8, p += 8)
+        {
+            uint64_t word = *(const uint64_t *)p;
+            lanes += (word & 0x00FF00FF00FF00FFULL) + ((word >> 8) & 0x00FF00FF00FF00FFULL);
+        }
+        sum += (lanes & 0xFFFF) + ((lanes >> 16) & 0xFFFF) + ((lanes >> 32) & 0xFFFF) + (lanes >> 48);
+    }
+
+    for(; length > 0; length--)
+        sum += *p++;
+
+    return (uint8_t)sum;
+}
+
+void InitializeCPU(void)
+{
+    uint64_t reg;
+    uint64_t features = 0;
+
+    READ_SYSTEM_REGISTER(MIDR_EL1, reg);
+    switch((reg >> 24) & 0xFF) // Implementer
+    {
+        case 0x41:
+            CopyMemory(mainCPUInfo.vendor, "ARM", 4);
+            break;
+        case 0x51:
+            CopyMemory(mainCPUInfo.vendor, "Qualcomm", 9);
+            break;
+        case 0x61:
+            CopyMemory(mainCPUInfo.vendor, "Apple", 6);
+            break;
+        default:
+            CopyMemory(mainCPUInfo.vendor, "Unknown", 8);
+            break;
+    }
+
+    READ_SYSTEM_REGISTER(CTR_EL0, reg);
+    mainCPUInfo.cacheLineSize = 4 << ((reg >> 16) & 0xF); // DminLine is log2 of the line size in words
+
+    READ_SYSTEM_REGISTER(CNTFRQ_EL0, reg); // Set by firmware
+    mainCPUInfo.counterFrequency = reg & 0xFFFFFFFF;
+
+    READ_SYSTEM_REGISTER(ID_AA64PFR0_EL1, reg);
+    if(((reg >> 16) & 0xF) != 0xF)
+        features |= CPU_FEATURE_FP;
+    if(((reg >> 20) & 0xF) != 0xF)
+        features |= CPU_FEATURE_ASIMD;
+
+    READ_SYSTEM_REGISTER(ID_AA64ISAR0_EL1, reg);
+    if(((reg >> 16) & 0xF) >= 1)
+        features |= CPU_FEATURE_CRC32;
+    if(((reg >> 20) & 0xF) >= 2)
+        features |= CPU_FEATURE_ATOMICS;
+
+    READ_SYSTEM_REGISTER(DCZID_EL0, reg);
+    if(!(reg & (1 << 4))) // DZP: dc zva is prohibited
+    {
+        features |= CPU_FEATURE_DC_ZVA;
+        mainCPUInfo.zeroBlockSize = 4 << (reg & 0xF);
+    }
+
+    mainCPUInfo.features = features;
+
+    if(features & CPU_FEATURE_DC_ZVA)
+        mainCPURoutines.setMemory = SetMemoryZVA;
+}
+
+#ifdef DEBUG_PIOUS
+static const char * featureNames[] = {"fp", "asimd", "crc32", "atomics", "dc-zva"};
+
+void PrintCPUInfo(void)
+{
+    PrintString("%s, %u-byte cache lines\n", mainTextDisplaySettings.fontColor, mainTextDisplaySettings.backgroundColor, mainCPUInfo.vendor, mainCPUInfo.cacheLineSize);
+
+    PrintString("CPU features:", mainTextDisplaySettings.fontColor, mainTextDisplaySettings.backgroundColor);
+    for(uint8_t i = 0; i < sizeof(featureNames) / sizeof(featureNames[0]); i++)
+    {
+        if(mainCPUInfo.features & (1ULL << i))
+            PrintString(" %s", mainTextDisplaySettings.fontColor, mainTextDisplaySettings.backgroundColor, featureNames[i]);
+    }
+    PrintString("\n", mainTextDisplaySettings.fontColor, mainTextDisplaySettings.backgroundColor);
+}
+#endif
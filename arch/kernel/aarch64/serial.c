@@ -0,0 +1,24 @@
+#include "kernel/kernel.h"
+#include "kernel/serial.h"
+
+// There's no fixed address for a UART here; it'll have to come from the ACPI SPCR table or the device tree. Until then only the
+// framebuffer console is available.
+
+bool InitializeSerial(void)
+{
+    return false;
+}
+
+void WriteSerial(const unsigned char * chars, uint64_t length)
+{
+}
+
+// debugcon is an x86 I/O port device
+bool InitializeDebugcon(void)
+{
+    return false;
+}
+
+void WriteDebugcon(const unsigned char * chars, uint64_t length)
+{
+}
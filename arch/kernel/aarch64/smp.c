@@ -0,0 +1,173 @@
+#include "kernel/kernel.h"
+#include "kernel/smp.h"
+#include "kernel/acpi.h"
+#include "kernel/clock.h"
+#include "kernel/options.h"
+#include "system.h"
+
+#define READ_SYSTEM_REGISTER(name, dest) asm volatile("mrs %[reg], " #name : [reg] "=r" (dest))
+
+#define PSCI_CPU_ON             0xC4000003 // SMC64 calling convention
+#define PSCI_SUCCESS            0
+
+#define MPIDR_AFFINITY_MASK     0xFF00FFFFFFULL
+#define CURRENT_EL_EL1          (1 << 2)
+#define PAR_FAULT               (1 << 0)
+#define PAR_ADDRESS_MASK        0x0000FFFFFFFFF000ULL
+
+#define STARTUP_TIMEOUT         100000000 // 100 ms for every CPU to check in
+
+_Static_assert(__builtin_offsetof(ARCH_CPU_STATE, VBAR) == 40, "trampoline.S's ARCH_VBAR is out of date");
+_Static_assert(__builtin_offsetof(ARCH_CPU_STATE, Entry) == 48, "trampoline.S's ARCH_ENTRY is out of date");
+
+extern uint8_t APTrampoline[], APTrampolineEnd[];
+
+static bool useHVC = false;
+
+// hardwareId only has 32 bits, so Aff3 goes where the MPIDR's non-affinity bits 31:24 are
+static uint32_t MPIDRToHardwareId(uint64_t mpidr)
+{
+    return (uint32_t)(((mpidr >> 8) & 0xFF000000) | (mpidr & 0x00FFFFFF));
+}
+
+static int64_t PSCICPUOn(uint64_t mpidr, uint64_t entry, uint64_t context)
+{
+    register uint64_t x0 asm("x0") = PSCI_CPU_ON;
+    register uint64_t x1 asm("x1") = mpidr;
+    register uint64_t x2 asm("x2") = entry;
+    register uint64_t x3 asm("x3") = context;
+
+    if(useHVC)
+        asm volatile("hvc #0" : "+r" (x0), "+r" (x1), "+r" (x2), "+r" (x3) : : "memory");
+    else
+        asm volatile("smc #0" : "+r" (x0), "+r" (x1), "+r" (x2), "+r" (x3) : : "memory");
+
+    return (int64_t)x0;
+}
+
+// The started CPU reads these with its caches off, so they have to be in RAM and not just in this CPU's cache
+static void CleanToCoherency(const void * address, uint64_t length)
+{
+    uint64_t line = mainCPUInfo.cacheLineSize ? mainCPUInfo.cacheLineSize : 64;
+    for(uint64_t current = (uint64_t)address & ~(line - 1); current < (uint64_t)address + length; current += line)
+        asm volatile("dc cvac, %[address]" : : [address] "r" (current) : "memory");
+    asm volatile("dsb sy" : : : "memory");
+}
+
+static uint64_t VirtualToPhysical(const void * address)
+{
+    uint64_t par;
+    asm volatile("at s1e1r, %[address]\n"
+                 "isb\n"
+                 "mrs %[par], par_el1"
+        : [par] "=r" (par) // Outputs
+        : [address] "r" (address) // Inputs
+        : // Clobbers
+    );
+
+    if(par & PAR_FAULT)
+        return 0;
+
+    return (par & PAR_ADDRESS_MASK) | ((uint64_t)address & 0xFFF);
+}
+
+// The startup code comes here with the MMU on and on the CPU's own stack
+void SecondaryCPUEntry(CPUState * cpu)
+{
+    SecondaryCPUMain(cpu);
+}
+
+void StartSecondaryCPUs(void)
+{
+    uint64_t start = GetMonotonicTime();
+    uint64_t bootMPIDR, currentEL;
+    READ_SYSTEM_REGISTER(mpidr_el1, bootMPIDR);
+    READ_SYSTEM_REGISTER(CurrentEL, currentEL);
+    bootMPIDR &= MPIDR_AFFINITY_MASK;
+    mainSMPInfo.cpus[0]->hardwareId = MPIDRToHardwareId(bootMPIDR);
+
+    ACPI_MADT * madt = (ACPI_MADT *)GetACPITable(ACPI_TABLE_MADT);
+    ACPI_FADT * fadt = (ACPI_FADT *)GetACPITable(ACPI_TABLE_FADT);
+    uint64_t maxCPUs = GetBootOptionInteger("maxcpus", SMP_MAX_CPUS);
+    if((madt == NULL) || (fadt == NULL) || (maxCPUs < 2))
+        return;
+
+    // The startup timeout needs working time
+    if(mainClockSource.frequency == 0)
+    {
+        LogMessage(LOG_LEVEL_WARNING, "SMP: No clock to time the startup with, only using the boot CPU\n");
+        return;
+    }
+
+    if((fadt->header.length < __builtin_offsetof(ACPI_FADT, minorVersion)) || !(fadt->armBootArchitectureFlags & ACPI_ARM_PSCI_COMPLIANT))
+    {
+        LogMessage(LOG_LEVEL_WARNING, "SMP: Firmware doesn't support PSCI, only using the boot CPU\n");
+        return;
+    }
+    useHVC = (fadt->armBootArchitectureFlags & ACPI_ARM_PSCI_USE_HVC) != 0;
+
+    // CPU_ON starts CPUs at the caller's exception level, and the startup code only sets up EL1
+    if(currentEL != CURRENT_EL_EL1)
+    {
+        LogMessage(LOG_LEVEL_WARNING, "SMP: Kernel isn't running at EL1, only using the boot CPU\n");
+        return;
+    }
+
+    uint64_t entry = VirtualToPhysical(APTrampoline);
+    if(entry == 0)
+        return;
+    CleanToCoherency(APTrampoline, APTrampolineEnd - APTrampoline);
+
+    ARCH_CPU_STATE archState;
+    READ_SYSTEM_REGISTER(mair_el1, archState.MAIR);
+    READ_SYSTEM_REGISTER(tcr_el1, archState.TCR);
+    READ_SYSTEM_REGISTER(ttbr0_el1, archState.TTBR0);
+    READ_SYSTEM_REGISTER(ttbr1_el1, archState.TTBR1);
+    READ_SYSTEM_REGISTER(sctlr_el1, archState.SCTLR);
+    READ_SYSTEM_REGISTER(vbar_el1, archState.VBAR);
+    archState.Entry = (uint64_t)SecondaryCPUEntry;
+
+    uint32_t attempted = 1;
+    ACPI_MADT_ENTRY * madtEntry;
+    FOR_EACH_MADT_ENTRY(madt, madtEntry)
+    {
+        ACPI_MADT_GICC_ENTRY * gicc = (ACPI_MADT_GICC_ENTRY *)madtEntry;
+        if((madtEntry->type != ACPI_MADT_GICC) || (madtEntry->length < sizeof(ACPI_MADT_GICC_ENTRY)) || !(gicc->flags & ACPI_MADT_ENABLED))
+            continue;
+
+        uint64_t mpidr = gicc->mpidr & MPIDR_AFFINITY_MASK;
+        if(mpidr == bootMPIDR)
+            continue;
+
+        if(mainSMPInfo.cpuCount >= maxCPUs)
+            break;
+
+        CPUState * cpu = CreateCPUState(MPIDRToHardwareId(mpidr), sizeof(ARCH_CPU_STATE));
+        if(cpu == NULL)
+            break;
+
+        CopyMemory(cpu->arch, &archState, sizeof(ARCH_CPU_STATE));
+        CleanToCoherency(cpu, sizeof(CPUState));
+        CleanToCoherency(cpu->arch, sizeof(ARCH_CPU_STATE));
+
+        // Unlike INIT-SIPI there's no delay to wait out, so each CPU can be started as soon as its state is ready
+        int64_t status = PSCICPUOn(mpidr, entry, (uint64_t)cpu);
+        if(status != PSCI_SUCCESS)
+            LogMessage(LOG_LEVEL_WARNING, "SMP: CPU_ON for MPIDR %lx failed (%ld)\n", mpidr, status);
+        else
+            attempted++;
+    }
+
+    uint32_t cpuCount = mainSMPInfo.cpuCount;
+    uint64_t timeout = GetMonotonicTime() + STARTUP_TIMEOUT;
+    while((__atomic_load_n(&mainSMPInfo.onlineCount, __ATOMIC_ACQUIRE) < attempted) && (GetMonotonicTime() < timeout))
+        asm volatile("yield");
+
+    mainSMPInfo.startupTime = GetMonotonicTime() - start;
+
+    if(mainSMPInfo.onlineCount != cpuCount)
+        LogMessage(LOG_LEVEL_WARNING, "SMP: %u of %u CPUs didn't start\n", cpuCount - mainSMPInfo.onlineCount, cpuCount);
+
+    LogMessage(LOG_LEVEL_INFO, "Started %u of %u CPUs in %lu.%03lu ms\n", mainSMPInfo.onlineCount, cpuCount,
+        mainSMPInfo.startupTime / 1000000, (mainSMPInfo.startupTime / 1000) % 1000);
+}
@@ -1,18 +1,51 @@
 #include "system.h"
 #include "kernel/graphics.h"
 #include "kernel/memory.h"
+#include "kernel/slab.h"
+#include "kernel/options.h"
+#include "kernel/clock.h"
+#include "kernel/acpi.h"
+#include "kernel/boottime.h"
 #include "ISR.h"
 
 
 void InitializeSystem(LOADER_PARAMS * Parameters)
 {
-    InitializeMemory(Parameters->Memory_Map_Size, Parameters->Memory_Map_Size, Parameters->Memory_Map, Parameters->Memory_Map_Descriptor_Version);
-    InitializeDisplay(Parameters->GPU_Configs->GPUArray[0]);
+    InitializeCPU();
+    SetCurrentCPU(mainSMPInfo.cpus[0]);
+    InitializeBootOptions(Parameters->Kernel_Options, Parameters->Kernel_Options_Size);
+    InitializeLogSinks();
+    InitializeBootTimings(Parameters);
+    StartBootPhase(BOOT_PHASE_MEMORY);
+    InitializeMemory(Parameters->Memory_Map_Size, Parameters->Memory_Map_Descriptor_Size, Parameters->Memory_Map, Parameters->Memory_Map_Descriptor_Version);
+    InitializeSlab();
+    EndBootPhase(BOOT_PHASE_MEMORY);
+    InitializeACPI(Parameters->ConfigTables, Parameters->Number_of_ConfigTables);
+    InitializeClock();
+    if(mainKernelLog.sinks & LOG_SINK_FRAMEBUFFER)
+    {
+        StartBootPhase(BOOT_PHASE_DISPLAY);
+        InitializeDisplay(Parameters->GPU_Configs->GPUArray[0]);
+        EndBootPhase(BOOT_PHASE_DISPLAY);
+    }
+    DrainLog(); // Anything logged before there was a display
+#ifdef DEBUG_PIOUS
+    PrintBootOptions();
+    PrintCPUInfo();
+    PrintClockInfo();
+    PrintACPIInfo();
+#endif
 
+    StartBootPhase(BOOT_PHASE_ISR);
     InitializeISR();
+    EndBootPhase(BOOT_PHASE_ISR);
+    StartSecondaryCPUs();
 
 #ifdef DEBUG_PIOUS
+    PrintSMPInfo();
+    PrintObjectCacheStatistics();
     PrintDebugMessage("System Initialized\n");
+    DrainLog();
 #endif
 }
 
@@ -21,7 +54,8 @@ void Abort(uint64_t errorCode)
     #ifdef DEBUG_PIOUS
         PrintErrorCode(errorCode, "");
     #else
-        PrintString("ERROR", mainTextDisplaySettings.fontColor, mainTextDisplaySettings.backgroundColor);
+        LogMessage(LOG_LEVEL_ERROR, "ERROR");
+        DrainLog();
     #endif
 
     //asm volatile("hlt 0");
@@ -30,14 +64,3 @@ void Abort(uint64_t errorCode)
     "    b halt;"
     );
 }
-
-//TODO: Use hardware acceration
-int16_t CompareMemory(const void * addr1, const void * addr2, uint64_t length)
-{
-    for(; length > 0; length--)
-    {
-        if(*((uint8_t *)addr1) != *((uint8_t *)addr2))
-            return *((uint8_t *)addr2) - *((uint8_t *)addr1);
-    }
-    return 0;
-}
\ No newline at end of file
@@ -4,6 +4,18 @@
 #define PAGE_TABLE_SIZE 512*8
 
 #include "bootloader/bootloader.h"
+#include "kernel/smp.h"
+
+// What a CPU started by PSCI needs to turn its MMU on the same way the boot CPU's is, read by trampoline.S with the MMU still off
+typedef struct {
+  UINT64 MAIR;
+  UINT64 TCR;
+  UINT64 TTBR0;
+  UINT64 TTBR1;
+  UINT64 SCTLR;
+  UINT64 VBAR;
+  UINT64 Entry; // Virtual address of SecondaryCPUEntry()
+} ARCH_CPU_STATE;
 
 void InitializeISR();
 
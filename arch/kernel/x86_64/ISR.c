@@ -1,6 +1,7 @@
 #include "kernel/kernel.h"
 #include "ISR.h"
 #include "system.h"
+#include "interrupt.h"
 //#include "kernel/EfiTypes.h"
 //#include "kernel/EfiBind.h"
 //#include "kernel/EfiErr.h"
@@ -12,18 +13,20 @@ static void SetBPInterruptEntry(uint64_t isrNum, uint64_t isrAddr);
 static void SetMCInterruptEntry(uint64_t isrNum, uint64_t isrAddr);
 static void SetTrapEntry(uint64_t isrNum, uint64_t isrAddr);
 
-__attribute__((aligned(64))) TSS64_STRUCT tss64 = {0};
+__attribute__((aligned(64))) static IDT_GATE_STRUCT IDT_data[256] = {0}; // Shared by every CPU
+static DT_STRUCT idtEntry = {0};
 
-__attribute__((aligned(64))) static IDT_GATE_STRUCT IDT_data[256] = {0};
-__attribute__((aligned(64))) static volatile unsigned char NMI_stack[1 << 12] = {0};
-__attribute__((aligned(64))) static volatile unsigned char DF_stack[1 << 12] = {0};
-__attribute__((aligned(64))) static volatile unsigned char MC_stack[1 << 12] = {0};
-__attribute__((aligned(64))) static volatile unsigned char BP_stack[1 << 12] = {0};
+// Everything below is per CPU (see kernel/percpu.h)
+static DEFINE_PER_CPU_ALIGNED(ARCH_CPU_STATE, cpuTables);
+static DEFINE_PER_CPU_ALIGNED(unsigned char, NMI_stack[IST_STACK_SIZE]);
+static DEFINE_PER_CPU_ALIGNED(unsigned char, DF_stack[IST_STACK_SIZE]);
+static DEFINE_PER_CPU_ALIGNED(unsigned char, MC_stack[IST_STACK_SIZE]);
+static DEFINE_PER_CPU_ALIGNED(unsigned char, BP_stack[IST_STACK_SIZE]);
 
 #define XSAVE_SIZE (1 << 13)
 
-__attribute__((aligned(64))) static volatile unsigned char cpu_xsave_space[XSAVE_SIZE] = {0}; // Generic space for unhandled/unknown IDT vectors in the 0-31 range.
-__attribute__((aligned(64))) static volatile unsigned char user_xsave_space[XSAVE_SIZE] = {0}; // For vectors 32-255, which can't preempt each other due to interrupt gating (IF in RFLAGS is cleared during ISR execution)
+static DEFINE_PER_CPU_ALIGNED(unsigned char, cpu_xsave_space[XSAVE_SIZE]); // Generic space for unhandled/unknown IDT vectors in the 0-31 range.
+static DEFINE_PER_CPU_ALIGNED(unsigned char, user_xsave_space[XSAVE_SIZE]); // For vectors 32-255, which can't preempt each other due to interrupt gating (IF in RFLAGS is cleared during ISR execution)
 
 
 void InitializeISR()
@@ -54,59 +57,11 @@ void InitializeISR()
              : [dest] "r" (reg) // Inputs
              : // Clobbers
     );
-    
 
 
-    DT_STRUCT dgtData = {0};
-    dgtData.Limit = sizeof(MinimalGDT) - 1;
-    dgtData.BaseAddress = (uint64_t)MinimalGDT; //Take the address from the EfiLoaderData
-
-
-
-    ( (TSS_LDT_ENTRY_STRUCT*) &((GDT_ENTRY_STRUCT*)MinimalGDT)[3] )->BaseAddress1 = (uint16_t)((uint64_t)&tss64);
-    ( (TSS_LDT_ENTRY_STRUCT*) &((GDT_ENTRY_STRUCT*)MinimalGDT)[3] )->BaseAddress2 = (uint8_t)((uint64_t)&tss64 >> 16);
-    ( (TSS_LDT_ENTRY_STRUCT*) &((GDT_ENTRY_STRUCT*)MinimalGDT)[3] )->BaseAddress3 = (uint8_t)((uint64_t)&tss64 >> 24);
-    ( (TSS_LDT_ENTRY_STRUCT*) &((GDT_ENTRY_STRUCT*)MinimalGDT)[3] )->BaseAddress4 = (uint32_t)((uint64_t)&tss64 >> 32); // TSS is a double-sized entry
-
-    asm volatile("lgdt %[src]"
-        : // Outputs
-        : [src] "m" (dgtData) // Inputs
-        : // Clobbers
-    );
-
-    uint16_t reg2 = 0x18;
-    asm volatile("ltr %[src]"
-        : // Outputs
-        : [src] "m" (reg2) // Inputs
-        : // Clobbers
-    );
-
-    asm volatile("mov $16, %ax \n\t" // Data segment index
-               "mov %ax, %ds \n\t"
-               "mov %ax, %es \n\t"
-               "mov %ax, %fs \n\t"
-               "mov %ax, %gs \n\t"
-               "mov %ax, %ss \n\t"
-               "movq $8, %rdx \n\t" // 64-bit code segment index
-               // Store RIP offSet, pointing to right after 'lretq'
-               "leaq 4(%rip), %rax \n\t" // This is hardcoded to the size of the rest of this little ASM block. %rip points to the next instruction, +4 bytes puts it right after 'lretq'
-               "pushq %rdx \n\t"
-               "pushq %rax \n\t"
-               "lretq \n\t" // NOTE: lretq and retfq are the same. lretq is supported by both GCC and Clang, while retfq works only with GCC. Either way, opcode is 0x48CB.
-               // The address loaded into %rax points here (right after 'lretq'), so execution returns to this point without breaking compiler compatibility
-    );
-
-
-    DT_STRUCT idtEntry = {0};
-
     idtEntry.Limit = sizeof(IDT_data) - 1;
     idtEntry.BaseAddress = (uint64_t)IDT_data;
 
-    *(uint64_t*)(&tss64.IST1) = (uint64_t)(NMI_stack + (1 << 12));
-    *(uint64_t*)(&tss64.IST2) = (uint64_t)(DF_stack + (1 << 12));
-    *(uint64_t*)(&tss64.IST3) = (uint64_t)(MC_stack + (1 << 12));
-    *(uint64_t*)(&tss64.IST4) = (uint64_t)(BP_stack + (1 << 12));
-
     //
     // Predefined System Interrupts and Exceptions
     //
@@ -392,7 +347,61 @@ void InitializeISR()
     SetInterruptEntry(254, (uint64_t)User_ISR_pusher254);
     SetInterruptEntry(255, (uint64_t)User_ISR_pusher255);
 
+    LoadCPUTables(mainSMPInfo.cpus[0]);
+}
+
+// Loads cpu's GDT and TSS and the shared IDT on the calling CPU, then points GS_BASE at cpu's per-CPU variables. Every CPU runs this once,
+// the boot CPU from InitializeISR() and the rest on their way in from the AP startup code.
+void LoadCPUTables(CPUState * cpu)
+{
+    ARCH_CPU_STATE * arch = PER_CPU_POINTER(cpu->perCPUOffset, cpuTables);
+    uint64_t tssAddress = (uint64_t)&arch->TSS;
+
+    *(uint64_t*)(&arch->TSS.IST1) = (uint64_t)*PER_CPU_POINTER(cpu->perCPUOffset, NMI_stack) + IST_STACK_SIZE;
+    *(uint64_t*)(&arch->TSS.IST2) = (uint64_t)*PER_CPU_POINTER(cpu->perCPUOffset, DF_stack) + IST_STACK_SIZE;
+    *(uint64_t*)(&arch->TSS.IST3) = (uint64_t)*PER_CPU_POINTER(cpu->perCPUOffset, MC_stack) + IST_STACK_SIZE;
+    *(uint64_t*)(&arch->TSS.IST4) = (uint64_t)*PER_CPU_POINTER(cpu->perCPUOffset, BP_stack) + IST_STACK_SIZE;
 
+    CopyMemory(arch->GDT, MinimalGDT, sizeof(MinimalGDT));
+    ( (TSS_LDT_ENTRY_STRUCT*) &arch->GDT[3] )->BaseAddress1 = (uint16_t)tssAddress;
+    ( (TSS_LDT_ENTRY_STRUCT*) &arch->GDT[3] )->BaseAddress2 = (uint8_t)(tssAddress >> 16);
+    ( (TSS_LDT_ENTRY_STRUCT*) &arch->GDT[3] )->BaseAddress3 = (uint8_t)(tssAddress >> 24);
+    ( (TSS_LDT_ENTRY_STRUCT*) &arch->GDT[3] )->BaseAddress4 = (uint32_t)(tssAddress >> 32); // TSS is a double-sized entry
+
+    DT_STRUCT dgtData = {0};
+    dgtData.Limit = sizeof(arch->GDT) - 1;
+    dgtData.BaseAddress = (uint64_t)arch->GDT;
+
+    asm volatile("lgdt %[src]"
+        : // Outputs
+        : [src] "m" (dgtData) // Inputs
+        : // Clobbers
+    );
+
+    uint16_t reg2 = 0x18;
+    asm volatile("ltr %[src]"
+        : // Outputs
+        : [src] "m" (reg2) // Inputs
+        : // Clobbers
+    );
+
+    asm volatile("mov $16, %%ax \n\t" // Data segment index
+               "mov %%ax, %%ds \n\t"
+               "mov %%ax, %%es \n\t"
+               "mov %%ax, %%fs \n\t"
+               "mov %%ax, %%gs \n\t"
+               "mov %%ax, %%ss \n\t"
+               "movq $8, %%rdx \n\t" // 64-bit code segment index
+               // Store RIP offSet, pointing to right after 'lretq'
+               "leaq 4(%%rip), %%rax \n\t" // This is hardcoded to the size of the rest of this little ASM block. %rip points to the next instruction, +4 bytes puts it right after 'lretq'
+               "pushq %%rdx \n\t"
+               "pushq %%rax \n\t"
+               "lretq \n\t" // NOTE: lretq and retfq are the same. lretq is supported by both GCC and Clang, while retfq works only with GCC. Either way, opcode is 0x48CB.
+               // The address loaded into %rax points here (right after 'lretq'), so execution returns to this point without breaking compiler compatibility
+               : // Outputs
+               : // Inputs
+               : "rax", "rdx", "memory" // Clobbers
+    );
 
     asm volatile("lidt %[src]"
         : // Outputs
@@ -400,6 +409,7 @@ void InitializeISR()
         : // Clobbers
     );
 
+    SetCurrentCPU(cpu); // Loading %gs zeroes GS_BASE, so this has to come after
 }
 
 
@@ -490,11 +500,24 @@ static void SetBPInterruptEntry(uint64_t isrNum, uint64_t isrAddr)
 void User_ISR_handler(INTERRUPT_FRAME * i_frame)
 {
     // %rdx: Mask for xcr0 [63:32], %rax: Mask for xcr0 [31:0]
-    asm volatile ("xsave64 %[area]"
-                : // No outputs
-                : "a" (0xE7), "d" (0x00), [area] "m" (user_xsave_space) // Inputs
-                : "memory" // Clobbers
-              );
+    // Without XSAVE, InitializeCPU() leaves the mask at 0 and only the legacy x87/SSE state can be saved.
+    // user_xsave_space is per CPU, so the %gs prefix makes this CPU save into its own copy.
+    if(mainCPUInfo.xsaveMask)
+    {
+        asm volatile ("xsave64 %%gs:%[area]"
+                    : // No outputs
+                    : "a" ((uint32_t)mainCPUInfo.xsaveMask), "d" ((uint32_t)(mainCPUInfo.xsaveMask >> 32)), [area] "m" (user_xsave_space) // Inputs
+                    : "memory" // Clobbers
+                  );
+    }
+    else
+    {
+        asm volatile ("fxsave64 %%gs:%[area]"
+                    : // No outputs
+                    : [area] "m" (user_xsave_space) // Inputs
+                    : "memory" // Clobbers
+                  );
+    }
 
   // OK, since xsave has been called we can now safely use AVX instructions in this interrupt--up until xrstor is called, at any rate.
   // Using an interrupt gate in the IDT means we won't get preempted now, either, which would wreck the xsave area.
@@ -519,9 +542,30 @@ void User_ISR_handler(INTERRUPT_FRAME * i_frame)
     //
 
     default:
-        Abort(0xFFFFFFFFFFFFFFFF);
+        if(i_frame->isr_num >= APIC_FIRST_SYSTEM_VECTOR) // Timer, APIC error, spurious and the masked 8259s
+            HandleLocalAPICInterrupt((uint8_t)i_frame->isr_num);
+        else if(!DispatchDeviceInterrupt((uint8_t)i_frame->isr_num)) // From AllocateInterrupt()
+            Abort(0xFFFFFFFFFFFFFFFF);
       break;
   }
+
+    // Interrupts come back here now, so whatever was interrupted gets its own state back
+    if(mainCPUInfo.xsaveMask)
+    {
+        asm volatile ("xrstor64 %%gs:%[area]"
+                    : // No outputs
+                    : "a" ((uint32_t)mainCPUInfo.xsaveMask), "d" ((uint32_t)(mainCPUInfo.xsaveMask >> 32)), [area] "m" (user_xsave_space) // Inputs
+                    : "memory" // Clobbers
+                  );
+    }
+    else
+    {
+        asm volatile ("fxrstor64 %%gs:%[area]"
+                    : // No outputs
+                    : [area] "m" (user_xsave_space) // Inputs
+                    : "memory" // Clobbers
+                  );
+    }
 }
 
 void CPU_ISR_handler(INTERRUPT_FRAME * i_frame)
@@ -0,0 +1,271 @@
+#include "kernel/kernel.h"
+#include "kernel/acpi.h"
+#include "kernel/clock.h"
+#include "kernel/smp.h"
+#include "apic.h"
+#include "paging.h"
+#include "port.h"
+
+#define CALIBRATION_NANOSECONDS 10000000 // 10 ms, only without TSC-deadline mode
+
+#define APIC_BASE_ENABLE        (1 << 11)
+#define APIC_BASE_X2APIC        (1 << 10)
+
+// Registers, as xAPIC byte offsets from the base address. The x2APIC MSR for each is 0x800 + offset / 16.
+#define APIC_ID                 0x020
+#define APIC_TPR                0x080
+#define APIC_SVR                0x0F0
+#define APIC_ESR                0x280
+#define APIC_ICR_LOW            0x300
+#define APIC_ICR_HIGH           0x310     // xAPIC only; in x2APIC mode the ICR is one 64-bit MSR
+#define APIC_LVT_TIMER          0x320
+#define APIC_LVT_LINT0          0x350
+#define APIC_LVT_ERROR          0x370
+#define APIC_TIMER_INITIAL      0x380
+#define APIC_TIMER_CURRENT      0x390
+#define APIC_TIMER_DIVIDE       0x3E0
+
+#define X2APIC_MSR(reg)         (0x800 + ((reg) >> 4))
+
+#define APIC_SVR_ENABLE         (1 << 8)
+#define APIC_LVT_MASKED         (1 << 16)
+#define APIC_LVT_TSC_DEADLINE   (2 << 17)
+#define APIC_TIMER_DIVIDE_BY_1  0xB
+
+#define PIC1_COMMAND            0x20
+#define PIC1_DATA               0x21
+#define PIC2_COMMAND            0xA0
+#define PIC2_DATA               0xA1
+
+APICInfo mainAPICInfo = {0};
+
+static DEFINE_PER_CPU(uint64_t, timerDeadline);   // What ArmLocalAPICTimer() was last asked for, 0 if nothing is armed
+static DEFINE_PER_CPU(uint64_t, timerInterrupts);
+
+static uint32_t ReadAPIC(uint32_t reg)
+{
+    if(mainAPICInfo.x2apic)
+        return (uint32_t)ReadMSR(X2APIC_MSR(reg));
+
+    return ((volatile uint32_t *)mainAPICInfo.baseAddress)[reg / 4];
+}
+
+static void WriteAPIC(uint32_t reg, uint32_t value)
+{
+    if(mainAPICInfo.x2apic)
+        WriteMSR(X2APIC_MSR(reg), value);
+    else
+        ((volatile uint32_t *)mainAPICInfo.baseAddress)[reg / 4] = value;
+}
+
+// Nothing uses the 8259s, but they're still wired up until masked. They're remapped first so a spurious IRQ 7 or 15 (which masking doesn't
+// stop) comes in on APIC_PIC_VECTOR_BASE and up rather than on top of an exception.
+static void MaskLegacyPIC(void)
+{
+    OutputByte(PIC1_COMMAND, 0x11); // ICW1: initialize, ICW4 follows
+    OutputByte(PIC2_COMMAND, 0x11);
+    OutputByte(PIC1_DATA, APIC_PIC_VECTOR_BASE); // ICW2: vector base
+    OutputByte(PIC2_DATA, APIC_PIC_VECTOR_BASE + 8);
+    OutputByte(PIC1_DATA, 1 << 2); // ICW3: slave on IRQ 2
+    OutputByte(PIC2_DATA, 2);
+    OutputByte(PIC1_DATA, 0x01); // ICW4: 8086 mode
+    OutputByte(PIC2_DATA, 0x01);
+    OutputByte(PIC1_DATA, 0xFF); // Mask everything
+    OutputByte(PIC2_DATA, 0xFF);
+}
+
+static uint64_t CalibrateTimer(void)
+{
+    WriteAPIC(APIC_TIMER_DIVIDE, APIC_TIMER_DIVIDE_BY_1);
+    WriteAPIC(APIC_LVT_TIMER, APIC_LVT_MASKED);
+
+    uint64_t start = GetMonotonicTime();
+    WriteAPIC(APIC_TIMER_INITIAL, 0xFFFFFFFF);
+    WaitNanoseconds(CALIBRATION_NANOSECONDS);
+    uint32_t remaining = ReadAPIC(APIC_TIMER_CURRENT);
+    uint64_t elapsed = GetMonotonicTime() - start;
+    WriteAPIC(APIC_TIMER_INITIAL, 0);
+
+    if(elapsed == 0)
+        return 0;
+
+    return (uint64_t)(((unsigned __int128)(0xFFFFFFFF - remaining) * NANOSECONDS_PER_SECOND) / elapsed);
+}
+
+void InitializeLocalAPIC(void)
+{
+    uint64_t apicBase = ReadMSR(MSR_APIC_BASE);
+
+    if(GetCurrentCPU()->index == 0)
+    {
+        ACPI_MADT * madt = (ACPI_MADT *)GetACPITable(ACPI_TABLE_MADT);
+        if((madt == NULL) || (madt->flags & ACPI_MADT_PCAT_COMPAT))
+            MaskLegacyPIC();
+
+        mainAPICInfo.baseAddress = apicBase & PAGE_ADDRESS_MASK;
+        mainAPICInfo.x2apic = HasCPUFeature(CPU_FEATURE_X2APIC); // MSR accesses skip the uncached MMIO round trip
+        mainAPICInfo.timerMode = HasCPUFeature(CPU_FEATURE_TSC_DEADLINE) ? APIC_TIMER_TSC_DEADLINE : APIC_TIMER_ONE_SHOT;
+
+        // Both modes convert deadlines using the clock, and calibration would wait on it forever
+        if(mainClockSource.frequency == 0)
+            mainAPICInfo.timerMode = APIC_TIMER_NONE;
+    }
+
+    // Going from xAPIC to x2APIC mode can be done in one write, as long as the APIC ends up enabled
+    apicBase |= APIC_BASE_ENABLE;
+    if(mainAPICInfo.x2apic)
+        apicBase |= APIC_BASE_X2APIC;
+    WriteMSR(MSR_APIC_BASE, apicBase);
+
+    WriteAPIC(APIC_TPR, 0); // Accept every priority
+    WriteAPIC(APIC_LVT_LINT0, APIC_LVT_MASKED); // ExtINT from the 8259s
+    WriteAPIC(APIC_LVT_ERROR, APIC_ERROR_VECTOR);
+    WriteAPIC(APIC_ESR, 0); // Clears anything the firmware left behind
+    WriteAPIC(APIC_SVR, APIC_SVR_ENABLE | APIC_SPURIOUS_VECTOR);
+
+    if((GetCurrentCPU()->index == 0) && (mainAPICInfo.timerMode == APIC_TIMER_ONE_SHOT))
+    {
+        mainAPICInfo.timerFrequency = CalibrateTimer();
+        if(mainAPICInfo.timerFrequency == 0)
+            mainAPICInfo.timerMode = APIC_TIMER_NONE;
+    }
+
+    if(mainAPICInfo.timerMode == APIC_TIMER_TSC_DEADLINE)
+    {
+        WriteAPIC(APIC_LVT_TIMER, APIC_LVT_TSC_DEADLINE | APIC_TIMER_VECTOR);
+        asm volatile("mfence" : : : "memory"); // The switch to TSC-deadline mode has to land before IA32_TSC_DEADLINE is written
+    }
+    else if(mainAPICInfo.timerMode == APIC_TIMER_ONE_SHOT)
+    {
+        WriteAPIC(APIC_TIMER_DIVIDE, APIC_TIMER_DIVIDE_BY_1);
+        WriteAPIC(APIC_LVT_TIMER, APIC_TIMER_VECTOR); // One-shot
+    }
+    else
+        WriteAPIC(APIC_LVT_TIMER, APIC_LVT_MASKED);
+}
+
+uint32_t GetLocalAPICId(void)
+{
+    if(mainAPICInfo.x2apic)
+        return ReadAPIC(APIC_ID);
+
+    return ReadAPIC(APIC_ID) >> 24;
+}
+
+void SendAPICCommand(uint32_t apicId, uint32_t command)
+{
+    if(mainAPICInfo.x2apic)
+    {
+        // Writes to x2APIC MSRs aren't serializing, so make sure the target can see everything written before it gets the IPI
+        asm volatile("mfence" : : : "memory");
+        WriteMSR(X2APIC_MSR(APIC_ICR_LOW), ((uint64_t)apicId << 32) | command);
+        return;
+    }
+
+    WriteAPIC(APIC_ICR_HIGH, apicId << 24);
+    WriteAPIC(APIC_ICR_LOW, command);
+    while(ReadAPIC(APIC_ICR_LOW) & APIC_ICR_DELIVERY_PENDING);
+}
+
+void ArmLocalAPICTimer(uint64_t deadline)
+{
+    if(mainAPICInfo.timerMode == APIC_TIMER_NONE)
+        return;
+
+    THIS_CPU(timerDeadline) = deadline;
+
+    if(mainAPICInfo.timerMode == APIC_TIMER_TSC_DEADLINE)
+    {
+        // Time is the TSC scaled to nanoseconds, so the deadline only needs scaling back. Rounding up keeps it from firing early; 0 would disarm.
+        uint64_t ticks = (uint64_t)(((unsigned __int128)deadline * mainClockSource.frequency) / NANOSECONDS_PER_SECOND) + 1;
+        WriteMSR(MSR_TSC_DEADLINE, ticks);
+        return;
+    }
+
+    uint64_t now = GetMonotonicTime();
+    uint64_t count = 1;
+    if(deadline > now)
+        count = (uint64_t)(((unsigned __int128)(deadline - now) * mainAPICInfo.timerFrequency) / NANOSECONDS_PER_SECOND) + 1;
+    if(count > 0xFFFFFFFF)
+        count = 0xFFFFFFFF; // HandleLocalAPICInterrupt() goes again for the rest
+
+    WriteAPIC(APIC_TIMER_INITIAL, (uint32_t)count);
+}
+
+void DisarmLocalAPICTimer(void)
+{
+    THIS_CPU(timerDeadline) = 0;
+
+    if(mainAPICInfo.timerMode == APIC_TIMER_TSC_DEADLINE)
+        WriteMSR(MSR_TSC_DEADLINE, 0);
+    else if(mainAPICInfo.timerMode == APIC_TIMER_ONE_SHOT)
+        WriteAPIC(APIC_TIMER_INITIAL, 0);
+}
+
+void SleepUntil(uint64_t deadline)
+{
+    if(mainAPICInfo.timerMode == APIC_TIMER_NONE)
+        return; // Nothing would wake it, and time doesn't move anyway
+
+    uint64_t flags;
+    asm volatile("pushfq\n"
+                 "popq %[flags]"
+        : [flags] "=r" (flags) // Outputs
+        : // Inputs
+        : // Clobbers
+    );
+
+    ArmLocalAPICTimer(deadline);
+    while(GetMonotonicTime() < deadline)
+        asm volatile("sti\n" // hlt is in sti's interrupt shadow, so a timer interrupt that's already pending still wakes it
+                     "hlt\n"
+                     "cli" : : : "memory");
+
+    if(flags & (1 << 9)) // IF
+        asm volatile("sti");
+}
+
+void HandleLocalAPICInterrupt(uint8_t vector)
+{
+    if(vector < APIC_TIMER_VECTOR)
+        return; // Spurious IRQ 7/15 from the 8259s; there's nothing to acknowledge
+
+    switch(vector)
+    {
+        case APIC_TIMER_VECTOR:
+            THIS_CPU(timerInterrupts)++;
+            // One-shot mode can run out of count before a far off deadline, and rounding can leave either mode a little short
+            if(THIS_CPU(timerDeadline) > GetMonotonicTime())
+                ArmLocalAPICTimer(THIS_CPU(timerDeadline));
+            else
+                THIS_CPU(timerDeadline) = 0;
+            break;
+
+        case APIC_ERROR_VECTOR:
+            WriteAPIC(APIC_ESR, 0); // Latches the errors so they can be read
+            LogMessage(LOG_LEVEL_WARNING, "APIC %u: error 0x%x\n", GetLocalAPICId(), ReadAPIC(APIC_ESR));
+            break;
+
+        case APIC_SPURIOUS_VECTOR:
+            return; // Not a real interrupt, so no EOI
+
+        default:
+            break;
+    }
+
+    SignalEndOfInterrupt();
+}
+
+#ifdef DEBUG_PIOUS
+void PrintAPICInfo(void)
+{
+    LogMessage(LOG_LEVEL_DEBUG, "Local APIC: %s, ID %u, timer: ", mainAPICInfo.x2apic ? "x2APIC" : "xAPIC", GetLocalAPICId());
+    if(mainAPICInfo.timerMode == APIC_TIMER_TSC_DEADLINE)
+        LogMessage(LOG_LEVEL_DEBUG, "TSC-deadline\n");
+    else if(mainAPICInfo.timerMode == APIC_TIMER_NONE)
+        LogMessage(LOG_LEVEL_DEBUG, "off (no clock)\n");
+    else
+        LogMessage(LOG_LEVEL_DEBUG, "one-shot at %lu.%06lu MHz\n", mainAPICInfo.timerFrequency / 1000000, mainAPICInfo.timerFrequency % 1000000);
+    DrainLog();
+}
+#endif
@@ -0,0 +1,67 @@
+#ifndef _APIC_H
+#define _APIC_H 1
+
+#include "kernel/kernel.h"
+
+// Vectors the kernel keeps for itself; everything from 32 up to APIC_FIRST_SYSTEM_VECTOR is free for devices
+#define APIC_FIRST_SYSTEM_VECTOR 0xE0
+#define APIC_PIC_VECTOR_BASE     0xE0 // 0xE0-0xEF: where the masked 8259s would send IRQs 0-15, so their spurious IRQ 7/15 are harmless
+#define APIC_TIMER_VECTOR        0xF0
+#define APIC_ERROR_VECTOR        0xFE
+#define APIC_SPURIOUS_VECTOR     0xFF // Low 4 bits must be set for the P6 family
+
+// Interrupt Command Register values for SendAPICCommand()
+#define APIC_ICR_FIXED           0x00000 // | vector
+#define APIC_ICR_NMI             0x00400
+#define APIC_ICR_INIT            0x04500 // INIT, level assert
+#define APIC_ICR_STARTUP         0x04600 // SIPI, level assert; | the page the AP starts at
+#define APIC_ICR_DELIVERY_PENDING (1 << 12)
+
+#define X2APIC_EOI_MSR           0x80B
+#define XAPIC_EOI                0x0B0
+
+#define APIC_TIMER_TSC_DEADLINE  0
+#define APIC_TIMER_ONE_SHOT      1
+#define APIC_TIMER_NONE          2 // No calibrated clock to convert deadlines with; the timer stays masked
+
+typedef struct APICInfo {
+    bool         x2apic;         // Registers are MSRs instead of MMIO
+    uint8_t      timerMode;      // APIC_TIMER_*
+    uint8_t      pad[6];         // Pad to multiple of 64 bits
+    uint64_t     baseAddress;    // xAPIC MMIO registers
+    uint64_t     timerFrequency; // One-shot mode: APIC timer ticks per second (TSC-deadline mode counts in TSC ticks)
+} APICInfo;
+
+extern APICInfo mainAPICInfo;
+
+// Once on every CPU, the boot CPU first. Switches to x2APIC mode if the CPU has it, masks the 8259 PICs (boot CPU only) and enables the
+// local APIC with everything but the error interrupt masked.
+void InitializeLocalAPIC(void);
+uint32_t GetLocalAPICId(void);
+void SendAPICCommand(uint32_t apicId, uint32_t command);
+
+// One-shot wakeup at deadline, in GetMonotonicTime() nanoseconds (a deadline that's already passed fires straight away). Only one can be
+// armed per CPU; arming again replaces it. Does nothing with APIC_TIMER_NONE.
+void ArmLocalAPICTimer(uint64_t deadline);
+void DisarmLocalAPICTimer(void);
+
+// Halts with interrupts on until GetMonotonicTime() reaches deadline; returns straight away with APIC_TIMER_NONE
+void SleepUntil(uint64_t deadline);
+
+// Called from User_ISR_handler for vectors from APIC_FIRST_SYSTEM_VECTOR up
+void HandleLocalAPICInterrupt(uint8_t vector);
+
+#ifdef DEBUG_PIOUS
+void PrintAPICInfo(void);
+#endif
+
+// Every interrupt handler finishes with this, so it's kept to one register write
+static inline void SignalEndOfInterrupt(void)
+{
+    if(mainAPICInfo.x2apic)
+        WriteMSR(X2APIC_EOI_MSR, 0);
+    else
+        *(volatile uint32_t *)(mainAPICInfo.baseAddress + XAPIC_EOI) = 0;
+}
+
+#endif
@@ -0,0 +1,90 @@
+#include "kernel/kernel.h"
+#include "kernel/clock.h"
+#include "kernel/acpi.h"
+#include "port.h"
+
+#define CALIBRATION_NANOSECONDS 10000000 // 10 ms
+
+// HPET registers, as byte offsets from its base address
+#define HPET_CAPABILITIES       0x000
+#define HPET_CONFIGURATION      0x010
+#define HPET_MAIN_COUNTER       0x0F0
+
+#define HPET_CAPABILITY_64BIT   (1 << 13)
+#define HPET_ENABLE             (1 << 0)
+#define HPET_MAX_PERIOD         100000000 // Femtoseconds (100 ns); anything longer isn't a real HPET
+
+#define PIT_FREQUENCY           1193182
+#define PIT_CHANNEL2            0x42
+#define PIT_COMMAND             0x43
+#define PIT_GATE                0x61      // Bit 0: channel 2 gate, bit 1: speaker, bit 5: channel 2 output
+
+static uint64_t CalibrateWithHPET(uint64_t baseAddress)
+{
+    volatile uint64_t * registers = (volatile uint64_t *)baseAddress;
+    uint64_t capabilities = registers[HPET_CAPABILITIES / 8];
+    uint64_t period = capabilities >> 32; // Femtoseconds per tick
+    uint64_t mask = (capabilities & HPET_CAPABILITY_64BIT) ? ~0ULL : 0xFFFFFFFF;
+
+    if((period == 0) || (period > HPET_MAX_PERIOD))
+        return 0;
+
+    registers[HPET_CONFIGURATION / 8] |= HPET_ENABLE;
+
+    uint64_t ticks = (CALIBRATION_NANOSECONDS * 1000000ULL) / period;
+    uint64_t hpetStart = registers[HPET_MAIN_COUNTER / 8];
+    uint64_t tscStart = ReadCycleCounter();
+    uint64_t hpetElapsed;
+
+    do
+    {
+        hpetElapsed = (registers[HPET_MAIN_COUNTER / 8] - hpetStart) & mask;
+    } while(hpetElapsed < ticks);
+
+    uint64_t tscElapsed = ReadCycleCounter() - tscStart;
+
+    // TSC ticks / (HPET ticks * femtoseconds per tick / 10^15)
+    return (uint64_t)(((unsigned __int128)tscElapsed * 1000000000000000ULL) / (hpetElapsed * period));
+}
+
+// Counts TSC ticks while PIT channel 2 counts down once, in mode 0 (the output goes high at 0)
+static uint64_t CalibrateWithPIT(void)
+{
+    uint16_t latch = (PIT_FREQUENCY * (uint64_t)CALIBRATION_NANOSECONDS) / NANOSECONDS_PER_SECOND;
+
+    OutputByte(PIT_GATE, (InputByte(PIT_GATE) & ~0x02) | 0x01); // Gate on, speaker off
+    OutputByte(PIT_COMMAND, 0xB0); // Channel 2, low then high byte, mode 0
+    OutputByte(PIT_CHANNEL2, latch & 0xFF);
+    OutputByte(PIT_CHANNEL2, latch >> 8);
+
+    uint64_t tscStart = ReadCycleCounter();
+    while(!(InputByte(PIT_GATE) & 0x20));
+    uint64_t tscElapsed = ReadCycleCounter() - tscStart;
+
+    return (tscElapsed * PIT_FREQUENCY) / latch;
+}
+
+void InitializeClock(void)
+{
+    if(!HasCPUFeature(CPU_FEATURE_INVARIANT_TSC))
+        LogMessage(LOG_LEVEL_WARNING, "The TSC isn't invariant, so time will drift if the CPU changes speed\n");
+
+    if(mainCPUInfo.counterFrequency)
+    {
+        SetClockFrequency("CPUID", mainCPUInfo.counterFrequency);
+        return;
+    }
+
+    ACPI_HPET * hpet = (ACPI_HPET *)GetACPITable(ACPI_TABLE_HPET);
+    if(hpet && (hpet->baseAddress.addressSpace == 0))
+    {
+        uint64_t frequency = CalibrateWithHPET(hpet->baseAddress.address);
+        if(frequency)
+        {
+            SetClockFrequency("HPET", frequency);
+            return;
+        }
+    }
+
+    SetClockFrequency("PIT", CalibrateWithPIT());
+}
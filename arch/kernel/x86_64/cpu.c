@@ -0,0 +1,615 @@
+#include "kernel/kernel.h"
+#include "kernel/cpu.h"
+#include "kernel/graphics.h"
+
+#define FAST_STRINGS_THRESHOLD 256 // With just ERMS, rep movsb has a startup cost that only pays off past this
+#define XSAVE_STATE_MASK       0xE7 // x87, SSE, AVX, AVX-512 opmask/ZMM_Hi256/Hi16_ZMM
+
+typedef uint32_t Vector16 __attribute__((vector_size(16))); // Lets an XMM register be passed into inline asm
+
+
+static void CopyMemorySSE2(void * dest, const void * src, uint64_t length);
+static void SetMemorySSE2(void * dest, uint8_t value, uint64_t length);
+static int16_t CompareMemorySSE2(const void * addr1, const void * addr2, uint64_t length);
+static void FillMemory32SSE2(uint32_t * dest, uint32_t value, uint64_t count);
+static void StreamMemorySSE2(void * dest, const void * src, uint64_t length);
+static uint8_t Checksum8SSE2(const void * data, uint64_t length);
+
+CPUInfo mainCPUInfo = {0};
+
+// SSE2 is part of x86_64, so these run anywhere
+CPURoutines mainCPURoutines = {
+    CopyMemorySSE2,
+    SetMemorySSE2,
+    CompareMemorySSE2,
+    FillMemory32SSE2,
+    StreamMemorySSE2,
+    Checksum8SSE2
+};
+
+
+static void CPUID(uint32_t leaf, uint32_t subleaf, uint32_t * eax, uint32_t * ebx, uint32_t * ecx, uint32_t * edx)
+{
+    asm volatile("cpuid"
+        : "=a" (*eax), "=b" (*ebx), "=c" (*ecx), "=d" (*edx) // Outputs
+        : "a" (leaf), "c" (subleaf) // Inputs
+        : // Clobbers
+    );
+}
+
+//
+// Memory copies
+//
+
+static void CopyMemorySSE2(void * dest, const void * src, uint64_t length)
+{
+    while(length >= 64)
+    {
+        asm volatile("movdqu (%[src]), %%xmm0\n"
+                     "movdqu 16(%[src]), %%xmm1\n"
+                     "movdqu 32(%[src]), %%xmm2\n"
+                     "movdqu 48(%[src]), %%xmm3\n"
+                     "movdqu %%xmm0, (%[dest])\n"
+                     "movdqu %%xmm1, 16(%[dest])\n"
+                     "movdqu %%xmm2, 32(%[dest])\n"
+                     "movdqu %%xmm3, 48(%[dest])"
+            : // Outputs
+            : [dest] "r" (dest), [src] "r" (src) // Inputs
+            : "xmm0", "xmm1", "xmm2", "xmm3", "memory" // Clobbers
+        );
+        dest += 64;
+        src += 64;
+        length -= 64;
+    }
+
+    while(length >= 16)
+    {
+        asm volatile("movdqu (%[src]), %%xmm0\n"
+                     "movdqu %%xmm0, (%[dest])"
+            : // Outputs
+            : [dest] "r" (dest), [src] "r" (src) // Inputs
+            : "xmm0", "memory" // Clobbers
+        );
+        dest += 16;
+        src += 16;
+        length -= 16;
+    }
+
+    // Tail (a plain C loop here could be turned back into a call to memcpy by the compiler)
+    asm volatile("rep movsb"
+        : "+D" (dest), "+S" (src), "+c" (length) // Outputs
+        : // Inputs
+        : "memory" // Clobbers
+    );
+}
+
+static void CopyMemoryAVX2(void * dest, const void * src, uint64_t length)
+{
+    while(length >= 128)
+    {
+        asm volatile("vmovdqu (%[src]), %%ymm0\n"
+                     "vmovdqu 32(%[src]), %%ymm1\n"
+                     "vmovdqu 64(%[src]), %%ymm2\n"
+                     "vmovdqu 96(%[src]), %%ymm3\n"
+                     "vmovdqu %%ymm0, (%[dest])\n"
+                     "vmovdqu %%ymm1, 32(%[dest])\n"
+                     "vmovdqu %%ymm2, 64(%[dest])\n"
+                     "vmovdqu %%ymm3, 96(%[dest])"
+            : // Outputs
+            : [dest] "r" (dest), [src] "r" (src) // Inputs
+            : "xmm0", "xmm1", "xmm2", "xmm3", "memory" // Clobbers
+        );
+        dest += 128;
+        src += 128;
+        length -= 128;
+    }
+    asm volatile("vzeroupper" ::: "memory"); // Avoid the SSE/AVX transition penalty in the code that follows
+
+    CopyMemorySSE2(dest, src, length);
+}
+
+static void CopyMemoryERMS(void * dest, const void * src, uint64_t length)
+{
+    if(length < FAST_STRINGS_THRESHOLD)
+    {
+        CopyMemorySSE2(dest, src, length);
+        return;
+    }
+
+    asm volatile("rep movsb"
+        : "+D" (dest), "+S" (src), "+c" (length) // Outputs
+        : // Inputs
+        : "memory" // Clobbers
+    );
+}
+
+static void CopyMemoryFSRM(void * dest, const void * src, uint64_t length)
+{
+    asm volatile("rep movsb"
+        : "+D" (dest), "+S" (src), "+c" (length) // Outputs
+        : // Inputs
+        : "memory" // Clobbers
+    );
+}
+
+// movntdq/vmovntdq need an aligned destination, so the head is copied normally
+static void StreamMemorySSE2(void * dest, const void * src, uint64_t length)
+{
+    uint64_t head = (-(uint64_t)dest) & 15;
+    if(head > length)
+        head = length;
+
+    CopyMemorySSE2(dest, src, head);
+    dest += head;
+    src += head;
+    length -= head;
+
+    while(length >= 64)
+    {
+        asm volatile("movdqu (%[src]), %%xmm0\n"
+                     "movdqu 16(%[src]), %%xmm1\n"
+                     "movdqu 32(%[src]), %%xmm2\n"
+                     "movdqu 48(%[src]), %%xmm3\n"
+                     "movntdq %%xmm0, (%[dest])\n"
+                     "movntdq %%xmm1, 16(%[dest])\n"
+                     "movntdq %%xmm2, 32(%[dest])\n"
+                     "movntdq %%xmm3, 48(%[dest])"
+            : // Outputs
+            : [dest] "r" (dest), [src] "r" (src) // Inputs
+            : "xmm0", "xmm1", "xmm2", "xmm3", "memory" // Clobbers
+        );
+        dest += 64;
+        src += 64;
+        length -= 64;
+    }
+    asm volatile("sfence" ::: "memory"); // Non-temporal stores are weakly ordered
+
+    CopyMemorySSE2(dest, src, length);
+}
+
+static void StreamMemoryAVX2(void * dest, const void * src, uint64_t length)
+{
+    uint64_t head = (-(uint64_t)dest) & 31;
+    if(head > length)
+        head = length;
+
+    CopyMemorySSE2(dest, src, head);
+    dest += head;
+    src += head;
+    length -= head;
+
+    while(length >= 128)
+    {
+        asm volatile("vmovdqu (%[src]), %%ymm0\n"
+                     "vmovdqu 32(%[src]), %%ymm1\n"
+                     "vmovdqu 64(%[src]), %%ymm2\n"
+                     "vmovdqu 96(%[src]), %%ymm3\n"
+                     "vmovntdq %%ymm0, (%[dest])\n"
+                     "vmovntdq %%ymm1, 32(%[dest])\n"
+                     "vmovntdq %%ymm2, 64(%[dest])\n"
+                     "vmovntdq %%ymm3, 96(%[dest])"
+            : // Outputs
+            : [dest] "r" (dest), [src] "r" (src) // Inputs
+            : "xmm0", "xmm1", "xmm2", "xmm3", "memory" // Clobbers
+        );
+        dest += 128;
+        src += 128;
+        length -= 128;
+    }
+    asm volatile("vzeroupper\n"
+                 "sfence" ::: "memory");
+
+    CopyMemorySSE2(dest, src, length);
+}
+
+//
+// Memory fills
+//
+
+static void SetMemorySSE2(void * dest, uint8_t value, uint64_t length)
+{
+    Vector16 pattern = {value * 0x01010101U, value * 0x01010101U, value * 0x01010101U, value * 0x01010101U};
+
+    while(length >= 64)
+    {
+        asm volatile("movdqu %[pattern], (%[dest])\n"
+                     "movdqu %[pattern], 16(%[dest])\n"
+                     "movdqu %[pattern], 32(%[dest])\n"
+                     "movdqu %[pattern], 48(%[dest])"
+            : // Outputs
+            : [dest] "r" (dest), [pattern] "x" (pattern) // Inputs
+            : "memory" // Clobbers
+        );
+        dest += 64;
+        length -= 64;
+    }
+
+    while(length >= 16)
+    {
+        asm volatile("movdqu %[pattern], (%[dest])"
+            : // Outputs
+            : [dest] "r" (dest), [pattern] "x" (pattern) // Inputs
+            : "memory" // Clobbers
+        );
+        dest += 16;
+        length -= 16;
+    }
+
+    asm volatile("rep stosb"
+        : "+D" (dest), "+c" (length) // Outputs
+        : "a" (value) // Inputs
+        : "memory" // Clobbers
+    );
+}
+
+static void SetMemoryERMS(void * dest, uint8_t value, uint64_t length)
+{
+    if(length < FAST_STRINGS_THRESHOLD)
+    {
+        SetMemorySSE2(dest, value, length);
+        return;
+    }
+
+    asm volatile("rep stosb"
+        : "+D" (dest), "+c" (length) // Outputs
+        : "a" (value) // Inputs
+        : "memory" // Clobbers
+    );
+}
+
+static void SetMemoryFSRM(void * dest, uint8_t value, uint64_t length)
+{
+    asm volatile("rep stosb"
+        : "+D" (dest), "+c" (length) // Outputs
+        : "a" (value) // Inputs
+        : "memory" // Clobbers
+    );
+}
+
+static void FillMemory32SSE2(uint32_t * dest, uint32_t value, uint64_t count)
+{
+    if(count >= 4)
+    {
+        asm volatile("movd %[value], %%xmm0\n"
+                     "pshufd $0, %%xmm0, %%xmm0\n"
+                     "1:\n"
+                     "movdqu %%xmm0, (%[dest])\n"
+                     "add $16, %[dest]\n"
+                     "sub $4, %[count]\n"
+                     "cmp $4, %[count]\n"
+                     "jae 1b"
+            : [dest] "+r" (dest), [count] "+r" (count) // Outputs
+            : [value] "r" (value) // Inputs
+            : "xmm0", "memory", "cc" // Clobbers
+        );
+    }
+
+    asm volatile("rep stosl"
+        : "+D" (dest), "+c" (count) // Outputs
+        : "a" (value) // Inputs
+        : "memory" // Clobbers
+    );
+}
+
+static void FillMemory32AVX2(uint32_t * dest, uint32_t value, uint64_t count)
+{
+    if(count >= 8)
+    {
+        asm volatile("vmovd %[value], %%xmm0\n"
+                     "vpbroadcastd %%xmm0, %%ymm0\n"
+                     "1:\n"
+                     "vmovdqu %%ymm0, (%[dest])\n"
+                     "add $32, %[dest]\n"
+                     "sub $8, %[count]\n"
+                     "cmp $8, %[count]\n"
+                     "jae 1b\n"
+                     "vzeroupper"
+            : [dest] "+r" (dest), [count] "+r" (count) // Outputs
+            : [value] "r" (value) // Inputs
+            : "xmm0", "memory", "cc" // Clobbers
+        );
+    }
+
+    asm volatile("rep stosl"
+        : "+D" (dest), "+c" (count) // Outputs
+        : "a" (value) // Inputs
+        : "memory" // Clobbers
+    );
+}
+
+//
+// Comparisons and checksums
+//
+
+static int16_t CompareMemorySSE2(const void * addr1, const void * addr2, uint64_t length)
+{
+    const uint8_t * p1 = addr1;
+    const uint8_t * p2 = addr2;
+    uint32_t mask;
+
+    while(length >= 16)
+    {
+        // mask gets one bit per equal byte
+        asm volatile("movdqu (%[a]), %%xmm0\n"
+                     "movdqu (%[b]), %%xmm1\n"
+                     "pcmpeqb %%xmm1, %%xmm0\n"
+                     "pmovmskb %%xmm0, %[mask]"
+            : [mask] "=r" (mask) // Outputs
+            : [a] "r" (p1), [b] "r" (p2) // Inputs
+            : "xmm0", "xmm1", "memory" // Clobbers
+        );
+
+        if(mask != 0xFFFF)
+        {
+            uint32_t i = __builtin_ctz(~mask);
+            return p2[i] - p1[i];
+        }
+
+        p1 += 16;
+        p2 += 16;
+        length -= 16;
+    }
+
+    for(; length > 0; length--, p1++, p2++)
+    {
+        if(*p1 != *p2)
+            return *p2 - *p1;
+    }
+    return 0;
+}
+
+static int16_t CompareMemoryAVX2(const void * addr1, const void * addr2, uint64_t length)
+{
+    const uint8_t * p1 = addr1;
+    const uint8_t * p2 = addr2;
+    uint32_t mask;
+
+    while(length >= 32)
+    {
+        asm volatile("vmovdqu (%[a]), %%ymm0\n"
+                     "vpcmpeqb (%[b]), %%ymm0, %%ymm0\n"
+                     "vpmovmskb %%ymm0, %[mask]\n"
+                     "vzeroupper"
+            : [mask] "=r" (mask) // Outputs
+            : [a] "r" (p1), [b] "r" (p2) // Inputs
+            : "xmm0", "memory" // Clobbers
+        );
+
+        if(mask != 0xFFFFFFFF)
+        {
+            uint32_t i = __builtin_ctz(~mask);
+            return p2[i] - p1[i];
+        }
+
+        p1 += 32;
+        p2 += 32;
+        length -= 32;
+    }
+
+    return CompareMemorySSE2(p1, p2, length);
+}
+
+static uint8_t Checksum8SSE2(const void * data, uint64_t length)
+{
+    const uint8_t * p = data;
+    uint64_t sum = 0;
+
+    // psadbw against zero adds up each group of 8 bytes
+    if(length >= 16)
+    {
+        asm volatile("pxor %%xmm1, %%xmm1\n"
+                     "pxor %%xmm2, %%xmm2\n"
+                     "1:\n"
+                     "movdqu (%[p]), %%xmm0\n"
+                     "psadbw %%xmm1, %%xmm0\n"
+                     "paddq %%xmm0, %%xmm2\n"
+                     "add $16, %[p]\n"
+                     "sub $16, %[length]\n"
+                     "cmp $16, %[length]\n"
+                     "jae 1b\n"
+                     "pshufd $0x4E, %%xmm2, %%xmm0\n" // Swap the two halves
+                     "paddq %%xmm2, %%xmm0\n"
+                     "movq %%xmm0, %[sum]"
+            : [p] "+r" (p), [length] "+r" (length), [sum] "=r" (sum) // Outputs
+            : // Inputs
+            : "xmm0", "xmm1", "xmm2", "memory", "cc" // Clobbers
+        );
+    }
+
+    for(; length > 0; length--)
+        sum += *p++;
+
+    return (uint8_t)sum;
+}
+
+static uint8_t Checksum8AVX2(const void * data, uint64_t length)
+{
+    const uint8_t * p = data;
+    uint64_t sum = 0;
+
+    if(length >= 32)
+    {
+        asm volatile("vpxor %%ymm1, %%ymm1, %%ymm1\n"
+                     "vpxor %%ymm2, %%ymm2, %%ymm2\n"
+                     "1:\n"
+                     "vpsadbw (%[p]), %%ymm1, %%ymm0\n"
+                     "vpaddq %%ymm0, %%ymm2, %%ymm2\n"
+                     "add $32, %[p]\n"
+                     "sub $32, %[length]\n"
+                     "cmp $32, %[length]\n"
+                     "jae 1b\n"
+                     "vextracti128 $1, %%ymm2, %%xmm0\n"
+                     "vpaddq %%xmm2, %%xmm0, %%xmm0\n"
+                     "vpshufd $0x4E, %%xmm0, %%xmm1\n"
+                     "vpaddq %%xmm1, %%xmm0, %%xmm0\n"
+                     "vmovq %%xmm0, %[sum]\n"
+                     "vzeroupper"
+            : [p] "+r" (p), [length] "+r" (length), [sum] "=r" (sum) // Outputs
+            : // Inputs
+            : "xmm0", "xmm1", "xmm2", "memory", "cc" // Clobbers
+        );
+    }
+
+    return (uint8_t)(sum + Checksum8SSE2(p, length));
+}
+
+//
+// Detection
+//
+
+// Turns on XSAVE with every user state the kernel knows how to handle, so AVX code can run and the ISRs can save it
+static void EnableXSAVE(void)
+{
+    uint32_t eax, ebx, ecx, edx;
+    uint64_t reg;
+
+    asm volatile("mov %%cr4, %[dest]"
+        : [dest] "=r" (reg) // Outputs
+        : // Inputs
+        : // Clobbers
+    );
+    reg |= 1 << 18; // CR4.OSXSAVE
+    asm volatile("mov %[src], %%cr4"
+        : // Outputs
+        : [src] "r" (reg) // Inputs
+        : // Clobbers
+    );
+
+    CPUID(0xD, 0, &eax, &ebx, &ecx, &edx); // EDX:EAX = states this CPU supports
+    uint64_t xcr0 = (((uint64_t)edx << 32) | eax) & XSAVE_STATE_MASK;
+
+    asm volatile("xsetbv"
+        : // Outputs
+        : "a" ((uint32_t)xcr0), "d" ((uint32_t)(xcr0 >> 32)), "c" (0) // Inputs
+        : // Clobbers
+    );
+
+    CPUID(0xD, 0, &eax, &ebx, &ecx, &edx); // EBX = XSAVE area size for what XCR0 now enables
+    mainCPUInfo.xsaveMask = xcr0;
+    mainCPUInfo.xsaveSize = ebx;
+}
+
+void InitializeCPU(void)
+{
+    uint32_t eax, ebx, ecx, edx;
+    uint32_t maxLeaf, maxExtendedLeaf;
+    uint64_t features = 0;
+
+    CPUID(0, 0, &maxLeaf, &ebx, &ecx, &edx);
+    *(uint32_t *)&mainCPUInfo.vendor[0] = ebx;
+    *(uint32_t *)&mainCPUInfo.vendor[4] = edx;
+    *(uint32_t *)&mainCPUInfo.vendor[8] = ecx;
+    mainCPUInfo.vendor[12] = '\0';
+
+    CPUID(1, 0, &eax, &ebx, &ecx, &edx);
+    mainCPUInfo.cacheLineSize = ((ebx >> 8) & 0xFF) * 8;
+
+    if(ecx & (1 << 0))
+        features |= CPU_FEATURE_SSE3;
+    if(ecx & (1 << 9))
+        features |= CPU_FEATURE_SSSE3;
+    if(ecx & (1 << 19))
+        features |= CPU_FEATURE_SSE41;
+    if(ecx & (1 << 20))
+        features |= CPU_FEATURE_SSE42;
+    if(ecx & (1 << 21))
+        features |= CPU_FEATURE_X2APIC;
+    if(ecx & (1 << 23))
+        features |= CPU_FEATURE_POPCNT;
+    if(ecx & (1 << 24))
+        features |= CPU_FEATURE_TSC_DEADLINE;
+
+    uint8_t hasAVX = (ecx >> 28) & 1;
+
+    if(ecx & (1 << 26))
+    {
+        EnableXSAVE();
+        features |= CPU_FEATURE_XSAVE;
+    }
+
+    // AVX code needs the OS (us) to have enabled the registers' state in XCR0
+    uint8_t avxState = ((mainCPUInfo.xsaveMask & 0x6) == 0x6);
+    uint8_t avx512State = ((mainCPUInfo.xsaveMask & 0xE0) == 0xE0);
+
+    if(hasAVX && avxState)
+        features |= CPU_FEATURE_AVX;
+
+    // TSC frequency = crystal frequency * EBX / EAX. Often missing (ECX = 0), in which case the clock calibrates it instead.
+    if(maxLeaf >= 0x15)
+    {
+        CPUID(0x15, 0, &eax, &ebx, &ecx, &edx);
+        if(eax && ebx && ecx)
+            mainCPUInfo.counterFrequency = (uint64_t)ecx * ebx / eax;
+    }
+
+    if(maxLeaf >= 7)
+    {
+        CPUID(7, 0, &eax, &ebx, &ecx, &edx);
+
+        if((ebx & (1 << 5)) && avxState)
+            features |= CPU_FEATURE_AVX2;
+        if(ebx & (1 << 9))
+            features |= CPU_FEATURE_ERMS;
+        if((ebx & (1 << 16)) && avxState && avx512State)
+            features |= CPU_FEATURE_AVX512F;
+        if(edx & (1 << 4))
+            features |= CPU_FEATURE_FSRM;
+    }
+
+    CPUID(0x80000000, 0, &maxExtendedLeaf, &ebx, &ecx, &edx);
+
+    if(maxExtendedLeaf >= 0x80000001)
+    {
+        CPUID(0x80000001, 0, &eax, &ebx, &ecx, &edx);
+        if(edx & (1 << 26))
+            features |= CPU_FEATURE_PDPE1GB;
+    }
+
+    if(maxExtendedLeaf >= 0x80000007)
+    {
+        CPUID(0x80000007, 0, &eax, &ebx, &ecx, &edx);
+        if(edx & (1 << 8))
+            features |= CPU_FEATURE_INVARIANT_TSC;
+    }
+
+    mainCPUInfo.features = features;
+
+    // Pick the hot path implementations
+    if(features & CPU_FEATURE_FSRM)
+    {
+        mainCPURoutines.copyMemory = CopyMemoryFSRM;
+        mainCPURoutines.setMemory = SetMemoryFSRM;
+    }
+    else if(features & CPU_FEATURE_ERMS)
+    {
+        mainCPURoutines.copyMemory = CopyMemoryERMS;
+        mainCPURoutines.setMemory = SetMemoryERMS;
+    }
+    else if(features & CPU_FEATURE_AVX2)
+        mainCPURoutines.copyMemory = CopyMemoryAVX2;
+
+    if(features & CPU_FEATURE_AVX2)
+    {
+        mainCPURoutines.compareMemory = CompareMemoryAVX2;
+        mainCPURoutines.fillMemory32 = FillMemory32AVX2;
+        mainCPURoutines.streamMemory = StreamMemoryAVX2;
+        mainCPURoutines.checksum8 = Checksum8AVX2;
+    }
+}
+
+#ifdef DEBUG_PIOUS
+static const char * featureNames[] = {"sse3", "ssse3", "sse4.1", "sse4.2", "popcnt", "xsave", "avx", "avx2", "avx512f", "erms", "fsrm", "pdpe1gb", "x2apic", "tsc-deadline", "invariant-tsc"};
+
+void PrintCPUInfo(void)
+{
+    PrintString("%s, %u-byte cache lines, XSAVE mask 0x%lx (%u bytes)\n", mainTextDisplaySettings.fontColor, mainTextDisplaySettings.backgroundColor, mainCPUInfo.vendor, mainCPUInfo.cacheLineSize, mainCPUInfo.xsaveMask, mainCPUInfo.xsaveSize);
+
+    PrintString("CPU features:", mainTextDisplaySettings.fontColor, mainTextDisplaySettings.backgroundColor);
+    for(uint8_t i = 0; i < sizeof(featureNames) / sizeof(featureNames[0]); i++)
+    {
+        if(mainCPUInfo.features & (1ULL << i))
+            PrintString(" %s", mainTextDisplaySettings.fontColor, mainTextDisplaySettings.backgroundColor, featureNames[i]);
+    }
+    PrintString("\n", mainTextDisplaySettings.fontColor, mainTextDisplaySettings.backgroundColor);
+}
+#endif
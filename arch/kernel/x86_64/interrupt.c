@@ -0,0 +1,100 @@
+#include "kernel/kernel.h"
+#include "kernel/smp.h"
+#include "interrupt.h"
+
+typedef struct InterruptAction {
+    InterruptHandler     handler;   // NULL: the vector is free
+    void                *context;
+} InterruptAction;
+
+// Each CPU's table is written by whichever CPU allocates from it, under allocationLock, and only read by its own CPU
+static DEFINE_PER_CPU_ALIGNED(InterruptAction, deviceInterrupts[DEVICE_VECTOR_COUNT]);
+
+static volatile uint32_t allocationLock = 0;
+static uint32_t vectorsInUse[SMP_MAX_CPUS] = {0};
+
+static bool CanRouteTo(uint32_t cpu)
+{
+    return (cpu < mainSMPInfo.cpuCount) && mainSMPInfo.cpus[cpu]->online && (mainSMPInfo.cpus[cpu]->hardwareId <= 0xFF) &&
+        (vectorsInUse[cpu] < DEVICE_VECTOR_COUNT);
+}
+
+bool AllocateInterrupt(uint32_t cpu, InterruptHandler handler, void * context, InterruptRoute * route)
+{
+    if(handler == NULL)
+        return false;
+
+    AcquireSpinLock(&allocationLock);
+
+    if(!CanRouteTo(cpu))
+    {
+        cpu = INTERRUPT_ANY_CPU;
+        for(uint32_t i = 0; i < mainSMPInfo.cpuCount; i++)
+            if(CanRouteTo(i) && ((cpu == INTERRUPT_ANY_CPU) || (vectorsInUse[i] < vectorsInUse[cpu])))
+                cpu = i;
+
+        if(cpu == INTERRUPT_ANY_CPU)
+        {
+            ReleaseSpinLock(&allocationLock);
+            return false;
+        }
+    }
+
+    // The lowest free vector; CanRouteTo() made sure there is one
+    InterruptAction * actions = *PER_CPU_POINTER(mainSMPInfo.cpus[cpu]->perCPUOffset, deviceInterrupts);
+    uint32_t index = 0;
+    while(actions[index].handler != NULL)
+        index++;
+
+    actions[index].context = context;
+    actions[index].handler = handler;
+    vectorsInUse[cpu]++;
+
+    ReleaseSpinLock(&allocationLock);
+
+    route->cpu = cpu;
+    route->apicId = mainSMPInfo.cpus[cpu]->hardwareId;
+    route->vector = (uint8_t)(FIRST_DEVICE_VECTOR + index);
+    return true;
+}
+
+// The device has to be stopped from sending it first
+void FreeInterrupt(const InterruptRoute * route)
+{
+    if((route->cpu >= mainSMPInfo.cpuCount) || (route->vector < FIRST_DEVICE_VECTOR) || (route->vector >= APIC_FIRST_SYSTEM_VECTOR))
+        return;
+
+    AcquireSpinLock(&allocationLock);
+
+    InterruptAction * actions = *PER_CPU_POINTER(mainSMPInfo.cpus[route->cpu]->perCPUOffset, deviceInterrupts);
+    if(actions[route->vector - FIRST_DEVICE_VECTOR].handler != NULL)
+    {
+        actions[route->vector - FIRST_DEVICE_VECTOR].handler = NULL;
+        vectorsInUse[route->cpu]--;
+    }
+
+    ReleaseSpinLock(&allocationLock);
+}
+
+bool DispatchDeviceInterrupt(uint8_t vector)
+{
+    uint32_t index = vector - FIRST_DEVICE_VECTOR;
+    InterruptHandler handler = THIS_CPU(deviceInterrupts[index].handler); // THIS_CPU() of the whole array would lose the %gs
+    if(handler == NULL)
+        return false;
+
+    handler(THIS_CPU(deviceInterrupts[index].context));
+    SignalEndOfInterrupt(); // After the handler, so a level triggered IOAPIC input isn't resampled before the device is quiet
+    return true;
+}
+
+#ifdef DEBUG_PIOUS
+void PrintInterruptInfo(void)
+{
+    LogMessage(LOG_LEVEL_DEBUG, "Device interrupts per CPU:");
+    for(uint32_t i = 0; i < mainSMPInfo.cpuCount; i++)
+        LogMessage(LOG_LEVEL_DEBUG, " %u", vectorsInUse[i]);
+    LogMessage(LOG_LEVEL_DEBUG, " (of %u each)\n", DEVICE_VECTOR_COUNT);
+    DrainLog();
+}
+#endif
@@ -0,0 +1,53 @@
+#ifndef _INTERRUPT_H
+#define _INTERRUPT_H 1
+
+#include "kernel/kernel.h"
+#include "apic.h"
+
+// Device interrupts get vectors 32 (the first after the exceptions) up to the ones the local APIC keeps. Each CPU has its own set, so
+// the same vector can mean a different device on every CPU.
+#define FIRST_DEVICE_VECTOR     32
+#define DEVICE_VECTOR_COUNT     (APIC_FIRST_SYSTEM_VECTOR - FIRST_DEVICE_VECTOR)
+
+#define INTERRUPT_ANY_CPU       0xFFFFFFFF
+
+#define MSI_ADDRESS_BASE        0xFEE00000
+
+typedef void (*InterruptHandler)(void * context);
+
+// Where an allocated interrupt gets delivered
+typedef struct InterruptRoute {
+    uint32_t     cpu;       // Index into mainSMPInfo.cpus
+    uint32_t     apicId;    // The CPU's local APIC ID, for the IOAPIC or MSI destination
+    uint8_t      vector;
+    uint8_t      pad[7];    // Pad to multiple of 64 bits
+} InterruptRoute;
+
+// Takes a free vector on cpu (an index into mainSMPInfo.cpus) and has it call handler(context). With INTERRUPT_ANY_CPU, or if cpu is
+// offline or out of vectors, it goes to whichever CPU has the fewest device interrupts, so allocating one per MSI-X queue spreads
+// them across every CPU. Only CPUs with an APIC ID under 256 are used, as that's all the IOAPIC and MSI can address without interrupt
+// remapping. false if every CPU is full.
+bool AllocateInterrupt(uint32_t cpu, InterruptHandler handler, void * context, InterruptRoute * route);
+void FreeInterrupt(const InterruptRoute * route);
+
+// Called from User_ISR_handler for vectors below APIC_FIRST_SYSTEM_VECTOR. Runs the handler and signals EOI; false if nothing's allocated
+// at vector on this CPU.
+bool DispatchDeviceInterrupt(uint8_t vector);
+
+#ifdef DEBUG_PIOUS
+void PrintInterruptInfo(void);
+#endif
+
+// What a device writes, and where, to raise route's interrupt: fixed delivery, edge triggered, physical destination. For MSI-X these go
+// in the vector's table entry; plain MSI can only use one message this way, as multiple messages need a block of vectors on one CPU.
+static inline uint64_t GetMSIAddress(const InterruptRoute * route)
+{
+    return MSI_ADDRESS_BASE | ((uint64_t)route->apicId << 12);
+}
+
+static inline uint32_t GetMSIData(const InterruptRoute * route)
+{
+    return route->vector;
+}
+
+#endif
@@ -0,0 +1,141 @@
+#include "kernel/kernel.h"
+#include "kernel/acpi.h"
+#include "kernel/smp.h"
+#include "ioapic.h"
+
+// Registers are reached by writing their index to IOREGSEL and then using IOWIN
+#define IOAPIC_IOREGSEL         0x00
+#define IOAPIC_IOWIN            0x10
+
+#define IOAPIC_VERSION          0x01      // Bits 23:16: highest input number
+#define IOAPIC_REDIRECTION(pin) (0x10 + (pin) * 2) // Low half; the destination APIC ID is in bits 31:24 of the high half
+
+#define REDIRECTION_ACTIVE_LOW  (1 << 13)
+#define REDIRECTION_LEVEL       (1 << 15)
+#define REDIRECTION_MASKED      (1 << 16)
+
+IOAPICInfo mainIOAPICInfo = {0};
+
+static volatile uint32_t registerLock = 0; // IOREGSEL and IOWIN have to be used as a pair
+
+static uint32_t ReadIOAPIC(const IOAPIC * ioapic, uint32_t reg)
+{
+    volatile uint32_t * registers = (volatile uint32_t *)ioapic->address;
+    registers[IOAPIC_IOREGSEL / 4] = reg;
+    return registers[IOAPIC_IOWIN / 4];
+}
+
+static void WriteIOAPIC(const IOAPIC * ioapic, uint32_t reg, uint32_t value)
+{
+    volatile uint32_t * registers = (volatile uint32_t *)ioapic->address;
+    registers[IOAPIC_IOREGSEL / 4] = reg;
+    registers[IOAPIC_IOWIN / 4] = value;
+}
+
+static IOAPIC * FindIOAPIC(uint32_t gsi)
+{
+    for(uint32_t i = 0; i < mainIOAPICInfo.count; i++)
+        if((gsi >= mainIOAPICInfo.ioapics[i].gsiBase) && (gsi - mainIOAPICInfo.ioapics[i].gsiBase < mainIOAPICInfo.ioapics[i].inputCount))
+            return &mainIOAPICInfo.ioapics[i];
+
+    return NULL;
+}
+
+void InitializeIOAPIC(void)
+{
+    for(uint8_t i = 0; i < ISA_IRQ_COUNT; i++)
+        mainIOAPICInfo.isaGSI[i] = i; // Identity mapped unless overridden
+
+    ACPI_MADT * madt = (ACPI_MADT *)GetACPITable(ACPI_TABLE_MADT);
+    if(madt == NULL)
+        return;
+
+    ACPI_MADT_ENTRY * entry;
+    FOR_EACH_MADT_ENTRY(madt, entry)
+    {
+        if((entry->type == ACPI_MADT_IO_APIC) && (entry->length >= sizeof(ACPI_MADT_IO_APIC_ENTRY)) && (mainIOAPICInfo.count < IOAPIC_MAX))
+        {
+            ACPI_MADT_IO_APIC_ENTRY * ioapicEntry = (ACPI_MADT_IO_APIC_ENTRY *)entry;
+            IOAPIC * ioapic = &mainIOAPICInfo.ioapics[mainIOAPICInfo.count++];
+            ioapic->address = ioapicEntry->address;
+            ioapic->gsiBase = ioapicEntry->gsiBase;
+            ioapic->id = ioapicEntry->ioApicId;
+            ioapic->inputCount = ((ReadIOAPIC(ioapic, IOAPIC_VERSION) >> 16) & 0xFF) + 1;
+
+            // Whatever the firmware left routed would otherwise fire at vectors nothing has claimed
+            for(uint32_t pin = 0; pin < ioapic->inputCount; pin++)
+                WriteIOAPIC(ioapic, IOAPIC_REDIRECTION(pin), REDIRECTION_MASKED);
+        }
+        else if((entry->type == ACPI_MADT_OVERRIDE) && (entry->length >= sizeof(ACPI_MADT_OVERRIDE_ENTRY)))
+        {
+            ACPI_MADT_OVERRIDE_ENTRY * override = (ACPI_MADT_OVERRIDE_ENTRY *)entry;
+            if((override->bus == 0) && (override->source < ISA_IRQ_COUNT))
+            {
+                mainIOAPICInfo.isaGSI[override->source] = override->gsi;
+                mainIOAPICInfo.isaFlags[override->source] = override->flags;
+            }
+        }
+    }
+
+    if(mainIOAPICInfo.count == 0)
+        LogMessage(LOG_LEVEL_WARNING, "No IOAPIC in the MADT; only MSI interrupts will work\n");
+}
+
+bool RouteInterrupt(uint32_t gsi, uint16_t flags, uint32_t cpu, InterruptHandler handler, void * context, InterruptRoute * route)
+{
+    IOAPIC * ioapic = FindIOAPIC(gsi);
+    if((ioapic == NULL) || !AllocateInterrupt(cpu, handler, context, route))
+        return false;
+
+    uint32_t low = route->vector; // Fixed delivery, physical destination
+    if((flags & ACPI_MADT_POLARITY_MASK) == ACPI_MADT_POLARITY_LOW)
+        low |= REDIRECTION_ACTIVE_LOW;
+    if((flags & ACPI_MADT_TRIGGER_MASK) == ACPI_MADT_TRIGGER_LEVEL)
+        low |= REDIRECTION_LEVEL;
+
+    // The destination goes in first, so the input is never unmasked pointing somewhere else
+    uint32_t pin = gsi - ioapic->gsiBase;
+    AcquireSpinLock(&registerLock);
+    WriteIOAPIC(ioapic, IOAPIC_REDIRECTION(pin) + 1, route->apicId << 24);
+    WriteIOAPIC(ioapic, IOAPIC_REDIRECTION(pin), low);
+    ReleaseSpinLock(&registerLock);
+
+    return true;
+}
+
+bool RouteISAInterrupt(uint8_t irq, uint32_t cpu, InterruptHandler handler, void * context, InterruptRoute * route)
+{
+    if(irq >= ISA_IRQ_COUNT)
+        return false;
+
+    return RouteInterrupt(mainIOAPICInfo.isaGSI[irq], mainIOAPICInfo.isaFlags[irq], cpu, handler, context, route);
+}
+
+void UnrouteInterrupt(uint32_t gsi, const InterruptRoute * route)
+{
+    IOAPIC * ioapic = FindIOAPIC(gsi);
+    if(ioapic == NULL)
+        return;
+
+    AcquireSpinLock(&registerLock);
+    WriteIOAPIC(ioapic, IOAPIC_REDIRECTION(gsi - ioapic->gsiBase), REDIRECTION_MASKED);
+    ReleaseSpinLock(&registerLock);
+
+    FreeInterrupt(route);
+}
+
+#ifdef DEBUG_PIOUS
+void PrintIOAPICInfo(void)
+{
+    for(uint32_t i = 0; i < mainIOAPICInfo.count; i++)
+        LogMessage(LOG_LEVEL_DEBUG, "IOAPIC %u: GSIs %u-%u at 0x%lx\n", mainIOAPICInfo.ioapics[i].id, mainIOAPICInfo.ioapics[i].gsiBase,
+            mainIOAPICInfo.ioapics[i].gsiBase + mainIOAPICInfo.ioapics[i].inputCount - 1, mainIOAPICInfo.ioapics[i].address);
+
+    LogMessage(LOG_LEVEL_DEBUG, "ISA IRQ overrides:");
+    for(uint8_t i = 0; i < ISA_IRQ_COUNT; i++)
+        if((mainIOAPICInfo.isaGSI[i] != i) || mainIOAPICInfo.isaFlags[i])
+            LogMessage(LOG_LEVEL_DEBUG, " %u->%u (0x%x)", i, mainIOAPICInfo.isaGSI[i], mainIOAPICInfo.isaFlags[i]);
+    LogMessage(LOG_LEVEL_DEBUG, "\n");
+    DrainLog();
+}
+#endif
@@ -0,0 +1,46 @@
+#ifndef _IOAPIC_H
+#define _IOAPIC_H 1
+
+#include "kernel/kernel.h"
+#include "interrupt.h"
+
+#define IOAPIC_MAX      16
+#define ISA_IRQ_COUNT   16
+
+typedef struct IOAPIC {
+    uint64_t     address;       // MMIO registers
+    uint32_t     gsiBase;       // Global system interrupt of input 0
+    uint32_t     inputCount;
+    uint8_t      id;
+    uint8_t      pad[7];        // Pad to multiple of 64 bits
+} IOAPIC;
+
+typedef struct IOAPICInfo {
+    uint32_t     count;
+    uint32_t     pad;                       // Pad to multiple of 64 bits
+    IOAPIC       ioapics[IOAPIC_MAX];
+    uint32_t     isaGSI[ISA_IRQ_COUNT];     // Where each ISA IRQ comes in, after the MADT's interrupt source overrides
+    uint16_t     isaFlags[ISA_IRQ_COUNT];   // ACPI_MADT_POLARITY_* | ACPI_MADT_TRIGGER_* from the overrides
+} IOAPICInfo;
+
+extern IOAPICInfo mainIOAPICInfo;
+
+// Finds the IOAPICs and ISA IRQ overrides in the MADT and masks every input
+void InitializeIOAPIC(void);
+
+// Allocates a vector on cpu (see AllocateInterrupt()) for handler and points the IOAPIC input for gsi at it. flags are the
+// ACPI_MADT_POLARITY_* | ACPI_MADT_TRIGGER_* the input is wired with; PCI interrupts are active low and level triggered, and "conforms"
+// means ISA's active high and edge triggered. false if no IOAPIC has gsi or no vector is free.
+bool RouteInterrupt(uint32_t gsi, uint16_t flags, uint32_t cpu, InterruptHandler handler, void * context, InterruptRoute * route);
+
+// The same for a legacy ISA IRQ, wherever the MADT says it's wired
+bool RouteISAInterrupt(uint8_t irq, uint32_t cpu, InterruptHandler handler, void * context, InterruptRoute * route);
+
+// Masks gsi and frees its vector
+void UnrouteInterrupt(uint32_t gsi, const InterruptRoute * route);
+
+#ifdef DEBUG_PIOUS
+void PrintIOAPICInfo(void);
+#endif
+
+#endif
@@ -0,0 +1,182 @@
+#include "paging.h"
+#include "kernel/memory.h"
+#include "kernel/graphics.h"
+
+
+static uint64_t * kernelPML4 = NULL; // Page tables live in RAM that is identity mapped both by UEFI and by these tables, so they're accessed by physical address
+static uint64_t mappingCounts[3] = {0}; // 4 KiB, 2 MiB and 1 GiB pages mapped so far
+
+
+static uint64_t * NewTable(void)
+{
+    uint64_t * table = (uint64_t *)AllocatePhysicalPage();
+    if(table == NULL)
+        Abort(PAGING_ERROR_OUT_OF_MEMORY);
+
+    SetMemory(table, 0, EFI_PAGE_SIZE);
+    return table;
+}
+
+static uint64_t * NextLevel(uint64_t * table, uint16_t index)
+{
+    if(!(table[index] & PAGE_PRESENT))
+        table[index] = (uint64_t)NewTable() | PAGE_PRESENT | PAGE_WRITE;
+    else if(table[index] & PAGE_HUGE)
+        Abort(PAGING_ERROR_CONFLICT);
+
+    return (uint64_t *)(table[index] & PAGE_ADDRESS_MASK);
+}
+
+void MapPage(uint64_t virtualAddress, uint64_t physicalAddress, uint64_t pageSize, uint64_t flags)
+{
+    uint64_t * pdpt = NextLevel(kernelPML4, (virtualAddress >> 39) & 0x1FF);
+    if(pageSize == PAGE_SIZE_1G)
+    {
+        pdpt[(virtualAddress >> 30) & 0x1FF] = physicalAddress | flags | PAGE_PRESENT | PAGE_HUGE;
+        mappingCounts[2]++;
+        return;
+    }
+
+    uint64_t * pd = NextLevel(pdpt, (virtualAddress >> 30) & 0x1FF);
+    if(pageSize == PAGE_SIZE_2M)
+    {
+        pd[(virtualAddress >> 21) & 0x1FF] = physicalAddress | flags | PAGE_PRESENT | PAGE_HUGE;
+        mappingCounts[1]++;
+        return;
+    }
+
+    uint64_t * pt = NextLevel(pd, (virtualAddress >> 21) & 0x1FF);
+    pt[(virtualAddress >> 12) & 0x1FF] = physicalAddress | flags | PAGE_PRESENT;
+    mappingCounts[0]++;
+}
+
+// Maps a page-aligned range with the biggest pages that the alignment of both addresses allows, so 4 KiB pages only show up at unaligned edges
+void MapRange(uint64_t virtualAddress, uint64_t physicalAddress, uint64_t size, uint64_t flags)
+{
+    uint64_t end = virtualAddress + ((size + PAGE_SIZE_4K - 1) & ~(PAGE_SIZE_4K - 1));
+
+    while(virtualAddress < end)
+    {
+        uint64_t pageSize = PAGE_SIZE_4K;
+
+        if(HasCPUFeature(CPU_FEATURE_PDPE1GB) && !((virtualAddress | physicalAddress) & (PAGE_SIZE_1G - 1)) && (end - virtualAddress >= PAGE_SIZE_1G))
+            pageSize = PAGE_SIZE_1G;
+        else if(!((virtualAddress | physicalAddress) & (PAGE_SIZE_2M - 1)) && (end - virtualAddress >= PAGE_SIZE_2M))
+            pageSize = PAGE_SIZE_2M;
+
+        MapPage(virtualAddress, physicalAddress, pageSize, flags);
+        virtualAddress += pageSize;
+        physicalAddress += pageSize;
+    }
+}
+
+// Where the run of the identity map starting at address ends, and the memory type it gets. RAM is write-back. Framebuffers are
+// write-combining. Anything else is MMIO or a hole, and is uncached: MTRRs usually only cover MMIO below 4 GiB, so this can't rely on them.
+static uint64_t GetIdentityRun(LOADER_PARAMS * Parameters, uint64_t address, uint64_t top, uint64_t * flags)
+{
+    uint64_t end = top;
+
+    for(uint64_t i = 0; i < Parameters->GPU_Configs->NumberOfFrameBuffers; i++)
+    {
+        uint64_t frameBufferStart = Parameters->GPU_Configs->GPUArray[i].FrameBufferBase & ~(PAGE_SIZE_4K - 1);
+        uint64_t frameBufferEnd = (Parameters->GPU_Configs->GPUArray[i].FrameBufferBase + Parameters->GPU_Configs->GPUArray[i].FrameBufferSize + PAGE_SIZE_4K - 1) & ~(PAGE_SIZE_4K - 1);
+
+        if((address >= frameBufferStart) && (address < frameBufferEnd))
+        {
+            *flags = PAGE_WRITE_COMBINING;
+            return (frameBufferEnd < top) ? frameBufferEnd : top;
+        }
+        if((frameBufferStart > address) && (frameBufferStart < end))
+            end = frameBufferStart;
+    }
+
+    bool ram;
+    end = GetPhysicalRun(address, end, &ram);
+    *flags = ram ? PAGE_WRITE_BACK : PAGE_UNCACHED;
+    return end;
+}
+
+void InitializePAT(void)
+{
+    // Entry 1 goes from write-through (0x04) to write-combining (0x01); the rest keep their power on values
+    uint64_t pat = 0x0007040600070106;
+
+    asm volatile("wbinvd" : : : "memory"); // Nothing can be cached under the old type once the type changes
+    WriteMSR(MSR_PAT, pat);
+}
+
+void InitializePaging(LOADER_PARAMS * Parameters)
+{
+    uint64_t reg;
+    uint64_t top = GetMaxMappedPhysicalAddress();
+
+    // The local APIC, IOAPIC and HPET sit just under 4 GiB and usually aren't in the memory map
+    if(top < (4ULL << 30))
+        top = 4ULL << 30;
+
+    // A 64-bit framebuffer BAR isn't in the memory map either
+    for(uint64_t i = 0; i < Parameters->GPU_Configs->NumberOfFrameBuffers; i++)
+    {
+        uint64_t frameBufferEnd = Parameters->GPU_Configs->GPUArray[i].FrameBufferBase + Parameters->GPU_Configs->GPUArray[i].FrameBufferSize;
+        if(frameBufferEnd > top)
+            top = frameBufferEnd;
+    }
+
+    top = (top + PAGE_SIZE_4K - 1) & ~(PAGE_SIZE_4K - 1);
+    if(top > (255ULL << 39)) // The direct map gets the upper half's 256 PML4 entries, minus the kernel's (entry 511)
+        top = 255ULL << 39;
+
+    kernelPML4 = NewTable();
+
+    // Everything the bootloader handed over (LOADER_PARAMS, the memory map, the framebuffer) and everything the page allocator returns is still used through
+    // physical addresses, so the identity map stays. The direct map reuses the same PDPTs, so it costs no extra tables.
+    for(uint64_t address = 0; address < top;)
+    {
+        uint64_t flags;
+        uint64_t end = GetIdentityRun(Parameters, address, top, &flags);
+        MapRange(address, address, end - address, PAGE_WRITE | flags);
+        address = end;
+    }
+    for(uint16_t i = 0; i < ((top + (1ULL << 39) - 1) >> 39); i++)
+        kernelPML4[256 + i] = kernelPML4[i];
+
+    MapRange(KERNEL_VIRTUAL_BASE, Parameters->Kernel_BaseAddress, Parameters->Kernel_Pages << EFI_PAGE_SHIFT, PAGE_WRITE | PAGE_GLOBAL);
+
+    uint64_t topTable = (uint64_t)kernelPML4;
+
+    asm volatile("mov %%cr4, %[dest]"
+        : [dest] "=r" (reg) // Outputs
+        : // Inputs
+        : // Clobbers
+    );
+
+    // If the firmware left 5-level paging on, CR3 has to point to a PML5. Entries 0 and 511 both point to the PML4 since its identity, direct map
+    // and kernel entries sit at the same PML4 indices whether bits 56:48 are all 0s or all 1s.
+    if(reg & (1 << 12)) // CR4.LA57
+    {
+        uint64_t * pml5 = NewTable();
+        pml5[0] = topTable | PAGE_PRESENT | PAGE_WRITE;
+        pml5[511] = topTable | PAGE_PRESENT | PAGE_WRITE;
+        topTable = (uint64_t)pml5;
+    }
+
+    InitializePAT(); // The CR3 load below flushes anything the TLB has under the old types
+
+    asm volatile("mov %[src], %%cr3"
+        : // Outputs
+        : [src] "r" (topTable) // Inputs
+        : "memory" // Clobbers
+    );
+
+    // Nothing refers to the firmware's page tables anymore
+    ReclaimBootServicesMemory();
+}
+
+#ifdef DEBUG_PIOUS
+void PrintPagingStatistics(void)
+{
+    PrintString("Pages mapped: %lu x 1 GiB, %lu x 2 MiB, %lu x 4 KiB\n", mainTextDisplaySettings.fontColor, mainTextDisplaySettings.backgroundColor, mappingCounts[2], mappingCounts[1], mappingCounts[0]);
+    if(!HasCPUFeature(CPU_FEATURE_PDPE1GB))
+        PrintDebugMessage("1 GiB pages aren't supported by this CPU\n");
+}
+#endif
@@ -0,0 +1,42 @@
+#ifndef _Paging_H
+#define _Paging_H 1
+
+#include "kernel/kernel.h"
+
+#define KERNEL_VIRTUAL_BASE 0xFFFFFFFFC0000000 // HIGHER_HALF in linker.ld
+#define DIRECT_MAP_BASE     0xFFFF800000000000 // All physical memory is mapped starting here (PML4 entry 256 onwards)
+
+#define PHYSICAL_TO_DIRECT(address) ((void *)((uint64_t)(address) + DIRECT_MAP_BASE))
+
+// Page table entry bits
+#define PAGE_PRESENT       (1ULL << 0)
+#define PAGE_WRITE         (1ULL << 1)
+#define PAGE_USER          (1ULL << 2)
+#define PAGE_WRITE_THROUGH (1ULL << 3)
+#define PAGE_CACHE_DISABLE (1ULL << 4)
+#define PAGE_HUGE          (1ULL << 7) // PS bit: this PDPT/PD entry maps a 1 GiB/2 MiB page instead of pointing to a table
+#define PAGE_GLOBAL        (1ULL << 8)
+#define PAGE_ADDRESS_MASK  0x000FFFFFFFFFF000ULL
+
+// Memory types, through the PAT entry that PWT and PCD select (the PAT bit is left clear, since it moves in huge pages)
+#define PAGE_WRITE_BACK      0                                        // PAT entry 0
+#define PAGE_WRITE_COMBINING PAGE_WRITE_THROUGH                       // PAT entry 1, write-through until InitializePAT()
+#define PAGE_UNCACHED        (PAGE_CACHE_DISABLE | PAGE_WRITE_THROUGH) // PAT entry 3
+
+#define PAGE_SIZE_4K (1ULL << 12)
+#define PAGE_SIZE_2M (1ULL << 21)
+#define PAGE_SIZE_1G (1ULL << 30)
+
+#define PAGING_ERROR_OUT_OF_MEMORY 0x5047000000000001 // No free page for a page table
+#define PAGING_ERROR_CONFLICT      0x5047000000000002 // Tried to map through an existing huge page
+
+void InitializePaging(LOADER_PARAMS * Parameters);
+void InitializePAT(void); // Every CPU has to agree on the memory types, so the APs run this too
+void MapPage(uint64_t virtualAddress, uint64_t physicalAddress, uint64_t pageSize, uint64_t flags);
+void MapRange(uint64_t virtualAddress, uint64_t physicalAddress, uint64_t size, uint64_t flags);
+
+#ifdef DEBUG_PIOUS
+void PrintPagingStatistics(void);
+#endif
+
+#endif
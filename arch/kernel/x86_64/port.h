@@ -0,0 +1,36 @@
+#ifndef _Port_H
+#define _Port_H 1
+
+#include <stdint.h>
+
+static inline uint8_t InputByte(uint16_t port)
+{
+    uint8_t value;
+    asm volatile("inb %[port], %[value]"
+        : [value] "=a" (value) // Outputs
+        : [port] "Nd" (port) // Inputs
+        : // Clobbers
+    );
+    return value;
+}
+
+static inline void OutputByte(uint16_t port, uint8_t value)
+{
+    asm volatile("outb %[value], %[port]"
+        : // Outputs
+        : [port] "Nd" (port), [value] "a" (value) // Inputs
+        : // Clobbers
+    );
+}
+
+// Writes a whole buffer to one port with a single rep outsb
+static inline void OutputBytes(uint16_t port, const void * data, uint64_t length)
+{
+    asm volatile("rep outsb"
+        : "+S" (data), "+c" (length) // Outputs
+        : "d" (port) // Inputs
+        : "memory" // Clobbers
+    );
+}
+
+#endif
@@ -0,0 +1,75 @@
+#include "kernel/kernel.h"
+#include "kernel/serial.h"
+#include "port.h"
+
+#define COM1_PORT          0x3F8
+#define SERIAL_BAUD        115200
+
+// 16550 registers, as offsets from the base port
+#define UART_DATA          0 // Divisor low byte while DLAB is set
+#define UART_INTERRUPTS    1 // Divisor high byte while DLAB is set
+#define UART_FIFO_CONTROL  2
+#define UART_LINE_CONTROL  3
+#define UART_MODEM_CONTROL 4
+#define UART_LINE_STATUS   5
+#define UART_SCRATCH       7
+
+#define UART_LINE_STATUS_THR_EMPTY (1 << 5) // The transmit FIFO is empty
+#define UART_FIFO_SIZE             16
+
+// QEMU's isa-debugcon; the qemu target in the Makefile puts it at 0x402 (where OVMF writes its debug log too)
+#define DEBUGCON_PORT      0x402
+#define DEBUGCON_READBACK  0xE9      // What reading the port returns when the device is there
+
+bool InitializeSerial(void)
+{
+    // No UART: the scratch register won't hold a value
+    OutputByte(COM1_PORT + UART_SCRATCH, 0x5A);
+    if(InputByte(COM1_PORT + UART_SCRATCH) != 0x5A)
+        return false;
+
+    OutputByte(COM1_PORT + UART_INTERRUPTS, 0x00); // Polled, no interrupts
+    OutputByte(COM1_PORT + UART_LINE_CONTROL, 0x80); // DLAB on to set the baud rate divisor
+    OutputByte(COM1_PORT + UART_DATA, (115200 / SERIAL_BAUD) & 0xFF);
+    OutputByte(COM1_PORT + UART_INTERRUPTS, (115200 / SERIAL_BAUD) >> 8);
+    OutputByte(COM1_PORT + UART_LINE_CONTROL, 0x03); // 8N1, DLAB off
+    OutputByte(COM1_PORT + UART_FIFO_CONTROL, 0xC7); // Enable and clear the FIFOs
+    OutputByte(COM1_PORT + UART_MODEM_CONTROL, 0x03); // DTR and RTS
+
+    return true;
+}
+
+// Waits once per FIFO's worth of bytes instead of once per byte
+void WriteSerial(const unsigned char * chars, uint64_t length)
+{
+    bool carriageReturnSent = false;
+
+    while(length > 0)
+    {
+        while(!(InputByte(COM1_PORT + UART_LINE_STATUS) & UART_LINE_STATUS_THR_EMPTY));
+
+        for(uint8_t i = 0; (i < UART_FIFO_SIZE) && (length > 0); i++)
+        {
+            if((*chars == '\n') && !carriageReturnSent)
+            {
+                OutputByte(COM1_PORT + UART_DATA, '\r');
+                carriageReturnSent = true;
+                continue;
+            }
+
+            OutputByte(COM1_PORT + UART_DATA, *chars++);
+            carriageReturnSent = false;
+            length--;
+        }
+    }
+}
+
+bool InitializeDebugcon(void)
+{
+    return InputByte(DEBUGCON_PORT) == DEBUGCON_READBACK;
+}
+
+void WriteDebugcon(const unsigned char * chars, uint64_t length)
+{
+    OutputBytes(DEBUGCON_PORT, chars, length);
+}
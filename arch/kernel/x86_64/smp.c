@@ -0,0 +1,149 @@
+#include "kernel/kernel.h"
+#include "kernel/smp.h"
+#include "kernel/acpi.h"
+#include "kernel/clock.h"
+#include "kernel/memory.h"
+#include "kernel/options.h"
+#include "system.h"
+#include "apic.h"
+#include "paging.h"
+
+#define INIT_DELAY              10000000  // 10 ms
+#define STARTUP_DELAY           200000    // 200 us
+#define STARTUP_TIMEOUT         100000000 // 100 ms for every AP to check in
+
+#define CR4_LA57                (1 << 12)
+#define CR4_PAE                 (1 << 5)
+#define EFER_LMA                (1 << 10)
+
+extern uint8_t APTrampolineStart[], APTrampolineEnd[];
+extern uint32_t APTrampolineCR3Low, APTrampolineCR4Low, APTrampolineCPUCount, APTrampolineX2APIC;
+extern uint64_t APTrampolineEFER, APTrampolineCR0, APTrampolineCR3, APTrampolineCR4, APTrampolineXCR0, APTrampolineCPUs;
+
+// Where a field of the trampoline ends up in its low copy
+#define TRAMPOLINE_FIELD(copy, field) ((__typeof__(field) *)((copy) + ((uint8_t *)&(field) - APTrampolineStart)))
+
+// The AP startup code calls this once the AP is in long mode with the kernel's page tables
+void SecondaryCPUEntry(CPUState * cpu)
+{
+    InitializePAT();
+    LoadCPUTables(cpu);
+    InitializeLocalAPIC();
+    SecondaryCPUMain(cpu);
+}
+
+void StartSecondaryCPUs(void)
+{
+    uint64_t start = GetMonotonicTime();
+    uint32_t bootId = GetLocalAPICId();
+    mainSMPInfo.cpus[0]->hardwareId = bootId;
+
+    ACPI_MADT * madt = (ACPI_MADT *)GetACPITable(ACPI_TABLE_MADT);
+    uint64_t maxCPUs = GetBootOptionInteger("maxcpus", SMP_MAX_CPUS);
+    if((madt == NULL) || (maxCPUs < 2))
+        return;
+
+    // The INIT and SIPI delays and the startup timeout all need working time
+    if(mainClockSource.frequency == 0)
+    {
+        LogMessage(LOG_LEVEL_WARNING, "SMP: No clock to time the startup with, only using the boot CPU\n");
+        return;
+    }
+
+    ACPI_MADT_ENTRY * entry;
+    FOR_EACH_MADT_ENTRY(madt, entry)
+    {
+        uint32_t apicId, flags;
+        if(entry->type == ACPI_MADT_LOCAL_APIC)
+        {
+            apicId = ((ACPI_MADT_LOCAL_APIC_ENTRY *)entry)->apicId;
+            flags = ((ACPI_MADT_LOCAL_APIC_ENTRY *)entry)->flags;
+        }
+        else if(entry->type == ACPI_MADT_LOCAL_X2APIC)
+        {
+            apicId = ((ACPI_MADT_LOCAL_X2APIC_ENTRY *)entry)->x2apicId;
+            flags = ((ACPI_MADT_LOCAL_X2APIC_ENTRY *)entry)->flags;
+        }
+        else
+            continue;
+
+        if(!(flags & ACPI_MADT_ENABLED) || (apicId == bootId) || (!mainAPICInfo.x2apic && (apicId > 0xFE)))
+            continue;
+
+        // The GDT, TSS, IST stacks and XSAVE areas are per-CPU variables, so there's nothing else to allocate
+        if((mainSMPInfo.cpuCount >= maxCPUs) || (CreateCPUState(apicId, 0) == NULL))
+            break;
+    }
+
+    if(mainSMPInfo.cpuCount == 1)
+        return;
+
+    // SIPIs can only start CPUs in the first 1 MiB, and the startup code has to load CR3 while it's still in 32-bit mode
+    uint64_t trampoline = AllocatePhysicalPageBelow(1ULL << 20);
+    uint64_t lowTopTable = AllocatePhysicalPageBelow(4ULL << 30);
+    if((trampoline == 0) || (lowTopTable == 0))
+    {
+        if(trampoline)
+            FreePhysicalPage(trampoline);
+        if(lowTopTable)
+            FreePhysicalPage(lowTopTable);
+        LogMessage(LOG_LEVEL_WARNING, "SMP: No low memory for the AP startup code, only using the boot CPU\n");
+        return;
+    }
+
+    uint64_t cr0, cr3, cr4;
+    asm volatile("mov %%cr0, %[cr0]\n"
+                 "mov %%cr3, %[cr3]\n"
+                 "mov %%cr4, %[cr4]"
+        : [cr0] "=r" (cr0), [cr3] "=r" (cr3), [cr4] "=r" (cr4) // Outputs
+        : // Inputs
+        : // Clobbers
+    );
+
+    uint8_t * copy = (uint8_t *)trampoline;
+    CopyMemory(copy, APTrampolineStart, APTrampolineEnd - APTrampolineStart);
+    CopyMemory((void *)lowTopTable, (void *)(cr3 & PAGE_ADDRESS_MASK), EFI_PAGE_SIZE); // Lower levels are shared
+
+    *TRAMPOLINE_FIELD(copy, APTrampolineCR3Low) = (uint32_t)lowTopTable;
+    *TRAMPOLINE_FIELD(copy, APTrampolineCR4Low) = CR4_PAE | (cr4 & CR4_LA57);
+    *TRAMPOLINE_FIELD(copy, APTrampolineEFER) = ReadMSR(MSR_EFER) & ~EFER_LMA;
+    *TRAMPOLINE_FIELD(copy, APTrampolineCR0) = cr0;
+    *TRAMPOLINE_FIELD(copy, APTrampolineCR3) = cr3;
+    *TRAMPOLINE_FIELD(copy, APTrampolineCR4) = cr4;
+    *TRAMPOLINE_FIELD(copy, APTrampolineXCR0) = mainCPUInfo.xsaveMask;
+    *TRAMPOLINE_FIELD(copy, APTrampolineCPUs) = (uint64_t)mainSMPInfo.cpus;
+    *TRAMPOLINE_FIELD(copy, APTrampolineCPUCount) = mainSMPInfo.cpuCount;
+    *TRAMPOLINE_FIELD(copy, APTrampolineX2APIC) = mainAPICInfo.x2apic;
+
+    // INIT-SIPI-SIPI, but to every AP at once so they all spend the INIT delay together instead of one after the other
+    uint32_t cpuCount = mainSMPInfo.cpuCount;
+    for(uint32_t i = 1; i < cpuCount; i++)
+        SendAPICCommand(mainSMPInfo.cpus[i]->hardwareId, APIC_ICR_INIT);
+    WaitNanoseconds(INIT_DELAY);
+
+    for(uint32_t i = 1; i < cpuCount; i++)
+        SendAPICCommand(mainSMPInfo.cpus[i]->hardwareId, APIC_ICR_STARTUP | (uint32_t)(trampoline >> EFI_PAGE_SHIFT));
+    WaitNanoseconds(STARTUP_DELAY);
+
+    for(uint32_t i = 1; i < cpuCount; i++) // The second SIPI is only for CPUs that missed the first
+        if(!__atomic_load_n(&mainSMPInfo.cpus[i]->online, __ATOMIC_ACQUIRE))
+            SendAPICCommand(mainSMPInfo.cpus[i]->hardwareId, APIC_ICR_STARTUP | (uint32_t)(trampoline >> EFI_PAGE_SHIFT));
+
+    uint64_t timeout = GetMonotonicTime() + STARTUP_TIMEOUT;
+    while((__atomic_load_n(&mainSMPInfo.onlineCount, __ATOMIC_ACQUIRE) < cpuCount) && (GetMonotonicTime() < timeout))
+        asm volatile("pause");
+
+    mainSMPInfo.startupTime = GetMonotonicTime() - start;
+
+    // A CPU that's late could still be running the startup code, so that stays put unless everyone made it
+    if(mainSMPInfo.onlineCount == cpuCount)
+    {
+        FreePhysicalPage(trampoline);
+        FreePhysicalPage(lowTopTable);
+    }
+    else
+        LogMessage(LOG_LEVEL_WARNING, "SMP: %u of %u CPUs didn't start\n", cpuCount - mainSMPInfo.onlineCount, cpuCount);
+
+    LogMessage(LOG_LEVEL_INFO, "Started %u of %u CPUs in %lu.%03lu ms\n", mainSMPInfo.onlineCount, cpuCount,
+        mainSMPInfo.startupTime / 1000000, (mainSMPInfo.startupTime / 1000) % 1000);
+}
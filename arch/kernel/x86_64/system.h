@@ -4,6 +4,7 @@
 #define PAGE_TABLE_SIZE 512*8
 
 #include "bootloader/bootloader.h"
+#include "kernel/smp.h"
 
 //Descritor formats
 typedef struct __attribute__ ((packed)) {
@@ -69,6 +70,15 @@ typedef struct __attribute__ ((packed)) {
   UINT32 Reserved;
 } IDT_GATE_STRUCT; // Interrupt and trap gates use this format
 
+// Each CPU needs its own TSS for its IST stacks, and its own GDT to go with it since ltr marks the TSS descriptor busy
+typedef struct __attribute__ ((aligned(64))) {
+  UINT64       GDT[5];
+  TSS64_STRUCT TSS;
+} ARCH_CPU_STATE;
+
+#define IST_STACK_SIZE (1 << 12)
+
 void InitializeISR();
+void LoadCPUTables(CPUState * cpu);
 
 #endif
\ No newline at end of file
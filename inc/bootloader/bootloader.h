@@ -6,9 +6,92 @@
 
 
 #define BOOTLOADER_MAJOR_VER 1
-#define BOOTLOADER_MINOR_VER 0
+#define BOOTLOADER_MINOR_VER 2 // 1: LOADER_PARAMS has Boot_Timings, 2: BOOT_TIMINGS has the compressed kernel fields
 
 #define GPU_MENU_TIMEOUT_SECONDS 90
+#define GPU_MENU_HOTKEY          L'm' // Pressed before the bootloader starts (or held), brings up the graphics mode menu instead of picking a mode automatically
+
+#define KERNEL_CONFIG_PATH L"\\Pious\\Kernel64.txt" // Optional. First line: kernel path, second line: kernel options
+#define KERNEL_CONFIG_MAX_SIZE 4096
+
+#define KERNEL_PHYSICAL_BASE 0x40000000 // 1 GiB. The kernel's PT_LOAD segments are loaded here; anything the loader needs while it's loading stays below it
+
+#define ELF_READ_GAP_MAX (64 * 1024) // PT_LOAD segments further apart than this in the kernel file get their own Read() instead of reading through the gap
+
+// How InitUEFI_GOP() picks graphics modes, from the video= option on the second line of Kernel64.txt
+#define VIDEO_POLICY_AUTO        0 // video=auto (default): highest resolution with a usable framebuffer
+#define VIDEO_POLICY_SIZE        1 // video=<W>x<H>[,rgb|,bgr]: that mode if a GPU has it, otherwise like auto
+#define VIDEO_POLICY_CURRENT     2 // video=current: keep whatever mode the firmware set up
+#define VIDEO_POLICY_MENU        3 // video=menu: always ask, like pressing GPU_MENU_HOTKEY
+
+typedef struct {
+  UINT32                              Policy;               // VIDEO_POLICY_*
+  UINT32                              Width;                // VIDEO_POLICY_SIZE only
+  UINT32                              Height;
+  EFI_GRAPHICS_PIXEL_FORMAT           PixelFormat;          // PixelFormatMax matches any format
+} VIDEO_CONFIG;
+
+// Non-volatile variables the bootloader keeps under its own vendor GUID
+#define PIOUS_VARIABLE_GUID {0x3c5a8e21, 0x7d4b, 0x4f90, {0xa6, 0x1e, 0x52, 0xc8, 0x0b, 0x9d, 0x47, 0xf3}}
+
+#define GOP_MODE_CACHE_NAME_LENGTH 24 // L"GraphicsMode" + CRC32 of the GOP device path in hex
+
+// The last mode set on a GOP device, so the next boot can skip QueryMode()ing every mode (and SetMode() if it's still set)
+typedef struct {
+  UINT32                              Mode;
+  UINT32                              MaxMode;              // A different count means the mode list changed (e.g. another monitor)
+  VIDEO_CONFIG                        Video;                // The policy Mode was picked under; editing video= makes the bootloader pick again
+  EFI_GRAPHICS_OUTPUT_MODE_INFORMATION Info;                // What Mode looked like; checked against QueryMode() before it's trusted
+} GOP_MODE_CACHE;
+
+typedef struct {
+  CHAR16                             *Kernel_Path;          // First line of Kernel64.txt
+  UINT64                              Kernel_Path_Size;
+  CHAR16                             *Kernel_Options;       // Second line of Kernel64.txt
+  UINT64                              Kernel_Options_Size;
+  VIDEO_CONFIG                        Video;
+} BOOT_CONFIG;
+
+// Boot phases, as indexes into BOOT_TIMINGS.Phases. The bootloader times the ones before BOOT_PHASE_LOADER_COUNT, the kernel the rest.
+#define BOOT_PHASE_GOP          0 // InitUEFI_GOP(), including any time spent in the mode menu
+#define BOOT_PHASE_KERNEL_LOAD  1 // Reading the kernel ELF into memory
+#define BOOT_PHASE_EXIT_BOOT    2 // GetMemoryMap()/ExitBootServices(), including the retry
+#define BOOT_PHASE_LOADER_COUNT 3
+#define BOOT_PHASE_MEMORY       3 // InitializeMemory()
+#define BOOT_PHASE_PAGING       4 // InitializePaging() (x86_64 only)
+#define BOOT_PHASE_DISPLAY      5 // InitializeDisplay()
+#define BOOT_PHASE_ISR          6 // InitializeISR()
+#define BOOT_PHASE_DRIVERS      7 // InitializeDrivers()
+#define BOOT_PHASE_COUNT        8
+
+typedef struct {
+  UINT64                              Start;                // Cycle counter (TSC on x86_64, CNTVCT_EL0 on aarch64) when the phase started, 0 if it didn't run
+  UINT64                              End;                  // Cycle counter when the phase finished
+} BOOT_PHASE_TIME;
+
+typedef struct {
+  UINT64                              LoaderEntry;          // Cycle counter when efi_main() started; everything before it is firmware
+  BOOT_PHASE_TIME                     Phases[BOOT_PHASE_COUNT];
+  // Bootloader version 1.2+. For a compressed kernel these split up BOOT_PHASE_KERNEL_LOAD; for an uncompressed one the phases are 0 and the sizes are equal.
+  BOOT_PHASE_TIME                     KernelRead;           // Reading the whole compressed file off the ESP
+  BOOT_PHASE_TIME                     KernelDecompress;     // Decompressing it
+  UINT64                              KernelFileSize;       // Size of the kernel file on the ESP
+  UINT64                              KernelImageSize;      // Size of the ELF it holds
+} BOOT_TIMINGS;
+
+// The same counter the kernel's ReadCycleCounter() reads, so the two sets of samples line up
+static inline UINT64 ReadBootTimestamp(void)
+{
+#ifdef x86_64
+  UINT32 low, high;
+  asm volatile("rdtsc" : "=a" (low), "=d" (high));
+  return ((UINT64)high << 32) | low;
+#elif aarch64
+  UINT64 count;
+  asm volatile("mrs %[count], cntvct_el0" : [count] "=r" (count));
+  return count;
+#endif
+}
 
 typedef struct {
   EFI_GRAPHICS_OUTPUT_PROTOCOL_MODE  *GPUArray;             // This array contains the EFI_GRAPHICS_OUTPUT_PROTOCOL_MODE structures for each available framebuffer
@@ -36,18 +119,18 @@ typedef struct {
     EFI_FILE_INFO            *FileMeta;                       // Kernel file metadata
     EFI_CONFIGURATION_TABLE  *ConfigTables;                   // UEFI-installed system configuration tables (ACPI, SMBIOS, etc.)
     UINTN                     Number_of_ConfigTables;         // The number of system configuration tables
+    BOOT_TIMINGS             *Boot_Timings;                   // Bootloader version 1.1+: when each boot phase ran; the kernel fills in its own phases
   } LOADER_PARAMS;
 
 
 
-EFI_STATUS BootKernel(EFI_HANDLE ImageHandle, GPU_CONFIG  * Graphics, EFI_CONFIGURATION_TABLE * SysCfgTables, UINTN NumSysCfgTables, UINT32 UEFIVer);
-EFI_STATUS InitUEFI_GOP(EFI_HANDLE ImageHandle, GPU_CONFIG * Graphics);
+EFI_STATUS BootKernel(EFI_HANDLE ImageHandle, GPU_CONFIG  * Graphics, EFI_CONFIGURATION_TABLE * SysCfgTables, UINTN NumSysCfgTables, UINT32 UEFIVer, BOOT_CONFIG * Config, BOOT_TIMINGS * Timings);
+EFI_STATUS InitUEFI_GOP(EFI_HANDLE ImageHandle, GPU_CONFIG * Graphics, VIDEO_CONFIG * Video);
+EFI_STATUS LoadBootConfig(EFI_HANDLE ImageHandle, BOOT_CONFIG * Config);
+EFI_STATUS ReadKernelConfig(EFI_FILE * DriveRoot, CHAR16 ** KernelPath, UINT64 * KernelPathSize, CHAR16 ** KernelOptions, UINT64 * KernelOptionsSize);
 EFI_STATUS MapVirtualPages(UINTN physical, UINTN virt, UINTN pages, UINT32 flags, EFI_SYSTEM_TABLE * ST);
 
 
-UINT8 VerifyZeroMem(UINT64 NumBytes, UINT64 BaseAddr);
-EFI_PHYSICAL_ADDRESS ActuallyFreeAddress(UINT64 pages, EFI_PHYSICAL_ADDRESS OldAddress);
-EFI_PHYSICAL_ADDRESS ActuallyFreeAddressByPage(UINT64 pages, EFI_PHYSICAL_ADDRESS OldAddress);
 
 
 
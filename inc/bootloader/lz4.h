@@ -0,0 +1,14 @@
+#ifndef _PIOUS_LZ4_H
+#define _PIOUS_LZ4_H 1
+
+#include <efi.h>
+
+#define LZ4_FRAME_MAGIC 0x184D2204 // First 4 bytes (little endian) of an LZ4 frame, as written by the lz4 tool
+
+// Size of the data in the frame. The bootloader needs it up front, so frames have to be made with lz4 --content-size.
+EFI_STATUS LZ4GetContentSize(const UINT8 * Frame, UINT64 FrameSize, UINT64 * ContentSize);
+
+// Decompresses a whole LZ4 frame into Dest. Block and content checksums are skipped, not checked.
+EFI_STATUS LZ4DecompressFrame(const UINT8 * Frame, UINT64 FrameSize, UINT8 * Dest, UINT64 DestSize, UINT64 * Written);
+
+#endif
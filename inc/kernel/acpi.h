@@ -0,0 +1,251 @@
+#ifndef _ACPI_H
+#define _ACPI_H 1
+
+#include "kernel/kernel.h"
+
+typedef struct __attribute__((packed)) ACPI_RSDP {
+    char        signature[8];       // "RSD PTR "
+    uint8_t     checksum;           // First 20 bytes
+    char        oemId[6];
+    uint8_t     revision;           // 0 for ACPI 1.0 (no XSDT), 2 and up otherwise
+    uint32_t    rsdtAddress;
+    uint32_t    length;             // Revision 2+ from here on
+    uint64_t    xsdtAddress;
+    uint8_t     extendedChecksum;   // Whole structure
+    uint8_t     reserved[3];
+} ACPI_RSDP;
+
+typedef struct __attribute__((packed)) ACPI_SDT_HEADER {
+    char        signature[4];
+    uint32_t    length;             // Including this header
+    uint8_t     revision;
+    uint8_t     checksum;
+    char        oemId[6];
+    char        oemTableId[8];
+    uint32_t    oemRevision;
+    uint32_t    creatorId;
+    uint32_t    creatorRevision;
+} ACPI_SDT_HEADER;
+
+typedef struct __attribute__((packed)) ACPI_GENERIC_ADDRESS {
+    uint8_t     addressSpace;       // 0 = memory, 1 = I/O port
+    uint8_t     bitWidth;
+    uint8_t     bitOffset;
+    uint8_t     accessSize;
+    uint64_t    address;
+} ACPI_GENERIC_ADDRESS;
+
+typedef struct __attribute__((packed)) ACPI_HPET {
+    ACPI_SDT_HEADER       header;   // "HPET"
+    uint32_t              eventTimerBlockId;
+    ACPI_GENERIC_ADDRESS  baseAddress;
+    uint8_t               hpetNumber;
+    uint16_t              minimumTick;
+    uint8_t               pageProtection;
+} ACPI_HPET;
+
+// Fixed ACPI Description Table, up to the ACPI 2.0 fields. ACPI 1.0 ones end at resetRegister, so check header.length before going past that.
+typedef struct __attribute__((packed)) ACPI_FADT {
+    ACPI_SDT_HEADER       header;   // "FACP"
+    uint32_t              firmwareControl;
+    uint32_t              dsdt;
+    uint8_t               reserved1;
+    uint8_t               preferredPmProfile;
+    uint16_t              sciInterrupt;
+    uint32_t              smiCommandPort;
+    uint8_t               acpiEnable;
+    uint8_t               acpiDisable;
+    uint8_t               s4biosRequest;
+    uint8_t               pstateControl;
+    uint32_t              pm1aEventBlock;
+    uint32_t              pm1bEventBlock;
+    uint32_t              pm1aControlBlock;
+    uint32_t              pm1bControlBlock;
+    uint32_t              pm2ControlBlock;
+    uint32_t              pmTimerBlock;
+    uint32_t              gpe0Block;
+    uint32_t              gpe1Block;
+    uint8_t               pm1EventLength;
+    uint8_t               pm1ControlLength;
+    uint8_t               pm2ControlLength;
+    uint8_t               pmTimerLength;
+    uint8_t               gpe0Length;
+    uint8_t               gpe1Length;
+    uint8_t               gpe1Base;
+    uint8_t               cstateControl;
+    uint16_t              worstC2Latency;
+    uint16_t              worstC3Latency;
+    uint16_t              flushSize;
+    uint16_t              flushStride;
+    uint8_t               dutyOffset;
+    uint8_t               dutyWidth;
+    uint8_t               dayAlarm;
+    uint8_t               monthAlarm;
+    uint8_t               century;
+    uint16_t              bootArchitectureFlags;  // x86 only (IAPC_BOOT_ARCH)
+    uint8_t               reserved2;
+    uint32_t              flags;
+    ACPI_GENERIC_ADDRESS  resetRegister;
+    uint8_t               resetValue;
+    uint16_t              armBootArchitectureFlags; // ACPI 5.1+, see ACPI_ARM_*
+    uint8_t               minorVersion;
+    uint64_t              xFirmwareControl;
+    uint64_t              xDsdt;
+} ACPI_FADT;
+
+#define ACPI_ARM_PSCI_COMPLIANT (1 << 0)
+#define ACPI_ARM_PSCI_USE_HVC   (1 << 1) // PSCI calls go to the hypervisor instead of the secure monitor
+
+// Multiple APIC Description Table; variable length entries follow, each starting with an ACPI_MADT_ENTRY
+typedef struct __attribute__((packed)) ACPI_MADT {
+    ACPI_SDT_HEADER       header;   // "APIC"
+    uint32_t              localApicAddress;
+    uint32_t              flags;    // ACPI_MADT_PCAT_COMPAT
+} ACPI_MADT;
+
+#define ACPI_MADT_PCAT_COMPAT    (1 << 0) // There are also legacy 8259 PICs
+
+typedef struct __attribute__((packed)) ACPI_MADT_ENTRY {
+    uint8_t               type;
+    uint8_t               length;   // Including these two bytes
+} ACPI_MADT_ENTRY;
+
+#define ACPI_MADT_LOCAL_APIC     0x00
+#define ACPI_MADT_IO_APIC        0x01
+#define ACPI_MADT_OVERRIDE       0x02
+#define ACPI_MADT_LOCAL_X2APIC   0x09
+#define ACPI_MADT_GICC           0x0B
+
+#define ACPI_MADT_ENABLED        (1 << 0) // Processor flags: usable now
+#define ACPI_MADT_ONLINE_CAPABLE (1 << 1) // Can be enabled later (hot plug), ACPI 6.3+
+
+typedef struct __attribute__((packed)) ACPI_MADT_LOCAL_APIC_ENTRY {
+    ACPI_MADT_ENTRY       header;
+    uint8_t               processorId;
+    uint8_t               apicId;
+    uint32_t              flags;
+} ACPI_MADT_LOCAL_APIC_ENTRY;
+
+// Used instead of ACPI_MADT_LOCAL_APIC_ENTRY for APIC IDs of 255 and up
+typedef struct __attribute__((packed)) ACPI_MADT_LOCAL_X2APIC_ENTRY {
+    ACPI_MADT_ENTRY       header;
+    uint16_t              reserved;
+    uint32_t              x2apicId;
+    uint32_t              flags;
+    uint32_t              processorUid;
+} ACPI_MADT_LOCAL_X2APIC_ENTRY;
+
+typedef struct __attribute__((packed)) ACPI_MADT_IO_APIC_ENTRY {
+    ACPI_MADT_ENTRY       header;
+    uint8_t               ioApicId;
+    uint8_t               reserved;
+    uint32_t              address;
+    uint32_t              gsiBase;  // Global system interrupt of its first input
+} ACPI_MADT_IO_APIC_ENTRY;
+
+// An ISA IRQ that isn't wired to the IOAPIC input with the same number, or isn't active high edge triggered
+typedef struct __attribute__((packed)) ACPI_MADT_OVERRIDE_ENTRY {
+    ACPI_MADT_ENTRY       header;
+    uint8_t               bus;      // 0: ISA
+    uint8_t               source;   // ISA IRQ
+    uint32_t              gsi;
+    uint16_t              flags;    // ACPI_MADT_POLARITY_* | ACPI_MADT_TRIGGER_*
+} ACPI_MADT_OVERRIDE_ENTRY;
+
+// MPS INTI flags; "conforms" means whatever the bus normally uses (ISA: active high, edge)
+#define ACPI_MADT_POLARITY_MASK      0x3
+#define ACPI_MADT_POLARITY_CONFORMS  0x0
+#define ACPI_MADT_POLARITY_HIGH      0x1
+#define ACPI_MADT_POLARITY_LOW       0x3
+#define ACPI_MADT_TRIGGER_MASK       0xC
+#define ACPI_MADT_TRIGGER_CONFORMS   0x0
+#define ACPI_MADT_TRIGGER_EDGE       0x4
+#define ACPI_MADT_TRIGGER_LEVEL      0xC
+
+// GIC CPU interface, one per aarch64 CPU
+typedef struct __attribute__((packed)) ACPI_MADT_GICC_ENTRY {
+    ACPI_MADT_ENTRY       header;
+    uint16_t              reserved;
+    uint32_t              cpuInterfaceNumber;
+    uint32_t              processorUid;
+    uint32_t              flags;
+    uint32_t              parkingProtocolVersion;
+    uint32_t              performanceInterrupt;
+    uint64_t              parkedAddress;
+    uint64_t              physicalBaseAddress;
+    uint64_t              gicv;
+    uint64_t              gich;
+    uint32_t              vgicMaintenanceInterrupt;
+    uint64_t              gicrBaseAddress;
+    uint64_t              mpidr;
+} ACPI_MADT_GICC_ENTRY;
+
+#define FOR_EACH_MADT_ENTRY(madt, entry) for(entry = (ACPI_MADT_ENTRY *)((madt) + 1); \
+    ((uint8_t *)entry + sizeof(ACPI_MADT_ENTRY) <= (uint8_t *)(madt) + (madt)->header.length) && (entry->length >= sizeof(ACPI_MADT_ENTRY)); \
+    entry = (ACPI_MADT_ENTRY *)((uint8_t *)entry + entry->length))
+
+// PCI Express memory mapped configuration space; ACPI_MCFG_ALLOCATIONs fill the rest of the table
+typedef struct __attribute__((packed)) ACPI_MCFG_ALLOCATION {
+    uint64_t              baseAddress;
+    uint16_t              segment;
+    uint8_t               startBus;
+    uint8_t               endBus;
+    uint32_t              reserved;
+} ACPI_MCFG_ALLOCATION;
+
+typedef struct __attribute__((packed)) ACPI_MCFG {
+    ACPI_SDT_HEADER       header;   // "MCFG"
+    uint64_t              reserved;
+    ACPI_MCFG_ALLOCATION  allocations[];
+} ACPI_MCFG;
+
+// System Resource Affinity Table; variable length entries follow, laid out like the MADT's
+typedef struct __attribute__((packed)) ACPI_SRAT {
+    ACPI_SDT_HEADER       header;   // "SRAT"
+    uint32_t              reserved1;
+    uint64_t              reserved2;
+} ACPI_SRAT;
+
+// System Locality Information Table: a localityCount x localityCount matrix of relative distances (10 = local)
+typedef struct __attribute__((packed)) ACPI_SLIT {
+    ACPI_SDT_HEADER       header;   // "SLIT"
+    uint64_t              localityCount;
+    uint8_t               distances[];
+} ACPI_SLIT;
+
+// Tables InitializeACPI() looks up ahead of time, as indexes into ACPIInfo.tables
+#define ACPI_TABLE_FADT  0
+#define ACPI_TABLE_MADT  1
+#define ACPI_TABLE_HPET  2
+#define ACPI_TABLE_MCFG  3
+#define ACPI_TABLE_SRAT  4
+#define ACPI_TABLE_SLIT  5
+#define ACPI_TABLE_COUNT 6
+
+typedef struct ACPIInfo {
+    ACPI_RSDP           *rsdp;      // NULL if the firmware has no (valid) ACPI tables
+    ACPI_SDT_HEADER     *root;      // The XSDT, or the RSDT for ACPI 1.0
+    uint8_t              entrySize; // Of the root table's entries: 8 for the XSDT, 4 for the RSDT
+    uint8_t              pad[7];    // Pad to multiple of 64 bits
+    ACPI_SDT_HEADER     *tables[ACPI_TABLE_COUNT]; // NULL for any that are missing or fail their checksum
+} ACPIInfo;
+
+extern ACPIInfo mainACPIInfo;
+
+// Finds the RSDP in the UEFI configuration tables, checks it and the root table, and indexes the ACPI_TABLE_* tables. The tables are
+// identity mapped and sit in ACPI reclaim/NVS memory, which the page allocator never hands out, so the pointers stay good.
+void InitializeACPI(EFI_CONFIGURATION_TABLE * ConfigTables, UINTN NumberOfConfigTables);
+
+// First table with the given signature (e.g. "SSDT") in the root table, or NULL. Only for tables without an ACPI_TABLE_* index.
+ACPI_SDT_HEADER * FindACPITable(const char * signature);
+
+static inline ACPI_SDT_HEADER * GetACPITable(uint8_t table)
+{
+    return mainACPIInfo.tables[table];
+}
+
+#ifdef DEBUG_PIOUS
+void PrintACPIInfo(void);
+#endif
+
+#endif
@@ -0,0 +1,14 @@
+#ifndef _BootTime_H
+#define _BootTime_H 1
+
+#include "kernel/kernel.h"
+
+// Points the kernel's phase samples at the bootloader's BOOT_TIMINGS; without one (an older bootloader) the functions below do nothing
+void InitializeBootTimings(LOADER_PARAMS * Parameters);
+void StartBootPhase(uint8_t phase);
+void EndBootPhase(uint8_t phase);
+
+// Logs how long firmware, the bootloader and each kernel phase took. Needs the clock.
+void PrintBootTimings(void);
+
+#endif
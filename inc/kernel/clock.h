@@ -0,0 +1,45 @@
+#ifndef _Clock_H
+#define _Clock_H 1
+
+#include "kernel/kernel.h"
+
+#define NANOSECONDS_PER_SECOND 1000000000ULL
+#define CLOCK_SHIFT            32 // Fixed point fraction bits of ClockSource.multiplier
+
+// Time comes straight from ReadCycleCounter() (the invariant TSC or CNTVCT_EL0); InitializeClock() only works out how fast it counts
+typedef struct ClockSource {
+    const char  *name;          // Where the frequency came from
+    uint64_t     frequency;     // Counter ticks per second, 0 until InitializeClock()
+    uint64_t     multiplier;    // Nanoseconds per tick << CLOCK_SHIFT
+} ClockSource;
+
+extern ClockSource mainClockSource;
+
+// Implemented per architecture. x86_64 calibrates the TSC against the HPET (or the PIT if there isn't one) unless CPUID gives
+// its frequency; aarch64 uses CNTFRQ_EL0. The HPET comes from InitializeACPI().
+void InitializeClock(void);
+void SetClockFrequency(const char * name, uint64_t frequency);
+
+#ifdef DEBUG_PIOUS
+void PrintClockInfo(void);
+#endif
+
+static inline uint64_t CyclesToNanoseconds(uint64_t ticks)
+{
+    return (uint64_t)(((unsigned __int128)ticks * mainClockSource.multiplier) >> CLOCK_SHIFT);
+}
+
+// Nanoseconds since the counter started (around power on). Never goes backwards; 0 until InitializeClock().
+static inline uint64_t GetMonotonicTime(void)
+{
+    return CyclesToNanoseconds(ReadCycleCounter());
+}
+
+// Busy waits; for short hardware delays
+static inline void WaitNanoseconds(uint64_t nanoseconds)
+{
+    uint64_t end = GetMonotonicTime() + nanoseconds;
+    while(GetMonotonicTime() < end);
+}
+
+#endif
@@ -0,0 +1,136 @@
+#ifndef _CPU_H
+#define _CPU_H 1
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Feature bits for CPUInfo.features, probed once by InitializeCPU()
+#ifdef x86_64
+#define CPU_FEATURE_SSE3          (1ULL << 0)
+#define CPU_FEATURE_SSSE3         (1ULL << 1)
+#define CPU_FEATURE_SSE41         (1ULL << 2)
+#define CPU_FEATURE_SSE42         (1ULL << 3)
+#define CPU_FEATURE_POPCNT        (1ULL << 4)
+#define CPU_FEATURE_XSAVE         (1ULL << 5)
+#define CPU_FEATURE_AVX           (1ULL << 6)  // Only set if XCR0 has SSE and AVX state enabled
+#define CPU_FEATURE_AVX2          (1ULL << 7)  // Same
+#define CPU_FEATURE_AVX512F       (1ULL << 8)  // Only set if XCR0 has the AVX-512 states enabled
+#define CPU_FEATURE_ERMS          (1ULL << 9)  // Enhanced rep movsb/stosb
+#define CPU_FEATURE_FSRM          (1ULL << 10) // Fast short rep movsb
+#define CPU_FEATURE_PDPE1GB       (1ULL << 11) // 1 GiB pages
+#define CPU_FEATURE_X2APIC        (1ULL << 12)
+#define CPU_FEATURE_TSC_DEADLINE  (1ULL << 13)
+#define CPU_FEATURE_INVARIANT_TSC (1ULL << 14)
+#endif
+
+#ifdef aarch64
+#define CPU_FEATURE_FP            (1ULL << 0)
+#define CPU_FEATURE_ASIMD         (1ULL << 1)  // NEON
+#define CPU_FEATURE_CRC32         (1ULL << 2)
+#define CPU_FEATURE_ATOMICS       (1ULL << 3)  // LSE atomics
+#define CPU_FEATURE_DC_ZVA        (1ULL << 4)  // dc zva is allowed at EL1
+#endif
+
+typedef struct CPUInfo {
+    char        vendor[13];      // CPUID vendor string on x86_64, implementer name on aarch64
+    uint8_t     pad[3];          // Pad to multiple of 32 bits
+    uint32_t    cacheLineSize;   // Bytes
+    uint64_t    features;        // CPU_FEATURE_* bits
+    uint64_t    xsaveMask;       // x86_64: XCR0 as set by InitializeCPU(), 0 if XSAVE isn't supported
+    uint32_t    xsaveSize;       // x86_64: bytes needed by XSAVE for xsaveMask
+    uint32_t    zeroBlockSize;   // aarch64: bytes cleared by one dc zva
+    uint64_t    counterFrequency;// ReadCycleCounter() ticks per second if the CPU says (CPUID leaf 0x15, CNTFRQ_EL0), otherwise 0
+} CPUInfo;
+
+// Hot paths with more than one implementation. InitializeCPU() points these at the best ones for this CPU; until then they point at versions
+// every CPU of the architecture can run, so they're safe to call from the very start of InitializeSystem().
+typedef struct CPURoutines {
+    void        (*copyMemory)(void * dest, const void * src, uint64_t length);
+    void        (*setMemory)(void * dest, uint8_t value, uint64_t length);              // RAM only; on aarch64 this may use dc zva, which faults on device memory
+    int16_t     (*compareMemory)(const void * addr1, const void * addr2, uint64_t length);
+    void        (*fillMemory32)(uint32_t * dest, uint32_t value, uint64_t count);       // Framebuffer fills; safe on write-combining/device memory
+    void        (*streamMemory)(void * dest, const void * src, uint64_t length);        // Copy with non-temporal stores, for writing out to the framebuffer
+    uint8_t     (*checksum8)(const void * data, uint64_t length);                       // Sum of all bytes mod 256, as used by ACPI
+} CPURoutines;
+
+extern CPUInfo mainCPUInfo;
+extern CPURoutines mainCPURoutines;
+
+void InitializeCPU(void);
+
+#ifdef DEBUG_PIOUS
+void PrintCPUInfo(void);
+#endif
+
+static inline bool HasCPUFeature(uint64_t feature)
+{
+    return (mainCPUInfo.features & feature) == feature;
+}
+
+// Free-running counter for timestamps: the TSC on x86_64, CNTVCT_EL0 on aarch64
+static inline uint64_t ReadCycleCounter(void)
+{
+#ifdef x86_64
+    uint32_t low, high;
+    asm volatile("rdtsc" : "=a" (low), "=d" (high));
+    return ((uint64_t)high << 32) | low;
+#elif aarch64
+    uint64_t count;
+    asm volatile("mrs %[count], cntvct_el0" : [count] "=r" (count));
+    return count;
+#endif
+}
+
+#ifdef x86_64
+#define MSR_APIC_BASE    0x0000001B
+#define MSR_PAT          0x00000277
+#define MSR_TSC_DEADLINE 0x000006E0
+#define MSR_EFER         0xC0000080
+#define MSR_GS_BASE      0xC0000101
+
+static inline uint64_t ReadMSR(uint32_t msr)
+{
+    uint32_t low, high;
+    asm volatile("rdmsr" : "=a" (low), "=d" (high) : "c" (msr));
+    return ((uint64_t)high << 32) | low;
+}
+
+static inline void WriteMSR(uint32_t msr, uint64_t value)
+{
+    asm volatile("wrmsr" : : "c" (msr), "a" ((uint32_t)value), "d" ((uint32_t)(value >> 32)) : "memory");
+}
+#endif
+
+static inline int16_t CompareMemory(const void * addr1, const void * addr2, uint64_t length)
+{
+    return mainCPURoutines.compareMemory(addr1, addr2, length);
+}
+
+// Copies length bytes from addr2 to addr1
+static inline void CopyMemory(const void * addr1, const void * addr2, uint64_t length)
+{
+    mainCPURoutines.copyMemory((void *)addr1, addr2, length);
+}
+
+static inline void SetMemory(void * addr, uint8_t value, uint64_t length)
+{
+    mainCPURoutines.setMemory(addr, value, length);
+}
+
+static inline void FillMemory32(uint32_t * addr, uint32_t value, uint64_t count)
+{
+    mainCPURoutines.fillMemory32(addr, value, count);
+}
+
+// Like CopyMemory, but doesn't pull the destination into the cache
+static inline void StreamMemory(void * addr1, const void * addr2, uint64_t length)
+{
+    mainCPURoutines.streamMemory(addr1, addr2, length);
+}
+
+static inline uint8_t Checksum8(const void * data, uint64_t length)
+{
+    return mainCPURoutines.checksum8(data, length);
+}
+
+#endif
@@ -0,0 +1,16 @@
+#ifndef _Format_H
+#define _Format_H 1
+
+#include "kernel/kernel.h"
+
+// Receives formatted output a chunk at a time
+typedef void (*FormatSink)(void * context, const unsigned char * chars, UINT64 length);
+
+// printf-style formatting in a single pass over format. Supports the flags - 0 + and space, a width (or *), a precision (for %s and
+// floating point), the length modifiers hh h l ll z, and the conversions % c s d i u o x X p e E f g G.
+void FormatString(FormatSink sink, void * context, unsigned char * format, va_list args);
+
+// Formats into dest, truncating to size - 1 characters, and always null terminates. Returns the number of characters written.
+UINT64 FormatToBuffer(unsigned char * dest, UINT64 size, unsigned char * format, va_list args);
+
+#endif
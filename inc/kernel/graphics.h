@@ -4,13 +4,39 @@
 
 #include "kernel/kernel.h"
 
+#define CONSOLE_SCROLLBACK_KIB 512 // Default size of the console's line history (including what's on screen); the scrollback= boot option is in bytes (K/M/G suffixes work)
+#define MAX_FONT_SCALE         4   // Largest scale InitializeDisplay() picks or the scale= boot option can ask for
+
+// One character on the console
+typedef struct ConsoleCell {
+    UINT8   character;
+    UINT8   pad[3];     // Pad to multiple of 32 bits
+    UINT32  foreground;
+    UINT32  background;
+} ConsoleCell;
+
 typedef struct TextDisplaySettings {
     EFI_GRAPHICS_OUTPUT_PROTOCOL_MODE  defaultGPU;       // Default EFI GOP output device from GPUArray (should be GPUArray[0] if there's only 1)
 	UINT32                             fontColor;       // Default font color
 	UINT32                             highlightColor;  // Default highlight color
     UINT32                             backgroundColor; // Default background color
     UINT8                              scale;
-    UINT32                             index;            // Global string index for printf, etc. to keep track of cursor's postion in the framebuffer
+    UINT32                             columns;          // Text columns on screen
+    UINT32                             rows;             // Text rows on screen
+    ConsoleCell                       *cells;            // Ring of historyLines lines of columns cells each. Absolute line n lives at cells[(n % historyLines) * columns].
+    UINT32                             historyLines;     // Lines the ring holds, on screen and scrolled off
+    UINT32                             cursorColumn;
+    UINT64                             cursorLine;       // Absolute line the cursor is on (lines are numbered from 0 since boot)
+    UINT64                             viewOffset;       // How many lines the view is scrolled back from the newest output
+    UINT64                             renderedTop;      // Absolute line that was at the top of the screen when the console was last drawn
+    UINT64                             dirtyFirst;       // First absolute line changed since the console was last drawn
+    UINT64                             dirtyEnd;         // One past the last absolute line changed since the console was last drawn (dirtyFirst == dirtyEnd means none)
+    UINT32                            *glyphAtlas;       // Every glyph pre-drawn at the current scale in atlasForeground on atlasBackground, in the framebuffer's pixel format
+    UINT32                             atlasForeground;
+    UINT32                             atlasBackground;
+    UINT32                            *shadowBuffer;     // Everything is drawn here (in RAM) first; FlushDisplay() copies it to the framebuffer. Same layout as the framebuffer.
+    UINT32                             dirtyTop;         // First scanline changed since the last flush
+    UINT32                             dirtyBottom;      // One past the last scanline changed since the last flush (dirtyTop == dirtyBottom means nothing is dirty)
 } TextDisplaySettings;
 
 extern TextDisplaySettings mainTextDisplaySettings;
@@ -18,13 +44,11 @@ extern TextDisplaySettings mainTextDisplaySettings;
 
 void PrintString(unsigned char * str, UINT32 foregroundColor, UINT32 backgroundColor, ...);
 void PrintCharacter(unsigned char chr, UINT32 foregroundColor, UINT32 backgroundColor);
-void ScrollUp();
+void ScrollConsoleView(INT64 lines);
 void InitializeDisplay(EFI_GRAPHICS_OUTPUT_PROTOCOL_MODE GPU);
 void ColorScreen(UINT32 color);
-
-#ifdef DEBUG_PIOUS
-void PrintDebugMessage(unsigned char * str);
-void PrintErrorCode(unsigned long code, unsigned char * message);
-#endif
+void FlushDisplay(void);
+void WriteConsole(const unsigned char * chars, UINT64 length, UINT32 foregroundColor, UINT32 backgroundColor);
+void UpdateConsole(void);
 
 #endif
\ No newline at end of file
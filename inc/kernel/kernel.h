@@ -15,6 +15,9 @@
 #include <efi.h>
 #include <efiprot.h>
 
+#include "kernel/cpu.h" // CopyMemory, SetMemory, CompareMemory
+#include "kernel/log.h"
+
 //This assumes unsigned longs and doubles are of the same length (64 bits). Make note of this when porting to other architectures!
 typedef union
 {
@@ -24,8 +27,6 @@ typedef union
 
 
 void InitializeSystem(LOADER_PARAMS* Parameters);
-int16_t CompareMemory(const void * addr1, const void * addr2, uint64_t length);
-void CopyMemory(const void * addr1, const void * addr2, uint64_t length);
 void Abort(uint64_t errorCode);
 
 #endif
\ No newline at end of file
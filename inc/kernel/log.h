@@ -0,0 +1,66 @@
+#ifndef _Log_H
+#define _Log_H 1
+
+#include <stdint.h>
+#include <stdarg.h>
+
+#define LOG_BUFFER_SIZE  (64 * 1024) // Must be a power of 2
+#define LOG_MAX_MESSAGE  256         // Longer messages are truncated
+
+#define LOG_LEVEL_DEBUG    0
+#define LOG_LEVEL_INFO     1
+#define LOG_LEVEL_WARNING  2
+#define LOG_LEVEL_ERROR    3
+#define LOG_LEVEL_PADDING  0xFF      // Fills the end of the buffer when a record doesn't fit before it wraps
+
+#define LOG_RECORD_FREE       0
+#define LOG_RECORD_COMMITTED  1
+
+// Where DrainLog() writes to, picked with the console= boot option (e.g. console=serial,framebuffer)
+#define LOG_SINK_FRAMEBUFFER  (1 << 0)
+#define LOG_SINK_SERIAL       (1 << 1) // 16550 UART (COM1)
+#define LOG_SINK_DEBUGCON     (1 << 2) // QEMU debugcon port
+
+// Records are 8-byte aligned and never wrap around the end of the buffer
+typedef struct LogRecord {
+    uint64_t        timestamp;   // ReadCycleCounter() when the message was logged
+    uint16_t        length;      // Bytes of text after the header (not null terminated)
+    uint8_t         level;
+    uint8_t         state;       // Written last by the writer, so the reader never sees half a record
+    uint32_t        pad;         // Pad to multiple of 64 bits
+    unsigned char   text[];
+} LogRecord;
+
+// Any number of writers (including interrupt handlers) reserve space by moving head forward with a compare-and-swap, so writing
+// never takes a lock or touches the display. DrainLog() is the only reader.
+typedef struct KernelLog {
+    uint64_t        head __attribute__((aligned(64)));   // Bytes ever reserved by writers
+    uint64_t        tail __attribute__((aligned(64)));   // Bytes ever consumed by DrainLog()
+    uint64_t        dropped;                             // Messages thrown away because the buffer was full
+    uint64_t        reportedDropped;                     // dropped as of the last time DrainLog() said so
+    uint32_t        draining;                            // Set while DrainLog() runs
+    uint8_t         sinks;                               // LOG_SINK_* bits selected at boot
+    uint8_t         readySinks;                          // The selected serial/debugcon sinks that were found (the framebuffer is ready once it has cells)
+    uint8_t         minimumLevel;                        // From the loglevel= boot option
+    uint8_t         midLine;                             // The last record written didn't end in a newline, so the next one doesn't get a timestamp
+    unsigned char   buffer[LOG_BUFFER_SIZE] __attribute__((aligned(64)));
+} KernelLog;
+
+extern KernelLog mainKernelLog;
+
+// Picks the sinks and level from the boot options and brings up the sinks that don't need memory or the display
+void InitializeLogSinks(void);
+
+// Only copies the formatted message into the log; safe anywhere, including before the display is up
+void LogMessage(uint8_t level, unsigned char * format, ...);
+void LogMessageV(uint8_t level, unsigned char * format, va_list args);
+
+// Writes everything logged so far out to the sinks. Records stay in the log until at least one sink is ready.
+void DrainLog(void);
+
+#ifdef DEBUG_PIOUS
+void PrintDebugMessage(unsigned char * str);
+void PrintErrorCode(unsigned long code, unsigned char * message);
+#endif
+
+#endif
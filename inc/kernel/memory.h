@@ -3,6 +3,10 @@
 
 #include "kernel/kernel.h"
 
+#define PAGE_MAX_ORDER 18 // Largest buddy block is 2^18 pages (1 GiB)
+
+#define MEMORY_ERROR_NO_METADATA_SPACE 0x4D454D0000000001 // No EfiConventionalMemory range is large enough to hold the page frame metadata
+#define MEMORY_ERROR_BAD_FREE          0x4D454D0000000002 // A page was freed that is out of range or not currently allocated
 
 typedef struct MemorySettings {
     UINTN                   memMapSize;              // Size of the memory map (LP->Memory_Map_Size)
@@ -10,13 +14,29 @@ typedef struct MemorySettings {
     EFI_MEMORY_DESCRIPTOR  *memMap;                  // Pointer to memory map (LP->Memory_Map)
     UINT32                  memMapDescriptorVersion; // Memory map descriptor version
     UINT32                  pad;                     // Pad to multiple of 64 bits
+    uint64_t                totalSystemRam;          // Bytes of RAM described by the memory map, calculated once at startup
+    uint64_t                usableSystemRam;         // Bytes of RAM that isn't MMIO or firmware code, calculated once at startup
 } MemorySettings;
 
 extern MemorySettings mainMemorySettings;
 
 void InitializeMemory(UINTN MapSize, UINTN DescriptorSize, EFI_MEMORY_DESCRIPTOR *Map, UINT32 DescriptorVersion);
 uint64_t GetMaxMappedPhysicalAddress(void);
+uint64_t GetPhysicalRun(uint64_t address, uint64_t limit, bool * ram);
 uint64_t GetUsableSystemRam(void);
 uint64_t GetTotalSystemRam(void);
 
-#endif
\ No newline at end of file
+// Physical page frame (buddy) allocator. Addresses are physical and page-aligned; 0 is returned on failure since frame 0 is never handed out.
+void ReclaimBootServicesMemory(void);
+uint64_t AllocatePhysicalPage(void);
+uint64_t AllocatePhysicalPageBelow(uint64_t limit);
+void FreePhysicalPage(uint64_t address);
+uint64_t AllocatePhysicalPages(uint64_t count);
+void FreePhysicalPages(uint64_t address, uint64_t count);
+uint64_t AllocatePhysicalBlock(uint8_t order);
+void FreePhysicalBlock(uint64_t address, uint8_t order);
+uint64_t GetFreePhysicalPages(void);
+uint64_t GetUsedPhysicalPages(void);
+uint64_t GetFreePhysicalBlocks(uint8_t order);
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef _Options_H
+#define _Options_H 1
+
+#include "kernel/kernel.h"
+
+#define BOOT_OPTIONS_MAX_SIZE 1024 // Characters of Kernel_Options kept; the rest is ignored
+#define BOOT_OPTIONS_SLOTS    64   // Hash table size, must be a power of 2 (and there can't be more options than half of it)
+
+// Kernel_Options is a space separated list of key=value pairs (a key on its own means key=1), e.g.
+//     console=serial,framebuffer loglevel=info scale=2
+// Later copies of a key replace earlier ones.
+typedef struct BootOption {
+    const char  *key;      // NULL if the slot is empty
+    const char  *value;
+    uint32_t     hash;
+    uint32_t     pad;      // Pad to multiple of 64 bits
+} BootOption;
+
+// Converts the UTF-16 options once; everything after this reads the parsed copy. options may be NULL.
+void InitializeBootOptions(const uint16_t * options, uint64_t size);
+
+bool HasBootOption(const char * key);
+const char * GetBootOptionString(const char * key, const char * defaultValue);
+uint64_t GetBootOptionInteger(const char * key, uint64_t defaultValue);   // Decimal or 0x hex, with an optional K, M or G suffix
+bool GetBootOptionBool(const char * key, bool defaultValue);              // 1/0, yes/no, on/off or true/false
+
+#ifdef DEBUG_PIOUS
+void PrintBootOptions(void);
+#endif
+
+#endif
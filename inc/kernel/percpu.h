@@ -0,0 +1,34 @@
+#ifndef _PerCPU_H
+#define _PerCPU_H 1
+
+#include <stdint.h>
+
+// Per-CPU variables are defined with DEFINE_PER_CPU, which puts them in the .percpu section. The section itself is the boot CPU's copy;
+// CreateCPUState() gives every other CPU its own zeroed, cache-line aligned copy, so per-CPU variables start out as 0 (give them no
+// initializer). Each CPU keeps the distance from the section to its copy in GS_BASE on x86_64 and TPIDR_EL1 on aarch64, so this CPU's
+// copy of a variable is at its linked address plus that. On x86_64 THIS_CPU() is a single %gs relative access.
+extern uint8_t __percpu_start[], __percpu_end[]; // From linker.ld
+
+#define DEFINE_PER_CPU(type, name)  __attribute__((section(".percpu"))) type name
+#define DEFINE_PER_CPU_ALIGNED(type, name) __attribute__((section(".percpu"), aligned(64))) type name // Starts its own cache line
+#define DECLARE_PER_CPU(type, name) extern type name
+
+#define PER_CPU_SIZE (((uint64_t)(__percpu_end - __percpu_start) + 63) & ~63ULL)
+
+#ifdef x86_64
+#define THIS_CPU(name) (*(__seg_gs __typeof__(name) *)(uintptr_t)&(name))
+#elif aarch64
+static inline uint64_t GetPerCPUOffset(void)
+{
+    uint64_t offset;
+    asm volatile("mrs %[offset], tpidr_el1" : [offset] "=r" (offset));
+    return offset;
+}
+
+#define THIS_CPU(name) (*(__typeof__(name) *)((uintptr_t)&(name) + GetPerCPUOffset()))
+#endif
+
+// Another CPU's copy, given that CPU's offset (CPUState.perCPUOffset)
+#define PER_CPU_POINTER(offset, name) ((__typeof__(name) *)((uintptr_t)&(name) + (offset)))
+
+#endif
@@ -0,0 +1,14 @@
+#ifndef _Serial_H
+#define _Serial_H 1
+
+#include "kernel/kernel.h"
+
+// Text output that doesn't need the display. Implemented per architecture; the Initialize functions return false if the device
+// isn't there (or isn't supported on this architecture), and the Write functions must only be used once they've returned true.
+bool InitializeSerial(void);
+void WriteSerial(const unsigned char * chars, uint64_t length);   // '\n' goes out as "\r\n"
+
+bool InitializeDebugcon(void);
+void WriteDebugcon(const unsigned char * chars, uint64_t length);
+
+#endif
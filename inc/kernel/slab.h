@@ -0,0 +1,44 @@
+#ifndef _Slab_H
+#define _Slab_H 1
+
+#include "kernel/kernel.h"
+
+#define SLAB_ORDER       4                                // Every slab is one 64 KiB buddy block, so a slab can be found from any object inside it
+#define SLAB_SIZE        ((1ULL << SLAB_ORDER) << EFI_PAGE_SHIFT)
+#define SLAB_MIN_OBJECT  16                               // Objects are always at least 16-byte aligned
+#define SLAB_MAX_OBJECT  8192                             // Anything bigger should come straight from AllocatePhysicalPages()
+
+#define SLAB_ERROR_BAD_FREE 0x534C414200000001 // A pointer was freed that doesn't belong to a slab
+
+typedef struct Slab Slab;
+
+typedef struct ObjectCache {
+    const char          *name;           // Shown in the statistics dump
+    uint32_t             objectSize;     // Rounded up to a multiple of SLAB_MIN_OBJECT
+    uint32_t             objectsPerSlab;
+    Slab                *partialSlabs;   // Slabs with some objects free; allocations come from here first
+    Slab                *fullSlabs;
+    Slab                *emptySlab;      // One empty slab is kept so alloc/free at a slab boundary doesn't thrash the page allocator
+    uint64_t             objects;        // Objects currently allocated
+    uint64_t             slabs;          // Slabs currently owned by this cache
+    uint64_t             hits;           // Allocations served from an existing slab
+    uint64_t             misses;         // Allocations that needed a new slab
+    struct ObjectCache  *next;           // All caches, for statistics
+} ObjectCache;
+
+void InitializeSlab(void);
+
+// Named caches for fixed-size kernel structures
+ObjectCache * CreateObjectCache(const char *name, uint32_t objectSize);
+void * AllocateObject(ObjectCache *cache);
+void FreeObject(ObjectCache *cache, void *object);
+
+// General purpose heap (kmalloc/kfree) built on the size class caches. Returns NULL if size is 0, larger than SLAB_MAX_OBJECT, or memory has run out.
+void * KernelAllocate(uint64_t size);
+void KernelFree(void *pointer);
+
+#ifdef DEBUG_PIOUS
+void PrintObjectCacheStatistics(void);
+#endif
+
+#endif
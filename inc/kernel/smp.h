@@ -0,0 +1,100 @@
+#ifndef _SMP_H
+#define _SMP_H 1
+
+#define SMP_MAX_CPUS   256
+#define CPU_STACK_SIZE (64 * 1024)
+
+// CPUState offsets for the AP startup code
+#define CPU_STATE_PER_CPU_OFFSET 0
+#define CPU_STATE_STACK_TOP      8
+#define CPU_STATE_HARDWARE_ID    20
+#define CPU_STATE_ARCH           32
+
+#ifndef __ASSEMBLER__
+
+#include "kernel/kernel.h"
+#include "kernel/percpu.h"
+
+// One per CPU, on its own cache lines so CPUs never share a line through it. The CPU's own block is THIS_CPU(currentCPU).
+typedef struct CPUState {
+    uint64_t             perCPUOffset;  // This CPU's per-CPU copy minus __percpu_start; what GS_BASE/TPIDR_EL1 hold (0 for the boot CPU)
+    uint64_t             stackTop;      // Kernel stack the CPU starts on
+    uint32_t             index;         // 0 is the boot CPU, the rest are in the order the MADT lists them
+    uint32_t             hardwareId;    // Local APIC ID on x86_64, MPIDR affinity bits on aarch64
+    volatile uint32_t    online;        // Set by the CPU itself once it's running kernel code
+    uint32_t             pad;           // Pad to multiple of 64 bits
+    void                *arch;          // aarch64: the MMU settings the AP startup code turns the MMU on with
+} __attribute__((aligned(64))) CPUState;
+
+typedef struct SMPInfo {
+    uint32_t             cpuCount;      // CPUs with a CPUState, whether or not they came up
+    volatile uint32_t    onlineCount;   // Including the boot CPU
+    uint64_t             startupTime;   // Nanoseconds StartSecondaryCPUs() took
+    CPUState            *cpus[SMP_MAX_CPUS];
+} SMPInfo;
+
+extern SMPInfo mainSMPInfo;
+
+DECLARE_PER_CPU(CPUState *, currentCPU);
+
+// Gives the next CPU a CPUState from the "cpu-state" object cache, then its per-CPU variables, archSize bytes of cache-line aligned zeroed
+// memory at cpu->arch and a CPU_STACK_SIZE stack in one page allocation. NULL if there are already SMP_MAX_CPUS or memory has run out.
+CPUState * CreateCPUState(uint32_t hardwareId, uint64_t archSize);
+
+// Implemented per architecture. Starts every enabled CPU in the MADT (up to the maxcpus= option) and waits for them to come online.
+void StartSecondaryCPUs(void);
+
+// Where a started CPU goes once its architecture state is set up; it marks itself online and idles
+void SecondaryCPUMain(CPUState * cpu) __attribute__((noreturn));
+
+#ifdef DEBUG_PIOUS
+void PrintSMPInfo(void);
+#endif
+
+static inline CPUState * GetCurrentCPU(void)
+{
+    return THIS_CPU(currentCPU);
+}
+
+// Points the calling CPU's per-CPU variables at cpu's copy. On x86_64 loading %gs clears GS_BASE, so this has to come after that.
+static inline void SetCurrentCPU(CPUState * cpu)
+{
+    *PER_CPU_POINTER(cpu->perCPUOffset, currentCPU) = cpu;
+#ifdef x86_64
+    WriteMSR(MSR_GS_BASE, cpu->perCPUOffset);
+#elif aarch64
+    asm volatile("msr tpidr_el1, %[offset]" : : [offset] "r" (cpu->perCPUOffset) : "memory");
+#endif
+}
+
+// For the few places that share state between CPUs. Nothing that takes one may run in an interrupt handler, since the interrupted code
+// could be holding it.
+static inline void AcquireSpinLock(volatile uint32_t * lock)
+{
+    while(__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE))
+        while(__atomic_load_n(lock, __ATOMIC_RELAXED)) // Wait without bouncing the line between CPUs
+#ifdef x86_64
+            asm volatile("pause");
+#elif aarch64
+            asm volatile("yield");
+#endif
+}
+
+static inline void ReleaseSpinLock(volatile uint32_t * lock)
+{
+    __atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
+
+// Sleeps until the next interrupt
+static inline void WaitForInterrupt(void)
+{
+#ifdef x86_64
+    asm volatile("hlt");
+#elif aarch64
+    asm volatile("wfi");
+#endif
+}
+
+#endif
+
+#endif
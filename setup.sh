@@ -1,6 +1,6 @@
 #!/bin/bash
 # setup.sh (builds cross-compiler and references it in the PATH)
-sudo apt-get install make gcc bison flex libgmp3-dev libmpc-dev libmpfr-dev texinfo qemu-system gcc-aarch64-linux-gnu
+sudo apt-get install make gcc bison flex lz4 libgmp3-dev libmpc-dev libmpfr-dev texinfo qemu-system gcc-aarch64-linux-gnu
 
 mkdir Compiler-$1
 cd Compiler-$1
@@ -16,6 +16,7 @@
 #endif
 
 #include "bootloader/elf.h"
+#include "bootloader/lz4.h"
 
 #include "bootloader/bootloader.h"
 
@@ -24,6 +25,8 @@ EFI_STATUS
 EFIAPI
 efi_main (EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE *SystemTable) {
 
+   UINT64 LoaderEntry = ReadBootTimestamp();
+
    InitializeLib(ImageHandle, SystemTable);
 
    Print(L"Hello World!\r\n");
@@ -35,15 +38,35 @@ efi_main (EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE *SystemTable) {
       Print(L"Graphics AllocatePool error. 0x%llx\r\n", Status);
       return Status;
    }
+
+   BOOT_TIMINGS *Timings;
+   Status = uefi_call_wrapper(ST->BootServices->AllocatePool, 3, EfiLoaderData, sizeof(BOOT_TIMINGS), (void**)&Timings);
+   if(EFI_ERROR(Status))
+   {
+      Print(L"Timings AllocatePool error. 0x%llx\r\n", Status);
+      return Status;
+   }
+   ZeroMem(Timings, sizeof(BOOT_TIMINGS));
+   Timings->LoaderEntry = LoaderEntry;
+
+   // Kernel64.txt is read first since its video= option decides how the graphics mode is picked
+   BOOT_CONFIG Config;
+   Status = LoadBootConfig(ImageHandle, &Config);
+   if(EFI_ERROR(Status))
+   {
+      Print(L"Kernel64.txt read error, using defaults. 0x%llx\r\n", Status);
+   }
    
-   Status = InitUEFI_GOP(ImageHandle, Graphics);
+   Timings->Phases[BOOT_PHASE_GOP].Start = ReadBootTimestamp();
+   Status = InitUEFI_GOP(ImageHandle, Graphics, &Config.Video);
    if(EFI_ERROR(Status))
    {
       Print(L"InitUEFI_GOP error. 0x%llx\r\n", Status);
       return Status;
    }
+   Timings->Phases[BOOT_PHASE_GOP].End = ReadBootTimestamp();
 
-   Status = BootKernel(ImageHandle, Graphics, ST->ConfigurationTable, ST->NumberOfTableEntries, ST->Hdr.Revision);
+   Status = BootKernel(ImageHandle, Graphics, ST->ConfigurationTable, ST->NumberOfTableEntries, ST->Hdr.Revision, &Config, Timings);
 
    while(1) ;
    return Status;
@@ -51,9 +74,100 @@ efi_main (EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE *SystemTable) {
 
 
 
-EFI_STATUS BootKernel(EFI_HANDLE ImageHandle, GPU_CONFIG * Graphics, EFI_CONFIGURATION_TABLE * SysCfgTables, UINTN NumSysCfgTables, UINT32 UEFIVer)
+typedef struct {
+  EFI_FILE * File;
+  UINT8    * Image;     // The decompressed kernel, or NULL to read the file itself
+  UINT64     ImageSize;
+  UINT64     ImagePages;
+} KERNEL_SOURCE;
+
+// Reads Size bytes at Offset from the kernel, or fewer if it ends first (Size comes back as the number read)
+static EFI_STATUS ReadKernel(KERNEL_SOURCE * Source, UINT64 Offset, UINTN * Size, VOID * Buffer)
+{
+  if(Source->Image == NULL)
+  {
+    EFI_STATUS Status = uefi_call_wrapper(Source->File->SetPosition, 2, Source->File, Offset);
+    if(EFI_ERROR(Status))
+      return Status;
+
+    return uefi_call_wrapper(Source->File->Read, 3, Source->File, Size, Buffer);
+  }
+
+  if(Offset >= Source->ImageSize)
+    *Size = 0;
+  else if(*Size > (Source->ImageSize - Offset))
+    *Size = Source->ImageSize - Offset;
+
+  CopyMem(Buffer, Source->Image + Offset, *Size);
+  return EFI_SUCCESS;
+}
+
+// Reads the whole compressed kernel with one Read() and decompresses it into pages below KERNEL_PHYSICAL_BASE, where the ELF loader then copies it from
+static EFI_STATUS DecompressKernel(KERNEL_SOURCE * Source, UINT64 FileSize, UINT64 ImageSize, BOOT_TIMINGS * Timings)
+{
+  EFI_PHYSICAL_ADDRESS Compressed = KERNEL_PHYSICAL_BASE - 1;
+  UINT64 CompressedPages = EFI_SIZE_TO_PAGES(FileSize);
+
+  EFI_STATUS Status = uefi_call_wrapper(BS->AllocatePages, 4, AllocateMaxAddress, EfiBootServicesData, CompressedPages, &Compressed);
+  if(EFI_ERROR(Status))
+  {
+    Print(L"Compressed kernel AllocatePages error. 0x%llx\r\n", Status);
+    return Status;
+  }
+
+  Timings->KernelRead.Start = ReadBootTimestamp();
+  UINTN size = FileSize;
+  Status = ReadKernel(Source, 0, &size, (VOID*)Compressed);
+  if(EFI_ERROR(Status))
+  {
+    Print(L"Compressed kernel read error. 0x%llx\r\n", Status);
+    return Status;
+  }
+  if(size != FileSize)
+  {
+    Print(L"Kernel file is truncated (LZ4).\r\n");
+    return EFI_LOAD_ERROR;
+  }
+  Timings->KernelRead.End = ReadBootTimestamp();
+
+  EFI_PHYSICAL_ADDRESS Image = KERNEL_PHYSICAL_BASE - 1;
+  UINT64 ImagePages = EFI_SIZE_TO_PAGES(ImageSize);
+
+  Status = uefi_call_wrapper(BS->AllocatePages, 4, AllocateMaxAddress, EfiBootServicesData, ImagePages, &Image);
+  if(EFI_ERROR(Status))
+  {
+    Print(L"Decompressed kernel AllocatePages error. 0x%llx\r\n", Status);
+    return Status;
+  }
+
+  Timings->KernelDecompress.Start = ReadBootTimestamp();
+  UINT64 Written;
+  Status = LZ4DecompressFrame((UINT8*)Compressed, FileSize, (UINT8*)Image, ImageSize, &Written);
+  if(EFI_ERROR(Status))
+  {
+    Print(L"Kernel decompression error (LZ4). 0x%llx\r\n", Status);
+    return Status;
+  }
+  Timings->KernelDecompress.End = ReadBootTimestamp();
+
+  Status = uefi_call_wrapper(BS->FreePages, 2, Compressed, CompressedPages);
+  if(EFI_ERROR(Status))
+  {
+    Print(L"Error freeing compressed kernel pages. 0x%llx\r\n", Status);
+  }
+
+  Source->Image = (UINT8*)Image;
+  Source->ImageSize = ImageSize;
+  Source->ImagePages = ImagePages;
+
+  Print(L"Decompressed %llu KiB of kernel from %llu KiB\r\n", ImageSize >> 10, FileSize >> 10);
+  return EFI_SUCCESS;
+}
+
+EFI_STATUS BootKernel(EFI_HANDLE ImageHandle, GPU_CONFIG * Graphics, EFI_CONFIGURATION_TABLE * SysCfgTables, UINTN NumSysCfgTables, UINT32 UEFIVer, BOOT_CONFIG * Config, BOOT_TIMINGS * Timings)
 {
     Print(L"Booting kernel\r\n");
+    Timings->Phases[BOOT_PHASE_KERNEL_LOAD].Start = ReadBootTimestamp();
 
 #ifdef x86_64
   
@@ -136,9 +250,10 @@ EFI_STATUS BootKernel(EFI_HANDLE ImageHandle, GPU_CONFIG * Graphics, EFI_CONFIGU
         return BootStatus;
     }
 
-    CHAR16 * KernelPath = L"\\Pious\\Kernel.exe";
-    //UINT64 KernelPathLen = 17;x
-    UINT64 KernelPathSize = (17 + 1) << 1;
+    CHAR16 * KernelPath = Config->Kernel_Path;
+    UINT64 KernelPathSize = Config->Kernel_Path_Size;
+    CHAR16 * KernelOptions = Config->Kernel_Options;
+    UINT64 KernelOptionsSize = Config->Kernel_Options_Size;
 
 
     EFI_FILE *KernelFile;
@@ -189,6 +304,25 @@ EFI_STATUS BootKernel(EFI_HANDLE ImageHandle, GPU_CONFIG * Graphics, EFI_CONFIGU
         return BootStatus;
     }
 
+    // A kernel made with lz4 --content-size is decompressed whole, then loaded from memory just like it would have been from the file
+    KERNEL_SOURCE KernelSource = {KernelFile, NULL, 0, 0};
+    UINT64 KernelImageSize;
+
+    Timings->KernelFileSize = FileInfo->FileSize;
+    if(!EFI_ERROR(LZ4GetContentSize((UINT8*)&DOSheader, size, &KernelImageSize)))
+    {
+      BootStatus = DecompressKernel(&KernelSource, FileInfo->FileSize, KernelImageSize, Timings);
+      if(EFI_ERROR(BootStatus))
+      {
+        return BootStatus;
+      }
+      Timings->KernelImageSize = KernelImageSize;
+    }
+    else
+    {
+      Timings->KernelImageSize = FileInfo->FileSize;
+    }
+
 
 #ifdef x86_64
     // For the entry point jump, we need to know if the file uses ms_abi (is a PE image) or sysv_abi (*NIX image) calling convention
@@ -199,18 +333,10 @@ EFI_STATUS BootKernel(EFI_HANDLE ImageHandle, GPU_CONFIG * Graphics, EFI_CONFIGU
     //  64-Bit ELF Loader
     //----------------------------------------------------------------------------------------------------------------------------------
 
-    // Slightly less terrible way of doing this; just a placeholder.
-    BootStatus = uefi_call_wrapper(KernelFile->SetPosition, 2, KernelFile, 0);
-    if(EFI_ERROR(BootStatus))
-    {
-      Print(L"Reset SetPosition error (ELF). 0x%llx\r\n", BootStatus);
-      return BootStatus;
-    }
-
     Elf64_Ehdr ELF64header;
     size = sizeof(ELF64header); // This works because it's not a pointer
 
-    BootStatus = uefi_call_wrapper(KernelFile->Read, 3, KernelFile, &size, &ELF64header);
+    BootStatus = ReadKernel(&KernelSource, 0, &size, &ELF64header);
     if(EFI_ERROR(BootStatus))
     {
       Print(L"Header read error (ELF). 0x%llx\r\n", BootStatus);
@@ -245,13 +371,7 @@ EFI_STATUS BootKernel(EFI_HANDLE ImageHandle, GPU_CONFIG * Graphics, EFI_CONFIGU
           return BootStatus;
         }
 
-        BootStatus = uefi_call_wrapper(KernelFile->SetPosition, 2, KernelFile, ELF64header.e_phoff); // Go to program headers
-        if(EFI_ERROR(BootStatus))
-        {
-          Print(L"Error setting file position for mapping (ELF). 0x%llx\r\n", BootStatus);
-          return BootStatus;
-        }
-        BootStatus = uefi_call_wrapper(KernelFile->Read, 3, KernelFile, &size, &program_headers_table[0]); // Run right over the section table, it should be exactly the size to hold this data
+        BootStatus = ReadKernel(&KernelSource, ELF64header.e_phoff, &size, &program_headers_table[0]); // Run right over the section table, it should be exactly the size to hold this data
         if(EFI_ERROR(BootStatus))
         {
           Print(L"Error reading program headers (ELF). 0x%llx\r\n", BootStatus);
@@ -275,7 +395,7 @@ EFI_STATUS BootKernel(EFI_HANDLE ImageHandle, GPU_CONFIG * Graphics, EFI_CONFIGU
         KernelPages = pages;
 
 
-        EFI_PHYSICAL_ADDRESS AllocatedMemory = 0x40000000; // 1 GiB
+        EFI_PHYSICAL_ADDRESS AllocatedMemory = KERNEL_PHYSICAL_BASE;
 
 
         BootStatus = uefi_call_wrapper(BS->AllocatePages, 4, AllocateAddress, EfiLoaderData, pages, &AllocatedMemory);
@@ -287,276 +407,88 @@ EFI_STATUS BootKernel(EFI_HANDLE ImageHandle, GPU_CONFIG * Graphics, EFI_CONFIGU
         }
 
 
-        // Zero the allocated pages
-        ZeroMem((VOID*)AllocatedMemory, (pages << EFI_PAGE_SHIFT));
-
-        // If that memory isn't actually free due to weird firmware behavior...
-        // Iterate through the entirety of what was just allocated and check to make sure it's all zeros
-        // Start buggy firmware workaround
-        if(VerifyZeroMem(pages << EFI_PAGE_SHIFT, AllocatedMemory))
+        // Segments are read straight into place. PT_LOAD segments that are the same distance apart in the file as in memory (which is how
+        // linkers lay them out) are read as one run with a single Read(); whatever the file has between them lands in the gaps, which get
+        // zeroed below along with the .bss tails.
+        UINT64 reads = 0;
+        for(i = 0; i < Numofprogheaders; )
         {
-
-          // From UEFI Specification 2.7, Errata A (http://www.uefi.org/specifications):
-          // MemoryType values in the range 0x80000000..0xFFFFFFFF are reserved for use by
-          // UEFI OS loaders that are provided by operating system vendors.
-          // Compare what's there with the kernel file's first bytes; the system might have been reset and the non-zero
-          // memory is what remains of last time. This can be safely overwritten to avoid cluttering up system RAM.
-
-          // Sure hope there aren't any other page-aligned kernel images floating around in memory marked as free
-          // Good thing we know what to expect!
-
-          if(Compare((EFI_PHYSICAL_ADDRESS*)AllocatedMemory, ELFMAG, SELFMAG))
+          Elf64_Phdr *run_start = &program_headers_table[i++];
+          if((run_start->p_type != PT_LOAD) || (run_start->p_filesz == 0)) // Apparently some UEFI implementations can't deal with reading 0 byte sections
           {
-            // Do nothing, we're fine
+            continue;
           }
-          else // Not our remains, proceed with discovery of viable memory address
+
+          UINT64 run_end = run_start->p_offset + run_start->p_filesz; // File offset just past the run
+          for(; i < Numofprogheaders; i++)
           {
-            // Free the pages (well, return them to the system as they were...)
-            BootStatus = uefi_call_wrapper(BS->FreePages, 2, AllocatedMemory, pages);
-            if(EFI_ERROR(BootStatus))
+            Elf64_Phdr *next = &program_headers_table[i];
+            if((next->p_type != PT_LOAD) || (next->p_filesz == 0))
             {
-              Print(L"Could not free pages for ELF sections. Error code: 0x%llx\r\n", BootStatus);
-              return BootStatus;
+              continue;
             }
 
-            // NOTE: CANNOT create an array of all compatible free addresses because the array takes up memory. So does the memory map.
-            // This results in a paradox, so we need to scan the memory map every time we need to find a new address...
-
-            // It appears that AllocateAnyPages uses a "MaxAddress" approach. This will go bottom-up instead.
-            EFI_PHYSICAL_ADDRESS NewAddress = 0; // Start at zero
-            EFI_PHYSICAL_ADDRESS OldAllocatedMemory = AllocatedMemory;
-
-            BootStatus = uefi_call_wrapper(BS->AllocatePages, 4, AllocateAddress, EfiLoaderData, pages, &NewAddress); // Need to check 0x0
-            while(BootStatus != EFI_SUCCESS)
-            { // Keep checking free memory addresses until one works
-
-              if(BootStatus == EFI_NOT_FOUND)
-              {
-                // 0's not a good address (not enough contiguous pages could be found), get another one
-                NewAddress = ActuallyFreeAddress(pages, NewAddress);
-                // Make sure the new address isn't the known bad one
-                if(NewAddress == OldAllocatedMemory)
-                {
-                  // Get a new address if it is
-                  NewAddress = ActuallyFreeAddress(pages, NewAddress);
-                }
-                // Address can be > 4GB
-              }
-              else if(EFI_ERROR(BootStatus))
-              {
-                Print(L"Could not get an address for ELF pages. Error code: 0x%llx\r\n", BootStatus);
-                return BootStatus;
-              }
-
-              if(NewAddress == ~0ULL)
-              {
-                // If you get this, you had no memory free anywhere.
-                Print(L"No memory marked as EfiConventionalMemory...\r\n");
-                return BootStatus;
-              }
-
-              // Allocate the new address
-              BootStatus = uefi_call_wrapper(BS->AllocatePages, 4, AllocateAddress, EfiLoaderData, pages, &NewAddress);
-              // This loop shouldn't run more than once, but in the event something is at 0x0 we need to
-              // leave the loop with an allocated address
-
+            if((next->p_offset < run_end) || ((next->p_offset - run_end) > ELF_READ_GAP_MAX) || ((next->p_vaddr - run_start->p_vaddr) != (next->p_offset - run_start->p_offset)))
+            {
+              break;
             }
+            run_end = next->p_offset + next->p_filesz;
+          }
 
-            // Got a new address that's been allocated--save it
-            AllocatedMemory = NewAddress;
-
-            // Verify it's empty
-            while((NewAddress != ~0ULL) && VerifyZeroMem(pages << EFI_PAGE_SHIFT, AllocatedMemory)) // Loop this in case the firmware is really screwed
-            { // It's not empty :(
-
-              // Sure hope there aren't any other page-aligned kernel images floating around in memory marked as free
-              if(Compare((EFI_PHYSICAL_ADDRESS*)AllocatedMemory, ELFMAG, SELFMAG))
-              {
-                // Do nothing, we're fine
-                break;
-              }
-              else
-              { // Gotta keep looking for a good memory address
-
-                // It's not actually free...
-                BootStatus = uefi_call_wrapper(BS->FreePages, 2, AllocatedMemory, pages);
-                if(EFI_ERROR(BootStatus))
-                {
-                  Print(L"Could not free pages for ELF sections (loop). Error code: 0x%llx\r\n", BootStatus);
-                  return BootStatus;
-                }
-
-                // Allocate a new address
-                BootStatus = EFI_NOT_FOUND;
-                while((BootStatus != EFI_SUCCESS) && (NewAddress != ~0ULL))
-                {
-                  if(BootStatus == EFI_NOT_FOUND)
-                  {
-                    // Get an address (ideally, this should be very rare)
-                    NewAddress = ActuallyFreeAddress(pages, NewAddress);
-                    // Make sure the new address isn't the known bad one
-                    if(NewAddress == OldAllocatedMemory)
-                    {
-                      // Get a new address if it is
-                      NewAddress = ActuallyFreeAddress(pages, NewAddress);
-                    }
-                    // Address can be > 4GB
-                    // This loop will run until we get a good address (shouldn't be more than once, if ever)
-                  }
-                  else if(EFI_ERROR(BootStatus))
-                  {
-                    // EFI_OUT_OF_RESOURCES means the firmware's just not gonna load anything.
-                    Print(L"Could not get an address for ELF pages (loop). Error code: 0x%llx\r\n", BootStatus);
-                    return BootStatus;
-                  }
-                  // NOTE: The number of times the message "No more free addresses" pops up
-                  // helps indicate which NewAddress assignment hit the end.
-
-                  BootStatus = uefi_call_wrapper(BS->AllocatePages, 4, AllocateAddress, EfiLoaderData, pages, &NewAddress);
-                } // loop
-
-                // It's a new address
-                AllocatedMemory = NewAddress;
-
-                // Verify new address is empty (in loop), if not then free it and try again.
-              } // else
-            } // End VerifyZeroMem while loop
-
-            // Ran out of easy addresses, time for a more thorough check
-            // Hopefully no one ever gets here
-            if(AllocatedMemory == ~0ULL)
-            { // NewAddress is also -1
-              NewAddress = ActuallyFreeAddress(pages, 0); // Start from the first suitable EfiConventionalMemory address.
-              // Allocate the page's address
-              BootStatus = EFI_NOT_FOUND;
-              while(BootStatus != EFI_SUCCESS)
-              {
-                if(BootStatus == EFI_NOT_FOUND)
-                {
-                  // Nope, get another one
-                  NewAddress = ActuallyFreeAddressByPage(pages, NewAddress);
-                  // Make sure the new address isn't the known bad one
-                  if(NewAddress == OldAllocatedMemory)
-                  {
-                    // Get a new address if it is
-                    NewAddress = ActuallyFreeAddressByPage(pages, NewAddress);
-                  }
-                  // Adresses very well might be > 4GB with the filesizes these are allowed to be
-                }
-                else if(EFI_ERROR(BootStatus))
-                {
-                  Print(L"Could not get an address for ELF pages by page. Error code: 0x%llx\r\n", BootStatus);
-                  return BootStatus;
-                }
-
-                if(NewAddress == ~0ULL)
-                {
-                  // If you somehow get this, you really had no memory free anywhere.
-                  Print(L"Hmm... How did you get here?\r\n");
-                  return BootStatus;
-                }
-
-                BootStatus = uefi_call_wrapper(BS->AllocatePages, 4, AllocateAddress, EfiLoaderData, pages, &NewAddress);
-              }
-
-              AllocatedMemory = NewAddress;
-
-              while(VerifyZeroMem(pages << EFI_PAGE_SHIFT, AllocatedMemory))
-              {
-                // Sure hope there aren't any other page-aligned kernel images floating around in memory marked as free
-                if(Compare((EFI_PHYSICAL_ADDRESS*)AllocatedMemory, ELFMAG, SELFMAG))
-                {
-
-                  break;
-                }
-                else
-                {
-
-                  // It's not actually free...
-                  BootStatus = uefi_call_wrapper(BS->FreePages, 2, AllocatedMemory, pages);
-                  if(EFI_ERROR(BootStatus))
-                  {
-                    Print(L"Could not free pages for ELF sections by page (loop). Error code: 0x%llx\r\n", BootStatus);
-                    return BootStatus;
-                  }
-
-                  BootStatus = EFI_NOT_FOUND;
-                  while(BootStatus != EFI_SUCCESS)
-                  {
-                    if(BootStatus == EFI_NOT_FOUND)
-                    {
-                      // Nope, get another one
-                      NewAddress = ActuallyFreeAddressByPage(pages, NewAddress);
-                      // Make sure the new address isn't the known bad one
-                      if(NewAddress == OldAllocatedMemory)
-                      {
-                        // Get a new address if it is
-                        NewAddress = ActuallyFreeAddressByPage(pages, NewAddress);
-                      }
-                      // Address can be > 4GB
-                    }
-                    else if(EFI_ERROR(BootStatus))
-                    {
-                      Print(L"Could not get an address for ELF pages by page (loop). Error code: 0x%llx\r\n", BootStatus);
-                      return BootStatus;
-                    }
-
-                    if(AllocatedMemory == ~0ULL)
-                    {
-                      // Well, darn. Something's up with the system memory.
-                      return BootStatus;
-                    }
-
-                    BootStatus = uefi_call_wrapper(BS->AllocatePages, 4, AllocateAddress, EfiLoaderData, pages, &NewAddress);
-                  } // loop
-
-                  AllocatedMemory = NewAddress;
-
-                } // else
-              } // end ByPage VerifyZeroMem loop
-            } // End "big guns"
-
-            // Got a good address!
-          } // End discovery of viable memory address (else)
-          // Can move on now
-        } // End VerifyZeroMem buggy firmware workaround (outermost if)
-        else
-        {
+          UINTN RawDataSize = run_end - run_start->p_offset; // 64-bit ELFs can have 64-bit file sizes!
+          EFI_PHYSICAL_ADDRESS SectionAddress = AllocatedMemory + (run_start->p_vaddr - virt_min); // 64-bit ELFs use 64-bit addressing!
 
+          BootStatus = ReadKernel(&KernelSource, run_start->p_offset, &RawDataSize, (EFI_PHYSICAL_ADDRESS*)SectionAddress); // p_offset is a UINT64 relative to the beginning of the file, just like Read() expects!
+          if(EFI_ERROR(BootStatus))
+          {
+            Print(L"Program segment read error (ELF). 0x%llx\r\n", BootStatus);
+            return BootStatus;
+          }
+          if(RawDataSize != (run_end - run_start->p_offset))
+          {
+            Print(L"Kernel file is truncated (ELF).\r\n");
+            return EFI_LOAD_ERROR;
+          }
+          reads++;
         }
 
-
-        // No need to copy headers to memory for ELFs, just the program itself
-        // Only want to include PT_LOAD segments
-        for(i = 0; i < Numofprogheaders; i++) // Load sections into memory
+        // Zero everything that didn't come from the file: gaps between segments, .bss tails and the end of the last page.
+        // PT_LOAD segments are sorted by address, so one pass does it.
+        UINT64 filled = 0; // Bytes from the start of the allocation that already hold their final contents
+        for(i = 0; i < Numofprogheaders; i++)
         {
           Elf64_Phdr *specific_program_header = &program_headers_table[i];
-          UINTN RawDataSize = specific_program_header->p_filesz; // 64-bit ELFs can have 64-bit file sizes!
-          EFI_PHYSICAL_ADDRESS SectionAddress = AllocatedMemory + (specific_program_header->p_vaddr - program_headers_table[0].p_vaddr); // 64-bit ELFs use 64-bit addressing!
-
-          if(specific_program_header->p_type == PT_LOAD)
+          if(specific_program_header->p_type != PT_LOAD)
           {
+            continue;
+          }
 
-            BootStatus = uefi_call_wrapper(KernelFile->SetPosition, 2, KernelFile, specific_program_header->p_offset); // p_offset is a UINT64 relative to the beginning of the file, just like Read() expects!
-            if(EFI_ERROR(BootStatus))
-            {
-              Print(L"Program segment SetPosition error (ELF). 0x%llx\r\n", BootStatus);
-              return BootStatus;
-            }
+          UINT64 segment_start = specific_program_header->p_vaddr - virt_min;
+          if(segment_start > filled)
+          {
+            uefi_call_wrapper(BS->SetMem, 3, (VOID*)(AllocatedMemory + filled), segment_start - filled, 0);
+          }
+          if(segment_start + specific_program_header->p_filesz > filled)
+          {
+            filled = segment_start + specific_program_header->p_filesz;
+          }
+        }
+        uefi_call_wrapper(BS->SetMem, 3, (VOID*)(AllocatedMemory + filled), (pages << EFI_PAGE_SHIFT) - filled, 0);
 
-            if(RawDataSize != 0) // Apparently some UEFI implementations can't deal with reading 0 byte sections
-            {
-              BootStatus = uefi_call_wrapper(KernelFile->Read, 3, KernelFile, &RawDataSize, (EFI_PHYSICAL_ADDRESS*)SectionAddress);
-              if(EFI_ERROR(BootStatus))
-              {
-                Print(L"Program segment read error (ELF). 0x%llx\r\n", BootStatus);
-                return BootStatus;
-              }
-            }
+        if(KernelSource.Image)
+        {
+          BootStatus = uefi_call_wrapper(BS->FreePages, 2, (EFI_PHYSICAL_ADDRESS)KernelSource.Image, KernelSource.ImagePages);
+          if(EFI_ERROR(BootStatus))
+          {
+            Print(L"Error freeing decompressed kernel pages. 0x%llx\r\n", BootStatus);
           }
         }
+        else
+        {
+          Print(L"Loaded %llu KiB of kernel in %llu reads\r\n", (pages << EFI_PAGE_SHIFT) >> 10, reads);
+        }
 
-        EFI_PHYSICAL_ADDRESS startAddress = program_headers_table[0].p_vaddr;
+        EFI_PHYSICAL_ADDRESS startAddress = virt_min;
         // Done with program_headers_table
         if(program_headers_table)
         {
@@ -601,6 +533,8 @@ EFI_STATUS BootKernel(EFI_HANDLE ImageHandle, GPU_CONFIG * Graphics, EFI_CONFIGU
       }
   }
 
+  Timings->Phases[BOOT_PHASE_KERNEL_LOAD].End = ReadBootTimestamp();
+
   // Reserve memory for the loader block
   LOADER_PARAMS * Loader_block;
   BootStatus = uefi_call_wrapper(BS->AllocatePool, 3, EfiLoaderData, sizeof(LOADER_PARAMS), (void**)&Loader_block);
@@ -620,6 +554,7 @@ EFI_STATUS BootKernel(EFI_HANDLE ImageHandle, GPU_CONFIG * Graphics, EFI_CONFIGU
   EFI_MEMORY_DESCRIPTOR * MemMap = NULL;
 
   // Get memory map and exit boot services
+  Timings->Phases[BOOT_PHASE_EXIT_BOOT].Start = ReadBootTimestamp();
   BootStatus = uefi_call_wrapper(BS->GetMemoryMap, 5, &MemMapSize, MemMap, &MemMapKey, &MemMapDescriptorSize, &MemMapDescriptorVersion);
   if(BootStatus == EFI_BUFFER_TOO_SMALL)
   {
@@ -671,6 +606,7 @@ EFI_STATUS BootKernel(EFI_HANDLE ImageHandle, GPU_CONFIG * Graphics, EFI_CONFIGU
     Print(L"DescriptorSize: %llx, DescriptorVersion: %x\r\n", MemMapDescriptorSize, MemMapDescriptorVersion);
     return BootStatus;
   }
+  Timings->Phases[BOOT_PHASE_EXIT_BOOT].End = ReadBootTimestamp();
 
   //----------------------------------------------------------------------------------------------------------------------------------
   //  Entry Point Jump
@@ -693,6 +629,8 @@ EFI_STATUS BootKernel(EFI_HANDLE ImageHandle, GPU_CONFIG * Graphics, EFI_CONFIGU
   Loader_block->ESP_Root_Size = ESPRootSize;
   Loader_block->Kernel_Path = KernelPath;
   Loader_block->Kernel_Path_Size = KernelPathSize;
+  Loader_block->Kernel_Options = KernelOptions;
+  Loader_block->Kernel_Options_Size = KernelOptionsSize;
 
   Loader_block->RTServices = RT;
   Loader_block->GPU_Configs = Graphics;
@@ -700,6 +638,7 @@ EFI_STATUS BootKernel(EFI_HANDLE ImageHandle, GPU_CONFIG * Graphics, EFI_CONFIGU
 
   Loader_block->ConfigTables = SysCfgTables;
   Loader_block->Number_of_ConfigTables = NumSysCfgTables;
+  Loader_block->Boot_Timings = Timings;
 
 #ifdef x86_64
 
@@ -733,6 +672,162 @@ EFI_STATUS BootKernel(EFI_HANDLE ImageHandle, GPU_CONFIG * Graphics, EFI_CONFIGU
 
 
 
+// Copies one line of an ASCII (or UTF-8) text file into a new UTF-16 string
+static EFI_STATUS CopyConfigLine(UINT8 * Start, UINT8 * End, CHAR16 ** Line, UINT64 * LineSize)
+{
+  if((End > Start) && (End[-1] == '\r'))
+    End--;
+
+  UINT64 Length = End - Start;
+  CHAR16 * Copy;
+
+  EFI_STATUS Status = uefi_call_wrapper(BS->AllocatePool, 3, EfiLoaderData, (Length + 1) * sizeof(CHAR16), (void**)&Copy);
+  if(EFI_ERROR(Status))
+    return Status;
+
+  for(UINT64 i = 0; i < Length; i++)
+    Copy[i] = Start[i];
+  Copy[Length] = L'\0';
+
+  *Line = Copy;
+  *LineSize = (Length + 1) * sizeof(CHAR16);
+  return EFI_SUCCESS;
+}
+
+// Leaves the defaults alone if there's no Kernel64.txt, or for whichever line is missing or empty
+EFI_STATUS ReadKernelConfig(EFI_FILE * DriveRoot, CHAR16 ** KernelPath, UINT64 * KernelPathSize, CHAR16 ** KernelOptions, UINT64 * KernelOptionsSize)
+{
+  EFI_FILE * ConfigFile;
+  UINT8 Config[KERNEL_CONFIG_MAX_SIZE];
+  UINTN ConfigSize = sizeof(Config);
+
+  EFI_STATUS Status = uefi_call_wrapper(DriveRoot->Open, 5, DriveRoot, &ConfigFile, KERNEL_CONFIG_PATH, EFI_FILE_MODE_READ, EFI_FILE_READ_ONLY);
+  if(Status == EFI_NOT_FOUND)
+    return EFI_SUCCESS;
+  if(EFI_ERROR(Status))
+    return Status;
+
+  Status = uefi_call_wrapper(ConfigFile->Read, 3, ConfigFile, &ConfigSize, Config);
+  uefi_call_wrapper(ConfigFile->Close, 1, ConfigFile);
+  if(EFI_ERROR(Status))
+    return Status;
+
+  UINT8 * ConfigEnd = Config + ConfigSize;
+  UINT8 * LineStart = Config;
+
+  // Skip a UTF-8 byte order mark
+  if((ConfigSize >= 3) && (Config[0] == 0xEF) && (Config[1] == 0xBB) && (Config[2] == 0xBF))
+    LineStart += 3;
+
+  for(UINT8 LineNumber = 0; (LineNumber < 2) && (LineStart < ConfigEnd); LineNumber++)
+  {
+    UINT8 * LineEnd = LineStart;
+    while((LineEnd < ConfigEnd) && (*LineEnd != '\n'))
+      LineEnd++;
+
+    if((LineEnd > LineStart) && !((LineEnd == LineStart + 1) && (*LineStart == '\r')))
+    {
+      if(LineNumber == 0)
+        Status = CopyConfigLine(LineStart, LineEnd, KernelPath, KernelPathSize);
+      else
+        Status = CopyConfigLine(LineStart, LineEnd, KernelOptions, KernelOptionsSize);
+
+      if(EFI_ERROR(Status))
+        return Status;
+    }
+
+    LineStart = LineEnd + 1;
+  }
+
+  return EFI_SUCCESS;
+}
+
+// Reads the digits at *Text, leaving *Text just past them
+static UINT32 ParseDecimal(CHAR16 ** Text)
+{
+  UINT32 Value = 0;
+
+  for(; (**Text >= L'0') && (**Text <= L'9'); (*Text)++)
+    Value = (Value * 10) + (**Text - L'0');
+
+  return Value;
+}
+
+// Finds video= among the space separated kernel options. Anything it doesn't understand means auto.
+static VOID ParseVideoOption(CHAR16 * Options, VIDEO_CONFIG * Video)
+{
+  Video->Policy = VIDEO_POLICY_AUTO;
+  Video->Width = 0;
+  Video->Height = 0;
+  Video->PixelFormat = PixelFormatMax;
+
+  for(CHAR16 * Option = Options; *Option != L'\0'; )
+  {
+    while(*Option == L' ')
+      Option++;
+
+    if(StrnCmp(Option, L"video=", 6) == 0)
+    {
+      CHAR16 * Value = Option + 6;
+
+      if(StrnCmp(Value, L"current", 7) == 0)
+        Video->Policy = VIDEO_POLICY_CURRENT;
+      else if(StrnCmp(Value, L"menu", 4) == 0)
+        Video->Policy = VIDEO_POLICY_MENU;
+      else if((*Value >= L'0') && (*Value <= L'9'))
+      {
+        Video->Width = ParseDecimal(&Value);
+        if(*Value == L'x')
+        {
+          Value++;
+          Video->Height = ParseDecimal(&Value);
+          Video->Policy = VIDEO_POLICY_SIZE;
+        }
+
+        if(StrnCmp(Value, L",rgb", 4) == 0)
+          Video->PixelFormat = PixelRedGreenBlueReserved8BitPerColor;
+        else if(StrnCmp(Value, L",bgr", 4) == 0)
+          Video->PixelFormat = PixelBlueGreenRedReserved8BitPerColor;
+      }
+    }
+
+    while((*Option != L' ') && (*Option != L'\0'))
+      Option++;
+  }
+}
+
+// Config is always usable afterwards: on an error, whatever couldn't be read keeps its default
+EFI_STATUS LoadBootConfig(EFI_HANDLE ImageHandle, BOOT_CONFIG * Config)
+{
+  Config->Kernel_Path = L"\\Pious\\Kernel.exe";
+  Config->Kernel_Path_Size = (17 + 1) << 1;
+  Config->Kernel_Options = L"";
+  Config->Kernel_Options_Size = sizeof(CHAR16);
+  ParseVideoOption(Config->Kernel_Options, &Config->Video);
+
+  EFI_LOADED_IMAGE_PROTOCOL *LoadedImage;
+  EFI_SIMPLE_FILE_SYSTEM_PROTOCOL *FileSystem;
+  EFI_FILE *DriveRoot;
+
+  EFI_STATUS Status = uefi_call_wrapper(BS->OpenProtocol, 6, ImageHandle, &LoadedImageProtocol, (void**)&LoadedImage, ImageHandle, NULL, EFI_OPEN_PROTOCOL_GET_PROTOCOL);
+  if(EFI_ERROR(Status))
+    return Status;
+
+  Status = uefi_call_wrapper(BS->OpenProtocol, 6, LoadedImage->DeviceHandle, &FileSystemProtocol, (void**)&FileSystem, ImageHandle, NULL, EFI_OPEN_PROTOCOL_GET_PROTOCOL);
+  if(EFI_ERROR(Status))
+    return Status;
+
+  Status = uefi_call_wrapper(FileSystem->OpenVolume, 2, FileSystem, &DriveRoot);
+  if(EFI_ERROR(Status))
+    return Status;
+
+  Status = ReadKernelConfig(DriveRoot, &Config->Kernel_Path, &Config->Kernel_Path_Size, &Config->Kernel_Options, &Config->Kernel_Options_Size);
+  uefi_call_wrapper(DriveRoot->Close, 1, DriveRoot);
+
+  ParseVideoOption(Config->Kernel_Options, &Config->Video);
+  return Status;
+}
+
 UINT8 Compare(const void* firstitem, const void* seconditem, UINT64 comparelength)
 {
   // Using const since this is a read-only operation: absolutely nothing should be changed here.
@@ -747,147 +842,214 @@ UINT8 Compare(const void* firstitem, const void* seconditem, UINT64 comparelengt
   return 1;
 }
 
-UINT8 VerifyZeroMem(UINT64 NumBytes, UINT64 BaseAddr) // BaseAddr is a 64-bit unsigned int whose value is the memory address
+
+// This array is a global variable so that it can be made static, which helps prevent a stack overflow if it ever needs to lengthen.
+STATIC CONST CHAR16 PxFormats[5][17] = {
+    L"RGBReserved 8Bpp",
+    L"BGRReserved 8Bpp",
+    L"PixelBitMask    ",
+    L"PixelBltOnly    ",
+    L"PixelFormatMax  "
+};
+
+// Picks a mode for GOPTable by Video's policy, without asking. Modes that only support Blt() are never picked since the kernel needs a framebuffer.
+static EFI_STATUS PickGraphicsMode(EFI_GRAPHICS_OUTPUT_PROTOCOL * GOPTable, VIDEO_CONFIG * Video, UINT32 * Mode)
 {
-  for(UINT64 i = 0; i < NumBytes; i++)
+  EFI_GRAPHICS_OUTPUT_MODE_INFORMATION *GOPInfo;
+  UINTN GOPInfoSize;
+  UINT64 BestPixels = 0;
+
+  *Mode = GOPTable->Mode->Mode; // If nothing is better, stay in the current mode
+
+  if(Video->Policy == VIDEO_POLICY_CURRENT)
+  {
+    return EFI_SUCCESS;
+  }
+
+  for(UINT32 mode = 0; mode < GOPTable->Mode->MaxMode; mode++)
   {
-    if(*(((UINT8*)BaseAddr) + i) != 0)
+    EFI_STATUS Status = uefi_call_wrapper(GOPTable->QueryMode, 4, GOPTable, mode, &GOPInfoSize, &GOPInfo);
+    if(EFI_ERROR(Status))
+    {
+      Print(L"GraphicsTable QueryMode error. 0x%llx\r\n", Status);
+      return Status;
+    }
+
+    UINT64 Pixels = (UINT64)GOPInfo->HorizontalResolution * GOPInfo->VerticalResolution;
+    BOOLEAN Usable = (GOPInfo->PixelFormat != PixelBltOnly);
+    BOOLEAN Requested = (Video->Policy == VIDEO_POLICY_SIZE) && (GOPInfo->HorizontalResolution == Video->Width) && (GOPInfo->VerticalResolution == Video->Height)
+                        && ((Video->PixelFormat == PixelFormatMax) || (GOPInfo->PixelFormat == Video->PixelFormat));
+
+    Status = uefi_call_wrapper(BS->FreePool, 1, GOPInfo);
+    if(EFI_ERROR(Status))
+    {
+      Print(L"Error freeing GOPInfo pool. 0x%llx\r\n", Status);
+      return Status;
+    }
+
+    if(!Usable)
+    {
+      continue;
+    }
+
+    if(Requested)
+    {
+      *Mode = mode;
+      break;
+    }
+
+    if(Pixels > BestPixels)
     {
-      return 1;
+      BestPixels = Pixels;
+      *Mode = mode;
     }
   }
-  return 0;
+
+  return EFI_SUCCESS;
 }
 
+static EFI_GUID PiousVariableGuid = PIOUS_VARIABLE_GUID;
 
-EFI_PHYSICAL_ADDRESS ActuallyFreeAddress(UINT64 pages, EFI_PHYSICAL_ADDRESS OldAddress)
+// Each GOP device gets its own cache variable, named after a CRC32 of its device path. Name is left empty (no caching) if it doesn't have one.
+static VOID GetModeCacheName(EFI_HANDLE GraphicsHandle, CHAR16 * Name)
 {
-  EFI_STATUS memmap_status;
-  UINTN MemMapSize = 0, MemMapKey, MemMapDescriptorSize;
-  UINT32 MemMapDescriptorVersion;
-  EFI_MEMORY_DESCRIPTOR * MemMap = NULL;
-  EFI_MEMORY_DESCRIPTOR * Piece;
+  EFI_DEVICE_PATH * DevicePath = DevicePathFromHandle(GraphicsHandle);
+  UINT32 Crc;
 
-  memmap_status = uefi_call_wrapper(BS->GetMemoryMap, 5, &MemMapSize, MemMap, &MemMapKey, &MemMapDescriptorSize, &MemMapDescriptorVersion);
-  if(memmap_status == EFI_BUFFER_TOO_SMALL)
+  Name[0] = L'\0';
+  if(DevicePath == NULL)
   {
-    memmap_status = uefi_call_wrapper(BS->AllocatePool, 3, EfiBootServicesData, MemMapSize, (void **)&MemMap); // Allocate pool for MemMap
-    if(EFI_ERROR(memmap_status)) // Error! Wouldn't be safe to continue.
-    {
-      Print(L"ActuallyFreeAddress MemMap AllocatePool error. 0x%llx\r\n", memmap_status);
-      return ~0ULL;
-    }
-    memmap_status = uefi_call_wrapper(BS->GetMemoryMap, 5, &MemMapSize, MemMap, &MemMapKey, &MemMapDescriptorSize, &MemMapDescriptorVersion);
+    return;
   }
-  if(EFI_ERROR(memmap_status))
+
+  if(!EFI_ERROR(uefi_call_wrapper(BS->CalculateCrc32, 3, DevicePath, DevicePathSize(DevicePath), &Crc)))
   {
-    Print(L"Error getting memory map for ActuallyFreeAddress. 0x%llx\r\n", memmap_status);
-    return ~0ULL;
+    SPrint(Name, GOP_MODE_CACHE_NAME_LENGTH * sizeof(CHAR16), L"GraphicsMode%08x", Crc);
   }
+}
+
+// Returns TRUE with the cached mode if it was picked under the same policy and the GPU still has it. When it's the current mode, not even QueryMode() is needed.
+static BOOLEAN LoadCachedGraphicsMode(CHAR16 * Name, EFI_GRAPHICS_OUTPUT_PROTOCOL * GOPTable, VIDEO_CONFIG * Video, UINT32 * Mode)
+{
+  GOP_MODE_CACHE Cache;
+  UINTN CacheSize = sizeof(Cache);
 
-  // Multiply NumberOfPages by EFI_PAGE_SIZE to get the end address... which should just be the start of the next section.
-  // Check for EfiConventionalMemory in the map
-  for(Piece = MemMap; Piece < (EFI_MEMORY_DESCRIPTOR*)((UINT8*)MemMap + MemMapSize); Piece = (EFI_MEMORY_DESCRIPTOR*)((UINT8*)Piece + MemMapDescriptorSize))
+  if((Name[0] == L'\0') || (Video->Policy == VIDEO_POLICY_CURRENT))
   {
-    // Within each compatible EfiConventionalMemory, look for space
-    if((Piece->Type == EfiConventionalMemory) && (Piece->NumberOfPages >= pages) && (Piece->PhysicalStart > OldAddress))
-    {
-      break;
-    }
+    return FALSE;
+  }
+
+  EFI_STATUS Status = uefi_call_wrapper(RT->GetVariable, 5, Name, &PiousVariableGuid, NULL, &CacheSize, &Cache);
+  if(EFI_ERROR(Status) || (CacheSize != sizeof(Cache)))
+  {
+    return FALSE;
   }
 
-  // Loop ended without a DiscoveredAddress
-  if(Piece >= (EFI_MEMORY_DESCRIPTOR*)((UINT8*)MemMap + MemMapSize))
+  if((Cache.MaxMode != GOPTable->Mode->MaxMode) || (Cache.Mode >= Cache.MaxMode) || !Compare(&Cache.Video, Video, sizeof(VIDEO_CONFIG)))
   {
-    return ~0ULL;
+    return FALSE;
   }
 
-  memmap_status = uefi_call_wrapper(BS->FreePool, 1, MemMap);
-  if(EFI_ERROR(memmap_status))
+  BOOLEAN Matches;
+  if((GOPTable->Mode->Mode == Cache.Mode) && (GOPTable->Mode->SizeOfInfo >= sizeof(Cache.Info)))
+  {
+    Matches = Compare(GOPTable->Mode->Info, &Cache.Info, sizeof(Cache.Info));
+  }
+  else
   {
-    Print(L"Error freeing ActuallyFreeAddress memmap pool. 0x%llx\r\n", memmap_status);
+    EFI_GRAPHICS_OUTPUT_MODE_INFORMATION *GOPInfo;
+    UINTN GOPInfoSize;
+
+    Status = uefi_call_wrapper(GOPTable->QueryMode, 4, GOPTable, Cache.Mode, &GOPInfoSize, &GOPInfo);
+    if(EFI_ERROR(Status))
+    {
+      return FALSE;
+    }
+
+    Matches = (GOPInfoSize >= sizeof(Cache.Info)) && Compare(GOPInfo, &Cache.Info, sizeof(Cache.Info));
+    uefi_call_wrapper(BS->FreePool, 1, GOPInfo);
   }
 
-  return Piece->PhysicalStart;
+  if(Matches)
+  {
+    *Mode = Cache.Mode;
+  }
+  return Matches;
 }
 
-EFI_PHYSICAL_ADDRESS ActuallyFreeAddressByPage(UINT64 pages, EFI_PHYSICAL_ADDRESS OldAddress)
+// Remembers the mode GOPTable is in now. Only writes the variable if it changed, since it lives in flash.
+static VOID SaveCachedGraphicsMode(CHAR16 * Name, EFI_GRAPHICS_OUTPUT_PROTOCOL * GOPTable, VIDEO_CONFIG * Video)
 {
-  EFI_STATUS memmap_status;
-  UINTN MemMapSize = 0, MemMapKey, MemMapDescriptorSize;
-  UINT32 MemMapDescriptorVersion;
-  EFI_MEMORY_DESCRIPTOR * MemMap = NULL;
-  EFI_MEMORY_DESCRIPTOR * Piece;
-  EFI_PHYSICAL_ADDRESS PhysicalEnd;
-  EFI_PHYSICAL_ADDRESS DiscoveredAddress;
+  GOP_MODE_CACHE Cache, OldCache;
+  UINTN CacheSize = sizeof(OldCache);
 
-  memmap_status = uefi_call_wrapper(BS->GetMemoryMap, 5, &MemMapSize, MemMap, &MemMapKey, &MemMapDescriptorSize, &MemMapDescriptorVersion);
-  if(memmap_status == EFI_BUFFER_TOO_SMALL)
+  if((Name[0] == L'\0') || (Video->Policy == VIDEO_POLICY_CURRENT) || (GOPTable->Mode->SizeOfInfo < sizeof(Cache.Info)))
   {
-    memmap_status = uefi_call_wrapper(BS->AllocatePool, 3, EfiBootServicesData, MemMapSize, (void **)&MemMap); // Allocate pool for MemMap
-    if(EFI_ERROR(memmap_status)) // Error! Wouldn't be safe to continue.
-    {
-      Print(L"ActuallyFreeAddressByPage MemMap AllocatePool error. 0x%llx\r\n", memmap_status);
-      return ~0ULL;
-    }
-    memmap_status = uefi_call_wrapper(BS->GetMemoryMap, 5, &MemMapSize, MemMap, &MemMapKey, &MemMapDescriptorSize, &MemMapDescriptorVersion);
+    return;
+  }
+
+  ZeroMem(&Cache, sizeof(Cache));
+  Cache.Mode = GOPTable->Mode->Mode;
+  Cache.MaxMode = GOPTable->Mode->MaxMode;
+  Cache.Video = *Video;
+  Cache.Info = *(GOPTable->Mode->Info);
+
+  EFI_STATUS Status = uefi_call_wrapper(RT->GetVariable, 5, Name, &PiousVariableGuid, NULL, &CacheSize, &OldCache);
+  if(!EFI_ERROR(Status) && (CacheSize == sizeof(OldCache)) && Compare(&OldCache, &Cache, sizeof(Cache)))
+  {
+    return;
   }
-  if(EFI_ERROR(memmap_status))
+
+  Status = uefi_call_wrapper(RT->SetVariable, 5, Name, &PiousVariableGuid, EFI_VARIABLE_NON_VOLATILE | EFI_VARIABLE_BOOTSERVICE_ACCESS, sizeof(Cache), &Cache);
+  if(EFI_ERROR(Status))
   {
-    Print(L"Error getting memory map for ActuallyFreeAddressByPage. 0x%llx\r\n", memmap_status);
-    return ~0ULL;
+    Print(L"Couldn't save the graphics mode (%s). 0x%llx\r\n", Name, Status);
   }
+}
 
-  // Multiply NumberOfPages by EFI_PAGE_SIZE to get the end address... which should just be the start of the next section.
-  // Check for EfiConventionalMemory in the map
-  for(Piece = MemMap; Piece < (EFI_MEMORY_DESCRIPTOR*)((UINT8*)MemMap + MemMapSize); Piece = (EFI_MEMORY_DESCRIPTOR*)((UINT8*)Piece + MemMapDescriptorSize))
+// Sets the mode and copies it into GPU for the kernel
+static EFI_STATUS SetGraphicsMode(EFI_GRAPHICS_OUTPUT_PROTOCOL * GOPTable, UINT32 Mode, EFI_GRAPHICS_OUTPUT_PROTOCOL_MODE * GPU)
+{
+  EFI_STATUS Status;
+
+  // SetMode() is usually a full modeset and can take hundreds of ms, so it's skipped if the GPU is already in that mode.
+  // Per spec, the FrameBufferBase might be 0 until SetMode is called, so that still gets it.
+  if((GOPTable->Mode->Mode != Mode) || (GOPTable->Mode->FrameBufferBase == 0))
   {
-    // Within each compatible EfiConventionalMemory, look for space
-    if((Piece->Type == EfiConventionalMemory) && (Piece->NumberOfPages >= pages))
+    Print(L"Setting graphics mode %u of %u.\r\n\n", Mode + 1, GOPTable->Mode->MaxMode);
+
+    // This is supposed to black the screen out per spec, but apparently not every GPU got the memo.
+    Status = uefi_call_wrapper(GOPTable->SetMode, 2, GOPTable, Mode);
+    if(EFI_ERROR(Status))
     {
-      PhysicalEnd = Piece->PhysicalStart + (Piece->NumberOfPages << EFI_PAGE_SHIFT) - EFI_PAGE_MASK; // Get the end of this range, and use it to set a bound on the range (define a max returnable address).
-      // (pages*EFI_PAGE_SIZE) or (pages << EFI_PAGE_SHIFT) gives the size the kernel would take up in memory
-      if((OldAddress >= Piece->PhysicalStart) && ((OldAddress + (pages << EFI_PAGE_SHIFT)) < PhysicalEnd)) // Bounds check on OldAddress
-      {
-        // Return the next available page's address in the range. We need to go page-by-page for the really buggy systems.
-        DiscoveredAddress = OldAddress + EFI_PAGE_SIZE; // Left shift EFI_PAGE_SIZE by 1 or 2 to check every 0x10 or 0x100 pages (must also modify the above PhysicalEnd bound check)
-        break;
-        // If PhysicalEnd == OldAddress, we need to go to the next EfiConventionalMemory range
-      }
-      else if(Piece->PhysicalStart > OldAddress) // Try a new range
-      {
-        DiscoveredAddress = Piece->PhysicalStart;
-        break;
-      }
+      Print(L"GraphicsTable SetMode error. 0x%llx\r\n", Status);
+      return Status;
     }
   }
-
-  // Loop ended without a DiscoveredAddress
-  if(Piece >= (EFI_MEMORY_DESCRIPTOR*)((UINT8*)MemMap + MemMapSize))
+  else
   {
-    // Return address -1, which will cause AllocatePages to fail
-    return ~0ULL;
+    Print(L"Keeping graphics mode %u of %u.\r\n\n", Mode + 1, GOPTable->Mode->MaxMode);
   }
 
-  memmap_status = uefi_call_wrapper(BS->FreePool, 1, MemMap);
-  if(EFI_ERROR(memmap_status))
+  Status = uefi_call_wrapper(BS->AllocatePool, 3, EfiLoaderData, GOPTable->Mode->SizeOfInfo, (void**)&GPU->Info);
+  if(EFI_ERROR(Status))
   {
-    Print(L"Error freeing ActuallyFreeAddressByPage memmap pool. 0x%llx\r\n", memmap_status);
+    Print(L"GOP Mode->Info AllocatePool error. 0x%llx\r\n", Status);
+    return Status;
   }
 
-  return DiscoveredAddress;
-}
+  // Can't blanketly store Mode struct because Mode->Info pointer in array will get overwritten
+  GPU->MaxMode = GOPTable->Mode->MaxMode;
+  GPU->Mode = GOPTable->Mode->Mode;
+  GPU->SizeOfInfo = GOPTable->Mode->SizeOfInfo;
+  GPU->FrameBufferBase = GOPTable->Mode->FrameBufferBase;
+  GPU->FrameBufferSize = GOPTable->Mode->FrameBufferSize;
+  *(GPU->Info) = *(GOPTable->Mode->Info);
 
-// This array is a global variable so that it can be made static, which helps prevent a stack overflow if it ever needs to lengthen.
-STATIC CONST CHAR16 PxFormats[5][17] = {
-    L"RGBReserved 8Bpp",
-    L"BGRReserved 8Bpp",
-    L"PixelBitMask    ",
-    L"PixelBltOnly    ",
-    L"PixelFormatMax  "
-};
+  return EFI_SUCCESS;
+}
 
-EFI_STATUS InitUEFI_GOP(EFI_HANDLE ImageHandle, GPU_CONFIG * Graphics)
+EFI_STATUS InitUEFI_GOP(EFI_HANDLE ImageHandle, GPU_CONFIG * Graphics, VIDEO_CONFIG * Video)
 { // Declaring a pointer only allocates 8 bytes (64-bit) for that pointer. Buffers must be manually allocated memory via AllocatePool and then freed with FreePool when done with.
 
   Graphics->NumberOfFrameBuffers = 0;
@@ -904,6 +1066,17 @@ EFI_STATUS InitUEFI_GOP(EFI_HANDLE ImageHandle, GPU_CONFIG * Graphics)
 
   Key.UnicodeChar = 0;
 
+  // The menus only come up when asked for, so unattended boots never wait. A hotkey pressed during POST is still waiting in ConIn.
+  BOOLEAN ShowMenu = (Video->Policy == VIDEO_POLICY_MENU);
+  while(uefi_call_wrapper(ST->ConIn->ReadKeyStroke, 2, ST->ConIn, &Key) == EFI_SUCCESS)
+  {
+    if((Key.UnicodeChar == GPU_MENU_HOTKEY) || (Key.UnicodeChar == (GPU_MENU_HOTKEY - L'a' + L'A')))
+    {
+      ShowMenu = TRUE;
+    }
+  }
+  Key.UnicodeChar = 0;
+
   // Vendors go all over the place with these...
   CHAR8 LanguageToUse[6] = {'e','n','-','U','S','\0'};
   CHAR8 LanguageToUse2[3] = {'e','n','\0'};
@@ -986,6 +1159,12 @@ EFI_STATUS InitUEFI_GOP(EFI_HANDLE ImageHandle, GPU_CONFIG * Graphics)
 
   for(DevNum = 0; DevNum < NumHandlesInHandleBuffer; DevNum++)
   {
+    NameBuffer[DevNum] = NULL;
+    if(!ShowMenu) // Names are only for the menus, and finding them is most of the work here
+    {
+      continue;
+    }
+
     DriverDisplayName = DefaultDriverDisplayName;
     ControllerDisplayName = DefaultControllerDisplayName;
     ChildDisplayName = DefaultChildDisplayName;
@@ -1370,15 +1549,13 @@ EFI_STATUS InitUEFI_GOP(EFI_HANDLE ImageHandle, GPU_CONFIG * Graphics)
   {
     // Using this as the choice holder
     // This sets the default option.
-    DevNum = 2;
+    DevNum = 4;
     UINT64 timeout_seconds = GPU_MENU_TIMEOUT_SECONDS;
     // FYI: The EFI watchdog has something like a 5 minute timeout before it resets the system if ExitBootServices() hasn't been reached.
     // Not all systems have a watchdog enabled, but enough do that knowing about the watchdog (and assuming there's always one) is useful.
 
-#ifdef DEBUG_PIOUS
-
     // User selection
-    while(0x30 > Key.UnicodeChar || Key.UnicodeChar > 0x33)
+    while(ShowMenu && (0x30 > Key.UnicodeChar || Key.UnicodeChar > 0x34))
     {
       for(UINTN DevNumIter = 0; DevNumIter < NumHandlesInHandleBuffer; DevNumIter++)
       {
@@ -1391,6 +1568,7 @@ EFI_STATUS InitUEFI_GOP(EFI_HANDLE ImageHandle, GPU_CONFIG * Graphics)
       Print(L"1. Configure one\r\n");
       Print(L"2. Configure all to use default resolutions of active displays (usually native)\r\n");
       Print(L"3. Configure all to use 1024x768\r\n");
+      Print(L"4. Configure all automatically (video= in Kernel64.txt, highest resolution by default)\r\n");
       Print(L"\r\nNote: The \"active display(s)\" on a GPU are determined by the GPU's firmware, and not all output ports may be currently active.\r\n\n");
 
       while(timeout_seconds)
@@ -1419,7 +1597,7 @@ EFI_STATUS InitUEFI_GOP(EFI_HANDLE ImageHandle, GPU_CONFIG * Graphics)
       }
     }
 
-    if(timeout_seconds) // Only update DevNum if the loop ended due to a keypress. The loop won't have exited with time remaining without a valid key pressed.
+    if(ShowMenu && timeout_seconds) // Only update DevNum if the loop ended due to a keypress. The loop won't have exited with time remaining without a valid key pressed.
     {
       DevNum = (UINT64)(Key.UnicodeChar - 0x30); // Convert user input character from unicode to number
     }
@@ -1431,7 +1609,6 @@ EFI_STATUS InitUEFI_GOP(EFI_HANDLE ImageHandle, GPU_CONFIG * Graphics)
       Print(L"Error resetting input buffer. 0x%llx\r\n", GOPStatus);
       return GOPStatus;
     }
-#endif
   }
 
   if((NumHandlesInHandleBuffer > 1) && (DevNum == 0))
@@ -1820,10 +1997,63 @@ EFI_STATUS InitUEFI_GOP(EFI_HANDLE ImageHandle, GPU_CONFIG * Graphics)
 
     // End 1024x768
   }
+  else if((NumHandlesInHandleBuffer > 1) && (DevNum == 4))
+  {
+    // Configure each device by the video= policy
+
+    // Setup
+    Graphics->NumberOfFrameBuffers = NumHandlesInHandleBuffer;
+    GOPStatus = uefi_call_wrapper(ST->BootServices->AllocatePool, 3, EfiLoaderData, Graphics->NumberOfFrameBuffers*sizeof(EFI_GRAPHICS_OUTPUT_PROTOCOL_MODE), (void**)&Graphics->GPUArray);
+    if(EFI_ERROR(GOPStatus))
+    {
+      Print(L"GPUArray AllocatePool error. 0x%llx\r\n", GOPStatus);
+      return GOPStatus;
+    }
+
+    // Configure
+    for(DevNum = 0; DevNum < NumHandlesInHandleBuffer; DevNum++)
+    {
+      EFI_GRAPHICS_OUTPUT_PROTOCOL *GOPTable;
+
+      GOPStatus = uefi_call_wrapper(BS->OpenProtocol, 6, GraphicsHandles[DevNum], &GraphicsOutputProtocol, (void**)&GOPTable, ImageHandle, NULL, EFI_OPEN_PROTOCOL_GET_PROTOCOL);
+      if(EFI_ERROR(GOPStatus))
+      {
+        Print(L"GraphicsTable OpenProtocol error. 0x%llx\r\n", GOPStatus);
+        return GOPStatus;
+      }
+
+      CHAR16 CacheName[GOP_MODE_CACHE_NAME_LENGTH];
+      GetModeCacheName(GraphicsHandles[DevNum], CacheName);
+
+      BOOLEAN Cached = LoadCachedGraphicsMode(CacheName, GOPTable, Video, &mode);
+      if(!Cached)
+      {
+        GOPStatus = PickGraphicsMode(GOPTable, Video, &mode);
+        if(EFI_ERROR(GOPStatus))
+        {
+          return GOPStatus;
+        }
+      }
+
+      GOPStatus = SetGraphicsMode(GOPTable, mode, &Graphics->GPUArray[DevNum]);
+      if(EFI_ERROR(GOPStatus))
+      {
+        return GOPStatus;
+      }
+
+      if(!Cached)
+      {
+        SaveCachedGraphicsMode(CacheName, GOPTable, Video);
+      }
+    }
+
+    // End automatic for each
+  }
   else
   {
     // Single GPU
     // NOTE: If there's only 1 available mode for a given device, this will just auto-set its output to that; no need for explicit choice there.
+    // Unless the menu was asked for, the mode is picked by the video= policy.
     // Similarly, this single GPU case is the only one that has a timeout on its resolution menu. Muti-GPU options 0 and 1 assume the user is present to use them--there's no other way to get to them! (Multi-GPU options 2 and 3 are automatic modes, so they don't have menus.)
 
     // Setup
@@ -1848,9 +2078,26 @@ EFI_STATUS InitUEFI_GOP(EFI_HANDLE ImageHandle, GPU_CONFIG * Graphics)
       return GOPStatus;
     }
 
+    CHAR16 CacheName[GOP_MODE_CACHE_NAME_LENGTH];
+    GetModeCacheName(GraphicsHandles[DevNum], CacheName);
+    BOOLEAN Cached = FALSE;
+
     if(GOPTable->Mode->MaxMode == 1) // Grammar
     {
       mode = 0; // If there's only one mode, it's going to be mode 0.
+      Cached = TRUE; // Nothing worth remembering
+    }
+    else if(!ShowMenu)
+    {
+      Cached = LoadCachedGraphicsMode(CacheName, GOPTable, Video, &mode);
+      if(!Cached)
+      {
+        GOPStatus = PickGraphicsMode(GOPTable, Video, &mode);
+        if(EFI_ERROR(GOPStatus))
+        {
+          return GOPStatus;
+        }
+      }
     }
     else
     {
@@ -1858,6 +2105,12 @@ EFI_STATUS InitUEFI_GOP(EFI_HANDLE ImageHandle, GPU_CONFIG * Graphics)
       UINT32 default_mode = 0;
       UINT64 timeout_seconds = GPU_MENU_TIMEOUT_SECONDS;
 
+      GOPStatus = PickGraphicsMode(GOPTable, Video, &default_mode);
+      if(EFI_ERROR(GOPStatus))
+      {
+        return GOPStatus;
+      }
+
       // Get supported graphics modes
       EFI_GRAPHICS_OUTPUT_MODE_INFORMATION *GOPInfo2; // Querymode allocates GOPInfo
       while(0x30 > Key.UnicodeChar || Key.UnicodeChar > (0x30 + GOPTable->Mode->MaxMode - 1))
@@ -1920,35 +2173,19 @@ EFI_STATUS InitUEFI_GOP(EFI_HANDLE ImageHandle, GPU_CONFIG * Graphics)
         mode = (UINT32)(Key.UnicodeChar - 0x30);
       }
       Key.UnicodeChar = 0;
-
-      Print(L"Setting graphics mode %u of %u.\r\n\n", mode + 1, GOPTable->Mode->MaxMode);
     }
 
-    // Set mode
-    // This is supposed to black the screen out per spec, but apparently not every GPU got the memo.
-    GOPStatus = uefi_call_wrapper(GOPTable->SetMode, 2, GOPTable, mode);
+    GOPStatus = SetGraphicsMode(GOPTable, mode, &Graphics->GPUArray[DevNum]);
     if(EFI_ERROR(GOPStatus))
     {
-      Print(L"GraphicsTable SetMode error. 0x%llx\r\n", GOPStatus);
       return GOPStatus;
     }
 
-    // Allocate graphics mode info
-    GOPStatus = uefi_call_wrapper(ST->BootServices->AllocatePool, 3, EfiLoaderData, GOPTable->Mode->SizeOfInfo, (void**)&Graphics->GPUArray[DevNum].Info);
-    if(EFI_ERROR(GOPStatus))
+    // A mode picked from the menu is remembered too, so it sticks until the mode list or video= changes
+    if(!Cached)
     {
-      Print(L"GOP Mode->Info AllocatePool error. 0x%llx\r\n", GOPStatus);
-      return GOPStatus;
+      SaveCachedGraphicsMode(CacheName, GOPTable, Video);
     }
-    // Store graphics mode info
-    // Can't blanketly store Mode struct because Mode->Info pointer in array will get overwritten
-    Graphics->GPUArray[DevNum].MaxMode = GOPTable->Mode->MaxMode;
-    Graphics->GPUArray[DevNum].Mode = GOPTable->Mode->Mode;
-    Graphics->GPUArray[DevNum].SizeOfInfo = GOPTable->Mode->SizeOfInfo;
-    Graphics->GPUArray[DevNum].FrameBufferBase = GOPTable->Mode->FrameBufferBase;
-    Graphics->GPUArray[DevNum].FrameBufferSize = GOPTable->Mode->FrameBufferSize;
-    // Can blanketly override Info struct, though (no pointers in it, just raw data)
-    *(Graphics->GPUArray[DevNum].Info) = *(GOPTable->Mode->Info);
 
   // End single GPU
   }
@@ -1956,6 +2193,11 @@ EFI_STATUS InitUEFI_GOP(EFI_HANDLE ImageHandle, GPU_CONFIG * Graphics)
   // Don't need string names anymore
   for(UINTN StringNameFree = 0; StringNameFree < NumHandlesInHandleBuffer; StringNameFree++)
   {
+    if(NameBuffer[StringNameFree] == NULL)
+    {
+      continue;
+    }
+
     GOPStatus = uefi_call_wrapper(BS->FreePool, 1, NameBuffer[StringNameFree]);
     if(EFI_ERROR(GOPStatus))
     {
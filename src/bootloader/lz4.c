@@ -0,0 +1,242 @@
+/*
+   Copyright 2019 Dylan Green
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+// LZ4 frame decoder for compressed kernels. Frame format: https://github.com/lz4/lz4/blob/dev/doc/lz4_Frame_format.md
+
+#include <efi.h>
+
+#include "bootloader/lz4.h"
+
+#define LZ4_FLAG_VERSION_MASK     0xC0
+#define LZ4_FLAG_VERSION          0x40 // Version 01
+#define LZ4_FLAG_BLOCK_CHECKSUM   0x10
+#define LZ4_FLAG_CONTENT_SIZE     0x08
+#define LZ4_FLAG_DICTIONARY_ID    0x01
+
+#define LZ4_BLOCK_UNCOMPRESSED    0x80000000 // Set in a block's size when it's stored as is
+#define LZ4_MIN_MATCH             4
+
+
+static UINT32 Read32(const UINT8 * Bytes)
+{
+  return Bytes[0] | (Bytes[1] << 8) | (Bytes[2] << 16) | ((UINT32)Bytes[3] << 24);
+}
+
+// Returns the header's size, or 0 if this isn't a frame that can be decoded here
+static UINT64 ParseFrameHeader(const UINT8 * Frame, UINT64 FrameSize, UINT8 * Flags, UINT64 * ContentSize)
+{
+  if((FrameSize < 7) || (Read32(Frame) != LZ4_FRAME_MAGIC))
+  {
+    return 0;
+  }
+
+  *Flags = Frame[4];
+  if(((*Flags & LZ4_FLAG_VERSION_MASK) != LZ4_FLAG_VERSION) || (*Flags & LZ4_FLAG_DICTIONARY_ID)) // There's no dictionary to give it
+  {
+    return 0;
+  }
+
+  UINT64 HeaderSize = 7 + ((*Flags & LZ4_FLAG_CONTENT_SIZE) ? 8 : 0); // Magic, FLG, BD, [content size], HC
+  if(FrameSize < HeaderSize)
+  {
+    return 0;
+  }
+
+  *ContentSize = (*Flags & LZ4_FLAG_CONTENT_SIZE) ? (Read32(Frame + 6) | ((UINT64)Read32(Frame + 10) << 32)) : 0;
+  return HeaderSize;
+}
+
+// Front to back in 8-byte words. Also right for a match whose source is at least 8 bytes behind Dest, since every word it reads is already written.
+static VOID CopyWords(UINT8 * Dest, const UINT8 * Src, UINT64 Length)
+{
+  for(; Length >= 8; Length -= 8, Dest += 8, Src += 8)
+  {
+    UINT64 Word;
+    __builtin_memcpy(&Word, Src, 8);
+    __builtin_memcpy(Dest, &Word, 8);
+  }
+
+  for(; Length > 0; Length--)
+  {
+    *Dest++ = *Src++;
+  }
+}
+
+// Adds the 255-continued length bytes after a token nibble of 15
+static BOOLEAN ReadLength(const UINT8 ** Src, const UINT8 * SrcEnd, UINT64 * Length)
+{
+  UINT8 Byte;
+
+  do
+  {
+    if(*Src >= SrcEnd)
+    {
+      return FALSE;
+    }
+    Byte = *(*Src)++;
+    *Length += Byte;
+  } while(Byte == 255);
+
+  return TRUE;
+}
+
+// Matches may reach back into earlier blocks (linked blocks are the lz4 tool's default), as far as DestStart
+static EFI_STATUS DecompressBlock(const UINT8 * Src, UINT64 SrcSize, UINT8 * DestStart, UINT8 ** DestPosition, UINT8 * DestEnd)
+{
+  const UINT8 * SrcEnd = Src + SrcSize;
+  UINT8 * Dest = *DestPosition;
+
+  while(Src < SrcEnd)
+  {
+    UINT8 Token = *Src++;
+
+    // Literals
+    UINT64 Length = Token >> 4;
+    if((Length == 15) && !ReadLength(&Src, SrcEnd, &Length))
+    {
+      return EFI_LOAD_ERROR;
+    }
+
+    if((Length > (UINT64)(SrcEnd - Src)) || (Length > (UINT64)(DestEnd - Dest)))
+    {
+      return EFI_LOAD_ERROR;
+    }
+    CopyWords(Dest, Src, Length);
+    Dest += Length;
+    Src += Length;
+
+    if(Src == SrcEnd) // The last sequence is only literals
+    {
+      break;
+    }
+
+    // Match
+    if((SrcEnd - Src) < 2)
+    {
+      return EFI_LOAD_ERROR;
+    }
+    UINT64 Offset = Src[0] | (Src[1] << 8);
+    Src += 2;
+
+    Length = Token & 0xF;
+    if((Length == 15) && !ReadLength(&Src, SrcEnd, &Length))
+    {
+      return EFI_LOAD_ERROR;
+    }
+    Length += LZ4_MIN_MATCH;
+
+    if((Offset == 0) || (Offset > (UINT64)(Dest - DestStart)) || (Length > (UINT64)(DestEnd - Dest)))
+    {
+      return EFI_LOAD_ERROR;
+    }
+
+    const UINT8 * Match = Dest - Offset;
+    if(Offset >= 8)
+    {
+      CopyWords(Dest, Match, Length);
+    }
+    else
+    {
+      for(UINT64 i = 0; i < Length; i++) // Overlapping run: each byte can depend on the one just written
+      {
+        Dest[i] = Match[i];
+      }
+    }
+    Dest += Length;
+  }
+
+  *DestPosition = Dest;
+  return EFI_SUCCESS;
+}
+
+EFI_STATUS LZ4GetContentSize(const UINT8 * Frame, UINT64 FrameSize, UINT64 * ContentSize)
+{
+  UINT8 Flags;
+
+  if(ParseFrameHeader(Frame, FrameSize, &Flags, ContentSize) == 0)
+  {
+    return EFI_UNSUPPORTED;
+  }
+
+  return (*ContentSize != 0) ? EFI_SUCCESS : EFI_UNSUPPORTED;
+}
+
+EFI_STATUS LZ4DecompressFrame(const UINT8 * Frame, UINT64 FrameSize, UINT8 * Dest, UINT64 DestSize, UINT64 * Written)
+{
+  UINT8 Flags;
+  UINT64 ContentSize;
+  UINT64 Position = ParseFrameHeader(Frame, FrameSize, &Flags, &ContentSize);
+  UINT8 * Out = Dest;
+  UINT8 * DestEnd = Dest + DestSize;
+
+  if(Position == 0)
+  {
+    return EFI_UNSUPPORTED;
+  }
+
+  while(1)
+  {
+    if((FrameSize - Position) < 4)
+    {
+      return EFI_LOAD_ERROR;
+    }
+
+    UINT32 BlockSize = Read32(Frame + Position);
+    Position += 4;
+    if(BlockSize == 0) // End mark (a content checksum may follow; it isn't checked)
+    {
+      break;
+    }
+
+    UINT64 DataSize = BlockSize & ~LZ4_BLOCK_UNCOMPRESSED;
+    if(DataSize > (FrameSize - Position))
+    {
+      return EFI_LOAD_ERROR;
+    }
+
+    if(BlockSize & LZ4_BLOCK_UNCOMPRESSED)
+    {
+      if(DataSize > (UINT64)(DestEnd - Out))
+      {
+        return EFI_LOAD_ERROR;
+      }
+      CopyWords(Out, Frame + Position, DataSize);
+      Out += DataSize;
+    }
+    else
+    {
+      EFI_STATUS Status = DecompressBlock(Frame + Position, DataSize, Dest, &Out, DestEnd);
+      if(EFI_ERROR(Status))
+      {
+        return Status;
+      }
+    }
+
+    Position += DataSize + ((Flags & LZ4_FLAG_BLOCK_CHECKSUM) ? 4 : 0);
+    if(Position > FrameSize)
+    {
+      return EFI_LOAD_ERROR;
+    }
+  }
+
+  *Written = Out - Dest;
+  if((ContentSize != 0) && (*Written != ContentSize))
+  {
+    return EFI_LOAD_ERROR;
+  }
+
+  return EFI_SUCCESS;
+}
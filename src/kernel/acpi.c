@@ -0,0 +1,158 @@
+/*
+   Copyright 2019 Dylan Green
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "kernel/kernel.h"
+#include "kernel/acpi.h"
+
+ACPIInfo mainACPIInfo = {0};
+
+static EFI_GUID acpi20Guid = ACPI_20_TABLE_GUID;
+static EFI_GUID acpi10Guid = ACPI_TABLE_GUID;
+
+// Indexed by ACPI_TABLE_*
+static const char tableSignatures[ACPI_TABLE_COUNT][4] = {
+    {'F', 'A', 'C', 'P'},
+    {'A', 'P', 'I', 'C'},
+    {'H', 'P', 'E', 'T'},
+    {'M', 'C', 'F', 'G'},
+    {'S', 'R', 'A', 'T'},
+    {'S', 'L', 'I', 'T'}
+};
+
+static ACPI_RSDP * FindRSDP(EFI_CONFIGURATION_TABLE * ConfigTables, UINTN NumberOfConfigTables)
+{
+    ACPI_RSDP * rsdp = NULL;
+
+    // Prefer the 2.0+ RSDP, since it has the 64-bit XSDT
+    for(UINTN i = 0; i < NumberOfConfigTables; i++)
+    {
+        if(!CompareMemory(&ConfigTables[i].VendorGuid, &acpi20Guid, sizeof(EFI_GUID)))
+            return (ACPI_RSDP *)ConfigTables[i].VendorTable;
+        if(!CompareMemory(&ConfigTables[i].VendorGuid, &acpi10Guid, sizeof(EFI_GUID)))
+            rsdp = (ACPI_RSDP *)ConfigTables[i].VendorTable;
+    }
+
+    return rsdp;
+}
+
+static bool ValidRSDP(ACPI_RSDP * rsdp)
+{
+    if(CompareMemory(rsdp->signature, "RSD PTR ", 8) || Checksum8(rsdp, 20))
+        return false;
+
+    return (rsdp->revision < 2) || !Checksum8(rsdp, rsdp->length);
+}
+
+static bool ValidTable(ACPI_SDT_HEADER * table)
+{
+    return (table->length >= sizeof(ACPI_SDT_HEADER)) && !Checksum8(table, table->length);
+}
+
+static ACPI_SDT_HEADER * RootEntry(uint64_t i)
+{
+    uint64_t address = 0;
+    CopyMemory(&address, (uint8_t *)(mainACPIInfo.root + 1) + i * mainACPIInfo.entrySize, mainACPIInfo.entrySize); // XSDT entries are only 4-byte aligned
+    return (ACPI_SDT_HEADER *)address;
+}
+
+static uint64_t RootEntryCount(void)
+{
+    return (mainACPIInfo.root->length - sizeof(ACPI_SDT_HEADER)) / mainACPIInfo.entrySize;
+}
+
+void InitializeACPI(EFI_CONFIGURATION_TABLE * ConfigTables, UINTN NumberOfConfigTables)
+{
+    ACPI_RSDP * rsdp = FindRSDP(ConfigTables, NumberOfConfigTables);
+    if(rsdp == NULL)
+    {
+        LogMessage(LOG_LEVEL_WARNING, "No ACPI tables\n");
+        return;
+    }
+
+    if(!ValidRSDP(rsdp))
+    {
+        LogMessage(LOG_LEVEL_ERROR, "The ACPI RSDP is corrupt\n");
+        return;
+    }
+
+    // The XSDT has 64-bit entries, the RSDT 32-bit ones
+    bool extended = (rsdp->revision >= 2) && rsdp->xsdtAddress;
+    ACPI_SDT_HEADER * root = extended ? (ACPI_SDT_HEADER *)rsdp->xsdtAddress : (ACPI_SDT_HEADER *)(uint64_t)rsdp->rsdtAddress;
+
+    if(!ValidTable(root) || CompareMemory(root->signature, extended ? "XSDT" : "RSDT", 4))
+    {
+        LogMessage(LOG_LEVEL_ERROR, "The ACPI %s is corrupt\n", extended ? "XSDT" : "RSDT");
+        return;
+    }
+
+    mainACPIInfo.rsdp = rsdp;
+    mainACPIInfo.root = root;
+    mainACPIInfo.entrySize = extended ? 8 : 4;
+
+    uint64_t entries = RootEntryCount();
+    for(uint64_t i = 0; i < entries; i++)
+    {
+        ACPI_SDT_HEADER * table = RootEntry(i);
+        if(table == NULL)
+            continue;
+
+        for(uint8_t index = 0; index < ACPI_TABLE_COUNT; index++)
+        {
+            if((mainACPIInfo.tables[index] != NULL) || CompareMemory(table->signature, tableSignatures[index], 4))
+                continue;
+
+            if(ValidTable(table))
+                mainACPIInfo.tables[index] = table;
+            else
+                LogMessage(LOG_LEVEL_WARNING, "Ignoring ACPI %.4s table with a bad checksum\n", table->signature);
+            break;
+        }
+    }
+}
+
+ACPI_SDT_HEADER * FindACPITable(const char * signature)
+{
+    if(mainACPIInfo.root == NULL)
+        return NULL;
+
+    uint64_t entries = RootEntryCount();
+    for(uint64_t i = 0; i < entries; i++)
+    {
+        ACPI_SDT_HEADER * table = RootEntry(i);
+
+        if(table && !CompareMemory(table->signature, signature, 4))
+            return table;
+    }
+
+    return NULL;
+}
+
+#ifdef DEBUG_PIOUS
+void PrintACPIInfo(void)
+{
+    if(mainACPIInfo.root == NULL)
+        return;
+
+    LogMessage(LOG_LEVEL_DEBUG, "ACPI: %.4s from %.6s with %lu tables, indexed:", mainACPIInfo.root->signature, mainACPIInfo.rsdp->oemId, RootEntryCount());
+    for(uint8_t index = 0; index < ACPI_TABLE_COUNT; index++)
+    {
+        if(mainACPIInfo.tables[index])
+            LogMessage(LOG_LEVEL_DEBUG, " %.4s", tableSignatures[index]);
+    }
+    LogMessage(LOG_LEVEL_DEBUG, "\n");
+    DrainLog();
+}
+#endif
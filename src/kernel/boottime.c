@@ -0,0 +1,110 @@
+/*
+   Copyright 2019 Dylan Green
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "kernel/kernel.h"
+#include "kernel/boottime.h"
+#include "kernel/clock.h"
+
+static BOOT_TIMINGS * bootTimings = NULL;
+static bool compressionTimings = false; // Bootloader 1.2+ fills in the compressed kernel fields
+
+static const char * phaseNames[BOOT_PHASE_COUNT] = {
+    "GOP setup",
+    "Kernel load",
+    "Exit boot services",
+    "Memory",
+    "Paging",
+    "Display",
+    "Interrupts",
+    "Drivers"
+};
+
+void InitializeBootTimings(LOADER_PARAMS * Parameters)
+{
+    if((Parameters->Bootloader_MajorVersion > 1) || ((Parameters->Bootloader_MajorVersion == 1) && (Parameters->Bootloader_MinorVersion >= 1)))
+        bootTimings = Parameters->Boot_Timings;
+
+    if((Parameters->Bootloader_MajorVersion > 1) || ((Parameters->Bootloader_MajorVersion == 1) && (Parameters->Bootloader_MinorVersion >= 2)))
+        compressionTimings = true;
+}
+
+void StartBootPhase(uint8_t phase)
+{
+    if(bootTimings)
+        bootTimings->Phases[phase].Start = ReadCycleCounter();
+}
+
+void EndBootPhase(uint8_t phase)
+{
+    if(bootTimings)
+        bootTimings->Phases[phase].End = ReadCycleCounter();
+}
+
+static void LogBootTime(const char * name, uint64_t start, uint64_t end)
+{
+    uint64_t at = CyclesToNanoseconds(start - bootTimings->LoaderEntry) / 1000;
+    uint64_t took = CyclesToNanoseconds(end - start) / 1000;
+
+    LogMessage(LOG_LEVEL_INFO, "  %-20s %6lu.%03lu ms  (at %lu.%03lu ms)\n", name, took / 1000, took % 1000, at / 1000, at % 1000);
+}
+
+// Reading the file uncompressed is estimated from how fast the compressed one came off the ESP
+static void LogKernelDecompression(void)
+{
+    BOOT_PHASE_TIME * read = &bootTimings->KernelRead;
+    BOOT_PHASE_TIME * decompress = &bootTimings->KernelDecompress;
+
+    if(!compressionTimings || (read->Start == 0) || (decompress->End < decompress->Start) || (bootTimings->KernelFileSize == 0))
+        return;
+
+    LogBootTime("  Read (compressed)", read->Start, read->End);
+    LogBootTime("  Decompress", decompress->Start, decompress->End);
+
+    uint64_t readTime = CyclesToNanoseconds(read->End - read->Start) / 1000;
+    uint64_t spent = readTime + CyclesToNanoseconds(decompress->End - decompress->Start) / 1000;
+    uint64_t uncompressed = readTime * bootTimings->KernelImageSize / bootTimings->KernelFileSize;
+    uint64_t saved = (uncompressed > spent) ? (uncompressed - spent) : (spent - uncompressed);
+
+    LogMessage(LOG_LEVEL_INFO, "  Kernel is %lu KiB compressed from %lu KiB; reading it uncompressed would take ~%lu.%03lu ms, %s %lu.%03lu ms\n",
+        bootTimings->KernelFileSize >> 10, bootTimings->KernelImageSize >> 10, uncompressed / 1000, uncompressed % 1000,
+        (uncompressed > spent) ? "saved" : "lost", saved / 1000, saved % 1000);
+}
+
+void PrintBootTimings(void)
+{
+    if(bootTimings == NULL)
+        return;
+
+    uint64_t now = ReadCycleCounter();
+    uint64_t firmware = CyclesToNanoseconds(bootTimings->LoaderEntry) / 1000;
+    uint64_t total = CyclesToNanoseconds(now - bootTimings->LoaderEntry) / 1000;
+
+    LogMessage(LOG_LEVEL_INFO, "Boot timing (from efi_main):\n");
+    LogMessage(LOG_LEVEL_INFO, "  %-20s %6lu.%03lu ms\n", "Firmware", firmware / 1000, firmware % 1000);
+
+    for(uint8_t i = 0; i < BOOT_PHASE_COUNT; i++)
+    {
+        if(bootTimings->Phases[i].Start && (bootTimings->Phases[i].End >= bootTimings->Phases[i].Start))
+        {
+            LogBootTime(phaseNames[i], bootTimings->Phases[i].Start, bootTimings->Phases[i].End);
+            if(i == BOOT_PHASE_KERNEL_LOAD)
+                LogKernelDecompression();
+        }
+    }
+
+    LogMessage(LOG_LEVEL_INFO, "  %-20s %6lu.%03lu ms\n", "Total", total / 1000, total % 1000);
+    DrainLog();
+}
@@ -0,0 +1,41 @@
+/*
+   Copyright 2019 Dylan Green
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "kernel/kernel.h"
+#include "kernel/clock.h"
+
+ClockSource mainClockSource = {"none", 0, 0};
+
+void SetClockFrequency(const char * name, uint64_t frequency)
+{
+    if(frequency == 0)
+    {
+        LogMessage(LOG_LEVEL_ERROR, "No clock frequency from %s; time won't advance\n", name);
+        return;
+    }
+
+    mainClockSource.name = name;
+    mainClockSource.multiplier = (uint64_t)(((unsigned __int128)NANOSECONDS_PER_SECOND << CLOCK_SHIFT) / frequency);
+    mainClockSource.frequency = frequency;
+}
+
+#ifdef DEBUG_PIOUS
+void PrintClockInfo(void)
+{
+    LogMessage(LOG_LEVEL_DEBUG, "Clock: %lu.%06lu MHz (from %s)\n", mainClockSource.frequency / 1000000, mainClockSource.frequency % 1000000, mainClockSource.name);
+    DrainLog();
+}
+#endif
@@ -0,0 +1,463 @@
+/*
+   Copyright 2019 Dylan Green
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "kernel/kernel.h"
+#include "kernel/format.h"
+
+#define PRINT_BUFFER_SIZE 256
+
+// FormatString() formats into this on the stack and hands it to the sink whenever it fills up
+typedef struct PrintBuffer {
+    unsigned char   data[PRINT_BUFFER_SIZE];
+    UINT32          length;
+    FormatSink      sink;
+    void           *context;
+} PrintBuffer;
+
+#define PRINT_FLAG_LEFT  (1 << 0) // '-': pad on the right
+#define PRINT_FLAG_ZERO  (1 << 1) // '0': pad numbers with zeros after the sign
+#define PRINT_FLAG_PLUS  (1 << 2) // '+': always print a sign
+#define PRINT_FLAG_SPACE (1 << 3) // ' ': space where a + would go
+
+static const char digitPairs[201] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+typedef struct BoundedBuffer {
+    unsigned char  *dest;
+    UINT64          size;
+    UINT64          length;
+} BoundedBuffer;
+
+static const char lowerHexDigits[] = "0123456789abcdef";
+static const char upperHexDigits[] = "0123456789ABCDEF";
+
+static void FlushPrintBuffer(PrintBuffer * buffer)
+{
+    if(buffer->length > 0)
+        buffer->sink(buffer->context, buffer->data, buffer->length);
+    buffer->length = 0;
+}
+
+static void BufferCharacters(PrintBuffer * buffer, const unsigned char * chars, UINT64 length)
+{
+    while(length > 0)
+    {
+        if(buffer->length == PRINT_BUFFER_SIZE)
+            FlushPrintBuffer(buffer);
+
+        UINT64 count = PRINT_BUFFER_SIZE - buffer->length;
+        if(count > length)
+            count = length;
+
+        CopyMemory(buffer->data + buffer->length, chars, count);
+        buffer->length += count;
+        chars += count;
+        length -= count;
+    }
+}
+
+static void BufferRepeat(PrintBuffer * buffer, unsigned char chr, UINT64 count)
+{
+    while(count > 0)
+    {
+        if(buffer->length == PRINT_BUFFER_SIZE)
+            FlushPrintBuffer(buffer);
+
+        UINT64 run = PRINT_BUFFER_SIZE - buffer->length;
+        if(run > count)
+            run = count;
+
+        SetMemory(buffer->data + buffer->length, chr, run);
+        buffer->length += run;
+        count -= run;
+    }
+}
+
+// Writes value's digits so they end just before end, and returns where they start. Decimal goes two digits per
+// division by a constant (which the compiler turns into a multiply), powers of two are just shifts.
+static unsigned char * FormatUnsigned(unsigned char * end, UINT64 value, UINT8 base, bool upperCase)
+{
+    unsigned char * p = end;
+
+    switch(base)
+    {
+    case 10:
+        while(value >= 100)
+        {
+            UINT64 pair = (value % 100) * 2;
+            value /= 100;
+            *--p = digitPairs[pair + 1];
+            *--p = digitPairs[pair];
+        }
+        if(value >= 10)
+        {
+            *--p = digitPairs[value * 2 + 1];
+            *--p = digitPairs[value * 2];
+        }
+        else
+            *--p = '0' + value;
+        break;
+    case 16:
+        do
+        {
+            *--p = upperCase ? upperHexDigits[value & 0xF] : lowerHexDigits[value & 0xF];
+            value >>= 4;
+        } while(value);
+        break;
+    case 8:
+        do
+        {
+            *--p = '0' + (value & 0x7);
+            value >>= 3;
+        } while(value);
+        break;
+    }
+
+    return p;
+}
+
+// Pads the sign/prefix and digits out to width
+static void BufferField(PrintBuffer * buffer, const unsigned char * prefix, UINT32 prefixLength, const unsigned char * body, UINT64 bodyLength, UINT32 width, UINT8 flags)
+{
+    UINT64 padding = (width > prefixLength + bodyLength) ? width - prefixLength - bodyLength : 0;
+
+    if(!(flags & (PRINT_FLAG_LEFT | PRINT_FLAG_ZERO)))
+        BufferRepeat(buffer, ' ', padding);
+
+    BufferCharacters(buffer, prefix, prefixLength);
+
+    if(flags & PRINT_FLAG_ZERO)
+        BufferRepeat(buffer, '0', padding);
+
+    BufferCharacters(buffer, body, bodyLength);
+
+    if(flags & PRINT_FLAG_LEFT)
+        BufferRepeat(buffer, ' ', padding);
+}
+
+// Fixed point with precision decimals; there's no exponent form, so %e and %g print the same way
+static void BufferDouble(PrintBuffer * buffer, double value, UINT32 width, UINT32 precision, UINT8 flags)
+{
+    static const UINT64 powersOf10[] = {1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000};
+    unsigned char digits[48];
+    unsigned char * end = digits + sizeof(digits);
+    unsigned char * start;
+    unsigned char sign = 0;
+    UINT32 trailingZeros = 0;
+
+    if(value < 0.0)
+    {
+        sign = '-';
+        value = -value;
+    }
+    else if(flags & PRINT_FLAG_PLUS)
+        sign = '+';
+    else if(flags & PRINT_FLAG_SPACE)
+        sign = ' ';
+
+    // The digit loop below would never finish on infinity, and converting a NaN to an integer is undefined
+    if(__builtin_isnan(value) || __builtin_isinf(value))
+    {
+        BufferField(buffer, &sign, sign ? 1 : 0, __builtin_isnan(value) ? "nan" : "inf", 3, width, flags & ~PRINT_FLAG_ZERO);
+        return;
+    }
+
+    if(precision > 9)
+        precision = 9;
+
+    // Values past what a UINT64 holds lose their low digits anyway, so print those as zeros
+    while(value >= 1e19)
+    {
+        value /= 10;
+        trailingZeros++;
+    }
+
+    value += 0.5 / powersOf10[precision]; // Round to nearest rather than truncate
+    UINT64 whole = (UINT64)value;
+    UINT64 fraction = (UINT64)((value - (double)whole) * powersOf10[precision]);
+
+    start = end;
+    if(precision > 0)
+    {
+        start = FormatUnsigned(end, fraction, 10, false);
+        while(end - start < precision)
+            *--start = '0';
+        *--start = '.';
+    }
+
+    unsigned char * fractionStart = start;
+    start = FormatUnsigned(start, whole, 10, false);
+
+    if(trailingZeros == 0)
+    {
+        BufferField(buffer, &sign, sign ? 1 : 0, start, end - start, width, flags);
+        return;
+    }
+
+    // Only the huge values take this path; padding is applied around the whole number by hand
+    UINT64 length = (sign ? 1 : 0) + (fractionStart - start) + trailingZeros + (end - fractionStart);
+    UINT64 padding = (width > length) ? width - length : 0;
+
+    if(!(flags & PRINT_FLAG_LEFT))
+        BufferRepeat(buffer, (flags & PRINT_FLAG_ZERO) ? '0' : ' ', padding);
+    if(sign)
+        BufferCharacters(buffer, &sign, 1);
+    BufferCharacters(buffer, start, fractionStart - start);
+    BufferRepeat(buffer, '0', trailingZeros);
+    BufferCharacters(buffer, fractionStart, end - fractionStart);
+    if(flags & PRINT_FLAG_LEFT)
+        BufferRepeat(buffer, ' ', padding);
+}
+
+void FormatString(FormatSink sink, void * context, unsigned char * str, va_list valist)
+{
+    PrintBuffer buffer;
+    unsigned char digits[24]; // Enough for a 64-bit number in octal
+    unsigned char * digitsEnd = digits + sizeof(digits);
+
+    buffer.length = 0;
+    buffer.sink = sink;
+    buffer.context = context;
+
+    while(*str != '\0')
+    {
+        if(*str != '%')
+        {
+            // Copy the literal text up to the next conversion in one go
+            unsigned char * literal = str;
+            while((*str != '\0') && (*str != '%'))
+                str++;
+
+            BufferCharacters(&buffer, literal, str - literal);
+            continue;
+        }
+
+        str++;
+
+        UINT8 flags = 0;
+        for(;; str++)
+        {
+            if(*str == '-')
+                flags |= PRINT_FLAG_LEFT;
+            else if(*str == '0')
+                flags |= PRINT_FLAG_ZERO;
+            else if(*str == '+')
+                flags |= PRINT_FLAG_PLUS;
+            else if(*str == ' ')
+                flags |= PRINT_FLAG_SPACE;
+            else
+                break;
+        }
+
+        UINT32 width = 0;
+        if(*str == '*')
+        {
+            int argWidth = va_arg(valist, int);
+            if(argWidth < 0)
+            {
+                flags |= PRINT_FLAG_LEFT;
+                argWidth = -argWidth;
+            }
+            width = argWidth;
+            str++;
+        }
+        else
+        {
+            for(; (*str >= '0') && (*str <= '9'); str++)
+                width = width * 10 + (*str - '0');
+        }
+
+        INT32 precision = -1;
+        if(*str == '.')
+        {
+            str++;
+            precision = 0;
+            if(*str == '*')
+            {
+                precision = va_arg(valist, int);
+                str++;
+            }
+            else
+            {
+                for(; (*str >= '0') && (*str <= '9'); str++)
+                    precision = precision * 10 + (*str - '0');
+            }
+        }
+
+        if(flags & PRINT_FLAG_LEFT)
+            flags &= ~PRINT_FLAG_ZERO;
+
+        // 0 = int, 1 = short, 2 = char, 3 = long
+        UINT8 size = 0;
+        if(*str == 'h')
+        {
+            size = 1;
+            str++;
+            if(*str == 'h')
+            {
+                size = 2;
+                str++;
+            }
+        }
+        else if((*str == 'l') || (*str == 'z'))
+        {
+            size = 3;
+            str++;
+            if(*str == 'l')
+                str++;
+        }
+
+        unsigned char conversion = *str;
+        unsigned char prefix[2];
+        UINT32 prefixLength = 0;
+        unsigned char * start;
+        INT64 signedValue;
+        UINT64 value;
+
+        switch(conversion)
+        {
+        case '%':
+            BufferCharacters(&buffer, str, 1);
+            break;
+        case 'c':
+            prefix[0] = va_arg(valist, int);
+            BufferField(&buffer, NULL, 0, prefix, 1, width, flags & PRINT_FLAG_LEFT);
+            break;
+        case 's':
+        {
+            unsigned char * string = va_arg(valist, unsigned char *);
+            if(string == NULL)
+                string = (unsigned char *)"(null)";
+
+            UINT64 length = 0;
+            while((string[length] != '\0') && ((precision < 0) || (length < (UINT64)precision)))
+                length++;
+
+            BufferField(&buffer, NULL, 0, string, length, width, flags & PRINT_FLAG_LEFT);
+            break;
+        }
+        case 'd':
+        case 'i':
+            if(size == 3)
+                signedValue = va_arg(valist, long);
+            else
+                signedValue = va_arg(valist, int);
+
+            if(size == 1)
+                signedValue = (short)signedValue;
+            else if(size == 2)
+                signedValue = (signed char)signedValue;
+
+            if(signedValue < 0)
+            {
+                prefix[prefixLength++] = '-';
+                value = -(UINT64)signedValue; // Also right for the most negative value
+            }
+            else
+            {
+                if(flags & PRINT_FLAG_PLUS)
+                    prefix[prefixLength++] = '+';
+                else if(flags & PRINT_FLAG_SPACE)
+                    prefix[prefixLength++] = ' ';
+                value = signedValue;
+            }
+
+            start = FormatUnsigned(digitsEnd, value, 10, false);
+            BufferField(&buffer, prefix, prefixLength, start, digitsEnd - start, width, flags);
+            break;
+        case 'u':
+        case 'o':
+        case 'x':
+        case 'X':
+            if(size == 3)
+                value = va_arg(valist, unsigned long);
+            else
+                value = va_arg(valist, unsigned int);
+
+            if(size == 1)
+                value = (unsigned short)value;
+            else if(size == 2)
+                value = (unsigned char)value;
+
+            start = FormatUnsigned(digitsEnd, value, (conversion == 'u') ? 10 : (conversion == 'o') ? 8 : 16, conversion == 'X');
+            BufferField(&buffer, NULL, 0, start, digitsEnd - start, width, flags);
+            break;
+        case 'p':
+            value = (UINT64)va_arg(valist, void *);
+
+            start = FormatUnsigned(digitsEnd, value, 16, false);
+            while(digitsEnd - start < 16)
+                *--start = '0';
+
+            BufferField(&buffer, (unsigned char *)"0x", 2, start, digitsEnd - start, width, flags & PRINT_FLAG_LEFT);
+            break;
+        case 'e':
+        case 'E':
+        case 'f':
+        case 'F':
+        case 'g':
+        case 'G':
+            BufferDouble(&buffer, va_arg(valist, double), width, (precision < 0) ? 4 : precision, flags);
+            break;
+        case 'n':
+            va_arg(valist, int *); // Not supported, but the argument still has to be skipped
+            break;
+        case '\0':
+            str--; // Format ended in the middle of a conversion
+            break;
+        default:
+            break;
+        }
+
+        str++;
+    }
+
+    FlushPrintBuffer(&buffer);
+}
+
+static void BoundedSink(void * context, const unsigned char * chars, UINT64 length)
+{
+    BoundedBuffer * buffer = context;
+    UINT64 space = buffer->size - 1 - buffer->length;
+
+    if(length > space)
+        length = space;
+
+    CopyMemory(buffer->dest + buffer->length, chars, length);
+    buffer->length += length;
+}
+
+UINT64 FormatToBuffer(unsigned char * dest, UINT64 size, unsigned char * format, va_list args)
+{
+    BoundedBuffer buffer = {dest, size, 0};
+
+    if(size == 0)
+        return 0;
+
+    FormatString(BoundedSink, &buffer, format, args);
+    dest[buffer.length] = '\0';
+    return buffer.length;
+}
+
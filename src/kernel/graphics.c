@@ -19,11 +19,19 @@
 
 
 #include "kernel/graphics.h"
+#include "kernel/options.h"
 #include "kernel/font_8x8.h"
+#include "kernel/memory.h"
 
 
 TextDisplaySettings mainTextDisplaySettings;
 
+// Each possible 8-pixel font row expanded to 8 * scale pixel masks (all ones where the font bit is set), for drawing glyphs in any color
+static UINT32 rowMasks[256][8 * MAX_FONT_SCALE];
+
+static void ClearLine(UINT64 line);
+static void BuildGlyphAtlas(void);
+
 void InitializeDisplay(EFI_GRAPHICS_OUTPUT_PROTOCOL_MODE GPU)
 {
     mainTextDisplaySettings.defaultGPU = GPU;
@@ -36,791 +44,392 @@ void InitializeDisplay(EFI_GRAPHICS_OUTPUT_PROTOCOL_MODE GPU)
     else if(pixels >= 960*540) mainTextDisplaySettings.scale = 2;
     else mainTextDisplaySettings.scale = 1;
 
+    UINT64 scale = GetBootOptionInteger("scale", 0); // 0 is automatic
+    if(scale > MAX_FONT_SCALE)
+        scale = MAX_FONT_SCALE;
+    if(scale > 0)
+        mainTextDisplaySettings.scale = scale;
+
+    BuildGlyphAtlas();
+
+    mainTextDisplaySettings.columns = GPU.Info->HorizontalResolution / (8 * mainTextDisplaySettings.scale);
+    mainTextDisplaySettings.rows = GPU.Info->VerticalResolution / (8 * mainTextDisplaySettings.scale);
+
+    // The framebuffer is uncached (or at best write-combining) MMIO, which is very slow to read and not much faster to write a pixel at a time.
+    // If there's no RAM for a shadow copy, everything just gets drawn straight into the framebuffer.
+    UINT64 shadowPages = EFI_SIZE_TO_PAGES((UINT64)GPU.Info->PixelsPerScanLine * GPU.Info->VerticalResolution * 4);
+    mainTextDisplaySettings.shadowBuffer = (UINT32 *)AllocatePhysicalPages(shadowPages);
+    if(mainTextDisplaySettings.shadowBuffer == NULL)
+        mainTextDisplaySettings.shadowBuffer = (UINT32 *)GPU.FrameBufferBase;
+
+    mainTextDisplaySettings.dirtyTop = 0;
+    mainTextDisplaySettings.dirtyBottom = 0;
+
+    UINT64 lineSize = (UINT64)mainTextDisplaySettings.columns * sizeof(ConsoleCell);
+    mainTextDisplaySettings.historyLines = GetBootOptionInteger("scrollback", CONSOLE_SCROLLBACK_KIB << 10) / lineSize;
+    if(mainTextDisplaySettings.historyLines < mainTextDisplaySettings.rows)
+        mainTextDisplaySettings.historyLines = mainTextDisplaySettings.rows;
 
-    mainTextDisplaySettings.index = 0;
+    mainTextDisplaySettings.cells = (ConsoleCell *)AllocatePhysicalPages(EFI_SIZE_TO_PAGES(mainTextDisplaySettings.historyLines * lineSize));
+    if(mainTextDisplaySettings.cells == NULL) // Do without scrollback
+    {
+        mainTextDisplaySettings.historyLines = mainTextDisplaySettings.rows;
+        mainTextDisplaySettings.cells = (ConsoleCell *)AllocatePhysicalPages(EFI_SIZE_TO_PAGES(mainTextDisplaySettings.historyLines * lineSize));
+    }
+    if(mainTextDisplaySettings.cells == NULL) // Stay headless; PrintString() keeps sending text to the log
+    {
+        if((UINT64)mainTextDisplaySettings.shadowBuffer != GPU.FrameBufferBase)
+            FreePhysicalPages((UINT64)mainTextDisplaySettings.shadowBuffer, shadowPages);
+        mainTextDisplaySettings.shadowBuffer = NULL;
+        LogMessage(LOG_LEVEL_WARNING, "No memory for the console; running without a display\n");
+        return;
+    }
+
+    mainTextDisplaySettings.cursorColumn = 0;
+    mainTextDisplaySettings.cursorLine = 0;
+    mainTextDisplaySettings.viewOffset = 0;
+    mainTextDisplaySettings.renderedTop = 0;
+    ClearLine(0);
 
     ColorScreen(mainTextDisplaySettings.backgroundColor);
 }
 
-
-#ifdef DEBUG_PIOUS
-void PrintDebugMessage(unsigned char * str)
+static void MarkDirty(UINT32 top, UINT32 bottom)
 {
-    PrintString("[DEBUG]", mainTextDisplaySettings.highlightColor, mainTextDisplaySettings.backgroundColor);
-    PrintString(" ", mainTextDisplaySettings.fontColor, mainTextDisplaySettings.backgroundColor);
-    PrintString(str, mainTextDisplaySettings.fontColor, mainTextDisplaySettings.backgroundColor);
+    if(mainTextDisplaySettings.dirtyTop == mainTextDisplaySettings.dirtyBottom)
+    {
+        mainTextDisplaySettings.dirtyTop = top;
+        mainTextDisplaySettings.dirtyBottom = bottom;
+        return;
+    }
+
+    if(top < mainTextDisplaySettings.dirtyTop)
+        mainTextDisplaySettings.dirtyTop = top;
+    if(bottom > mainTextDisplaySettings.dirtyBottom)
+        mainTextDisplaySettings.dirtyBottom = bottom;
 }
 
-void PrintErrorCode(unsigned long code, unsigned char * message)
+// Copies the scanlines that changed since the last flush out to the framebuffer
+void FlushDisplay(void)
 {
-    PrintString("[ERROR]", mainTextDisplaySettings.highlightColor, mainTextDisplaySettings.backgroundColor);
-    PrintString(" ", mainTextDisplaySettings.fontColor, mainTextDisplaySettings.backgroundColor);
-    
-    if(*message != '\0')
+    UINT32 pitch = mainTextDisplaySettings.defaultGPU.Info->PixelsPerScanLine;
+
+    if(mainTextDisplaySettings.dirtyTop != mainTextDisplaySettings.dirtyBottom && (UINT64)mainTextDisplaySettings.shadowBuffer != mainTextDisplaySettings.defaultGPU.FrameBufferBase)
     {
-        PrintString(message, mainTextDisplaySettings.fontColor, mainTextDisplaySettings.backgroundColor);
-        PrintString(" - ", mainTextDisplaySettings.fontColor, mainTextDisplaySettings.backgroundColor);
+        // Dirty scanlines are contiguous in both buffers, back porch included, so it's one long copy
+        StreamMemory((UINT32 *)mainTextDisplaySettings.defaultGPU.FrameBufferBase + (UINT64)mainTextDisplaySettings.dirtyTop * pitch,
+                     mainTextDisplaySettings.shadowBuffer + (UINT64)mainTextDisplaySettings.dirtyTop * pitch,
+                     (UINT64)(mainTextDisplaySettings.dirtyBottom - mainTextDisplaySettings.dirtyTop) * pitch * 4);
     }
 
+    mainTextDisplaySettings.dirtyTop = 0;
+    mainTextDisplaySettings.dirtyBottom = 0;
+}
 
-    PrintString("Error Code: 0x%lX", mainTextDisplaySettings.fontColor, mainTextDisplaySettings.backgroundColor, code);
 
+static UINT32 ChannelToPixel(UINT32 value, UINT32 mask)
+{
+    if(mask == 0)
+        return 0;
+
+    UINT32 width = __builtin_popcount(mask);
+    if(width < 8)
+        value >>= 8 - width;
+    else
+        value <<= width - 8;
 
+    return (value << __builtin_ctz(mask)) & mask;
 }
-#endif
 
-void PrintCharacter(unsigned char chr, UINT32 foregroundColor, UINT32 backgroundColor)
+// Colors are given as 0x00RRGGBB, which is already PixelBlueGreenRedReserved8BitPerColor's layout
+static UINT32 ToPixel(UINT32 color)
 {
+    EFI_GRAPHICS_OUTPUT_MODE_INFORMATION * info = mainTextDisplaySettings.defaultGPU.Info;
 
-    UINT32 backporch = mainTextDisplaySettings.defaultGPU.Info->PixelsPerScanLine - mainTextDisplaySettings.defaultGPU.Info->HorizontalResolution; // The area offscreen is the back porch. Sometimes it's 0.
-    UINT32 rowSize = mainTextDisplaySettings.defaultGPU.Info->VerticalResolution / (8 * mainTextDisplaySettings.scale);
-    UINT32 colSize = (mainTextDisplaySettings.defaultGPU.Info->PixelsPerScanLine - backporch) / (8 * mainTextDisplaySettings.scale);
+    switch(info->PixelFormat)
+    {
+        case PixelRedGreenBlueReserved8BitPerColor:
+            return ((color & 0xFF) << 16) | (color & 0xFF00) | ((color >> 16) & 0xFF);
+        case PixelBitMask:
+            return ChannelToPixel((color >> 16) & 0xFF, info->PixelInformation.RedMask) | ChannelToPixel((color >> 8) & 0xFF, info->PixelInformation.GreenMask) | ChannelToPixel(color & 0xFF, info->PixelInformation.BlueMask);
+        default:
+            return color;
+    }
+}
 
-    UINT32 col;
-    UINT32 row;
-            
-            
-    UINT8 i;
-    UINT8 j;
-    UINT8 k;
+static void BuildGlyphAtlas(void)
+{
+    UINT32 scale = mainTextDisplaySettings.scale;
+    UINT32 glyphWidth = 8 * scale;
 
-    for(i = 0; i < 64; i++)
+    for(UINT32 bits = 0; bits < 256; bits++)
     {
-        if((font8x8_basic[chr][i % 8] >> (i / 8)) & 0x01)
-        {
-            for(j = 0; j < mainTextDisplaySettings.scale; j++)
-            {
-                for(k = 0; k < mainTextDisplaySettings.scale; k++)
-                {
-                    *(UINT32*)(mainTextDisplaySettings.defaultGPU.FrameBufferBase + 4 * (mainTextDisplaySettings.defaultGPU.Info->PixelsPerScanLine * (mainTextDisplaySettings.index / colSize * (8 * mainTextDisplaySettings.scale) + (i % 8) * mainTextDisplaySettings.scale + j) + (mainTextDisplaySettings.index % colSize * (8 * mainTextDisplaySettings.scale) + (i / 8) * mainTextDisplaySettings.scale + k))) = foregroundColor;
-                }
-            }
-        }
-        else
-        {
-            for(j = 0; j < mainTextDisplaySettings.scale; j++)
-            {
-                for(k = 0; k < mainTextDisplaySettings.scale; k++)
-                {
-                    *(UINT32*)(mainTextDisplaySettings.defaultGPU.FrameBufferBase + 4 * (mainTextDisplaySettings.defaultGPU.Info->PixelsPerScanLine * (mainTextDisplaySettings.index / colSize * (8 * mainTextDisplaySettings.scale) + (i % 8) * mainTextDisplaySettings.scale + j) + (mainTextDisplaySettings.index % colSize * (8 * mainTextDisplaySettings.scale) + (i / 8) * mainTextDisplaySettings.scale + k))) = backgroundColor;
-                }
-            }
-        }
-                
+        for(UINT32 x = 0; x < glyphWidth; x++)
+            rowMasks[bits][x] = ((bits >> (x / scale)) & 0x01) ? 0xFFFFFFFF : 0;
     }
 
-    if(mainTextDisplaySettings.index == rowSize * colSize - 1)
+    mainTextDisplaySettings.atlasForeground = mainTextDisplaySettings.fontColor;
+    mainTextDisplaySettings.atlasBackground = mainTextDisplaySettings.backgroundColor;
+
+    // Without the atlas, every glyph goes through the masked path in DrawCell()
+    mainTextDisplaySettings.glyphAtlas = (UINT32 *)AllocatePhysicalPages(EFI_SIZE_TO_PAGES(128ULL * glyphWidth * glyphWidth * 4));
+    if(mainTextDisplaySettings.glyphAtlas == NULL)
+        return;
+
+    UINT32 foreground = ToPixel(mainTextDisplaySettings.atlasForeground);
+    UINT32 background = ToPixel(mainTextDisplaySettings.atlasBackground);
+    UINT32 * pixel = mainTextDisplaySettings.glyphAtlas;
+
+    for(UINT32 chr = 0; chr < 128; chr++)
     {
-        ScrollUp();
-        mainTextDisplaySettings.index = (rowSize - 1) * colSize;
+        for(UINT32 y = 0; y < glyphWidth; y++)
+        {
+            UINT32 * mask = rowMasks[font8x8_basic[chr][y / scale]];
+            for(UINT32 x = 0; x < glyphWidth; x++)
+                *pixel++ = (mask[x] & foreground) | (~mask[x] & background);
+        }
     }
-    else mainTextDisplaySettings.index++;
 }
 
-void ScrollUp()
+static void DrawCell(UINT32 row, UINT32 column, const ConsoleCell * cell)
 {
-    UINT32 backporch = mainTextDisplaySettings.defaultGPU.Info->PixelsPerScanLine - mainTextDisplaySettings.defaultGPU.Info->HorizontalResolution; // The area offscreen is the back porch. Sometimes it's 0.
-    UINT32 rowSize = mainTextDisplaySettings.defaultGPU.Info->VerticalResolution / (8 * mainTextDisplaySettings.scale);
-    UINT32 colSize = (mainTextDisplaySettings.defaultGPU.Info->PixelsPerScanLine - backporch) / (8 * mainTextDisplaySettings.scale);
+    UINT32 pitch = mainTextDisplaySettings.defaultGPU.Info->PixelsPerScanLine;
+    UINT32 scale = mainTextDisplaySettings.scale;
+    UINT32 glyphWidth = 8 * scale;
+    UINT32 * dest = mainTextDisplaySettings.shadowBuffer + (UINT64)row * glyphWidth * pitch + column * glyphWidth;
 
-    UINT32* startAddress = (UINT32*)mainTextDisplaySettings.defaultGPU.FrameBufferBase;
-    UINT32 incrementation = mainTextDisplaySettings.defaultGPU.Info->PixelsPerScanLine * 8 * mainTextDisplaySettings.scale;
-    UINT32* endAddress = startAddress + mainTextDisplaySettings.defaultGPU.Info->VerticalResolution * mainTextDisplaySettings.defaultGPU.Info->HorizontalResolution - incrementation;
+    // Default colors: one row-span copy per scanline straight from the atlas
+    if(mainTextDisplaySettings.glyphAtlas && (cell->foreground == mainTextDisplaySettings.atlasForeground) && (cell->background == mainTextDisplaySettings.atlasBackground))
+    {
+        UINT32 * src = mainTextDisplaySettings.glyphAtlas + (UINT64)cell->character * glyphWidth * glyphWidth;
+
+        for(UINT32 y = 0; y < glyphWidth; y++, dest += pitch, src += glyphWidth)
+            CopyMemory(dest, src, glyphWidth * 4);
+        return;
+    }
+
+    // Other colors: build each font row's scanline from its mask once, then copy it to the other (scale - 1) scanlines
+    UINT32 foreground = ToPixel(cell->foreground);
+    UINT32 background = ToPixel(cell->background);
 
-    UINT32* addr;
-    for(addr = startAddress; addr != endAddress; addr++)
+    for(UINT32 y = 0; y < 8; y++)
     {
-        *addr = *(addr + incrementation);
+        UINT32 * mask = rowMasks[font8x8_basic[cell->character][y]];
+
+        for(UINT32 x = 0; x < glyphWidth; x++)
+            dest[x] = (mask[x] & foreground) | (~mask[x] & background);
+
+        for(UINT32 k = 1; k < scale; k++)
+            CopyMemory(dest + (UINT64)k * pitch, dest, glyphWidth * 4);
+
+        dest += (UINT64)scale * pitch;
     }
-    
-    for(; addr != startAddress + mainTextDisplaySettings.defaultGPU.Info->VerticalResolution * mainTextDisplaySettings.defaultGPU.Info->HorizontalResolution; addr++)
-        *addr = mainTextDisplaySettings.backgroundColor;
 }
 
-void PrintString(unsigned char * str, UINT32 foregroundColor, UINT32 backgroundColor, ...)
+static inline ConsoleCell * GetLine(UINT64 line)
 {
-    va_list valist;
-    UINT8 num_args = 0;
+    return mainTextDisplaySettings.cells + (line % mainTextDisplaySettings.historyLines) * mainTextDisplaySettings.columns;
+}
 
-    unsigned char * str_scanner = str;
-    while(*str_scanner != '\0')
+static void MarkLinesDirty(UINT64 first, UINT64 end)
+{
+    if(mainTextDisplaySettings.dirtyFirst == mainTextDisplaySettings.dirtyEnd)
     {
-        if(*str_scanner == '%')
-        {
-            str_scanner++;
-            switch (*str_scanner)
-            {
-            case '%':
-                break;
-            case 'h':
-            case 'l':
-                str_scanner++;
-                num_args++;
-                break;
-            case 'c':
-            case 'd':
-            case 'i':
-            case 'e':
-            case 'E':
-            case 'f':
-            case 'g':
-            case 'G':
-            case 'o':
-            case 's':
-            case 'u':
-            case 'x':
-            case 'X':
-            case 'p':
-            case 'n':
-                num_args++;
-                break;
-            default:
-                break;
-            }
-        }
+        mainTextDisplaySettings.dirtyFirst = first;
+        mainTextDisplaySettings.dirtyEnd = end;
+        return;
+    }
 
-        str_scanner++;
+    if(first < mainTextDisplaySettings.dirtyFirst)
+        mainTextDisplaySettings.dirtyFirst = first;
+    if(end > mainTextDisplaySettings.dirtyEnd)
+        mainTextDisplaySettings.dirtyEnd = end;
+}
+
+static void ClearLine(UINT64 line)
+{
+    ConsoleCell * cell = GetLine(line);
+
+    for(UINT32 i = 0; i < mainTextDisplaySettings.columns; i++)
+    {
+        cell[i].character = ' ';
+        cell[i].foreground = mainTextDisplaySettings.fontColor;
+        cell[i].background = mainTextDisplaySettings.backgroundColor;
     }
 
-    UINT32 backporch = mainTextDisplaySettings.defaultGPU.Info->PixelsPerScanLine - mainTextDisplaySettings.defaultGPU.Info->HorizontalResolution; // The area offscreen is the back porch. Sometimes it's 0.
-    UINT32 rowSize = mainTextDisplaySettings.defaultGPU.Info->VerticalResolution / (8 * mainTextDisplaySettings.scale);
-    UINT32 colSize = (mainTextDisplaySettings.defaultGPU.Info->PixelsPerScanLine - backporch) / (8 * mainTextDisplaySettings.scale);
+    MarkLinesDirty(line, line + 1);
+}
+
+// Starting a line only touches the cell ring; nothing is drawn until RenderConsole()
+static void NewLine(void)
+{
+    mainTextDisplaySettings.cursorLine++;
+    mainTextDisplaySettings.cursorColumn = 0;
+    ClearLine(mainTextDisplaySettings.cursorLine);
+}
 
-    universal_long_t value;
-    universal_long_t value_cpy;
+static void PutCharacter(unsigned char chr, UINT32 foregroundColor, UINT32 backgroundColor)
+{
+    if(mainTextDisplaySettings.cursorColumn == mainTextDisplaySettings.columns)
+        NewLine();
 
-    unsigned char places;
-    unsigned long divisor;
-    unsigned char i;
-    unsigned char p;
+    ConsoleCell * cell = GetLine(mainTextDisplaySettings.cursorLine) + mainTextDisplaySettings.cursorColumn;
+    cell->character = (chr < 128) ? chr : '?'; // The font only has ASCII
+    cell->foreground = foregroundColor;
+    cell->background = backgroundColor;
 
-    va_start(valist, backgroundColor);
+    MarkLinesDirty(mainTextDisplaySettings.cursorLine, mainTextDisplaySettings.cursorLine + 1);
+    mainTextDisplaySettings.cursorColumn++;
+}
+
+static UINT64 GetBottomTop(void) // Top line of the screen when it's showing the newest output
+{
+    return (mainTextDisplaySettings.cursorLine >= mainTextDisplaySettings.rows) ? mainTextDisplaySettings.cursorLine - mainTextDisplaySettings.rows + 1 : 0;
+}
+
+// Brings the shadow buffer up to date with the cell ring. However many lines were printed since the last call, this costs at most one
+// shift of the shadow buffer plus drawing the lines that changed, and never more than one screen of cells.
+static void RenderConsole(void)
+{
+    UINT32 rows = mainTextDisplaySettings.rows;
+    UINT32 pitch = mainTextDisplaySettings.defaultGPU.Info->PixelsPerScanLine;
+    UINT32 textHeight = 8 * mainTextDisplaySettings.scale;
+    UINT64 top = GetBottomTop() - mainTextDisplaySettings.viewOffset;
 
-    while(*str != '\0')
+    if(top != mainTextDisplaySettings.renderedTop)
     {
-        if(*str == '%')
-        {
-            str++;
-            switch (*str)
-            {
-            case '%':
-                PrintCharacter(*str, foregroundColor, backgroundColor);
-                break;
-            case 'c':
-                PrintCharacter(va_arg(valist, int), foregroundColor, backgroundColor);
-                break;
-            
-            case 'l':
-                str++;
-                switch (*str)
-                {
-                case 'd':
-                case 'i':
-                    value.l = va_arg(valist, long);
-
-                    if((signed long)value.l < 0)
-                    {
-                        PrintCharacter('-', foregroundColor, backgroundColor);
-                        value.l = (unsigned long)((signed long)value.l * -1);
-                        //value.l ^= (1UL << 63);
-
-
-                        if((signed long)value.l == 0) //Check for max unsigned value, since the following arithmatic won't work on it after flipping the sign bit
-                        {
-                            PrintString("9223372036854775808", foregroundColor, backgroundColor);
-                            break;
-                        }
-                    }
-                    places = 0;
-                    value_cpy.l = value.l;
-                    while((signed long)value_cpy.l > 0)
-                    {
-                        value_cpy.l = (signed long)value_cpy.l / 10;
-                        places++;
-                    }
-
-                    if(places == 0)
-                        PrintCharacter('0', foregroundColor, backgroundColor);
-                    else
-                    {
-                        while(places > 0)
-                        {
-                            divisor = 1;
-                            for(i = 1; i < places; i++) divisor *= 10;
-                            p = ((signed long)value.l / divisor) % 10;
-                        
-                            PrintCharacter(p + 48, foregroundColor, backgroundColor);
-                            places--;
-                        }
-                    }
-                    break;
-                case 'o':
-                    value.l = va_arg(valist, unsigned long);
-
-                    places = 0;
-                    value_cpy.l = value.l;
-                    while(value_cpy.l > 0)
-                    {
-                        value_cpy.l /= 8;
-                        places++;
-                    }
-
-                    if(places == 0)
-                        PrintCharacter('0', foregroundColor, backgroundColor);
-                    else
-                    {
-                        while(places > 0)
-                        {
-                            divisor = 1;
-                            for(i = 1; i < places; i++) divisor *= 8;
-                            p = (value.l / divisor) % 8;
-                        
-                            PrintCharacter(p + 48, foregroundColor, backgroundColor);
-                            places--;
-                        }
-                    }
-                    break;
-                case 'u':
-                    value.l = va_arg(valist, unsigned long);
-
-                    places = 0;
-                    value_cpy.l = value.l;
-                    while(value_cpy.l > 0)
-                    {
-                        value_cpy.l /= 10;
-                        places++;
-                    }
-
-                    if(places == 0)
-                        PrintCharacter('0', foregroundColor, backgroundColor);
-                    else
-                    {
-                        while(places > 0)
-                        {
-                            divisor = 1;
-                            for(i = 1; i < places; i++) divisor *= 10;
-                            p = (value.l / divisor) % 10;
-                        
-                            PrintCharacter(p + 48, foregroundColor, backgroundColor);
-                            places--;
-                        }
-                    }
-                    break;
-                case 'x':
-                    value.l = va_arg(valist, unsigned long);
-
-                    places = 0;
-                    value_cpy.l = value.l;
-                    while(value_cpy.l > 0)
-                    {
-                        value_cpy.l /= 16;
-                        places++;
-                    }
-
-                    if(places == 0)
-                        PrintCharacter('0', foregroundColor, backgroundColor);
-                    else
-                    {
-                        while(places > 0)
-                        {
-                            divisor = 1;
-                            for(i = 1; i < places; i++) divisor *= 16;
-                            p = (value.l / divisor) % 16;
-
-                            if(p > 9)
-                                PrintCharacter(p + 87, foregroundColor, backgroundColor);
-                            else
-                                PrintCharacter(p + 48, foregroundColor, backgroundColor);
-                            places--;
-                        }
-                    }
-                    break;
-                case 'X':
-                    value.l = va_arg(valist, unsigned long);
-
-                    places = 0;
-                    value_cpy.l = value.l;
-                    while(value_cpy.l > 0)
-                    {
-                        value_cpy.l /= 16;
-                        places++;
-                    }
-
-                    if(places == 0)
-                        PrintCharacter('0', foregroundColor, backgroundColor);
-                    else
-                    {
-                        while(places > 0)
-                        {
-                            divisor = 1;
-                            for(i = 1; i < places; i++) divisor *= 16;
-                            p = (value.l / divisor) % 16;
-
-                            if(p > 9)
-                                PrintCharacter(p + 55, foregroundColor, backgroundColor);
-                            else
-                                PrintCharacter(p + 48, foregroundColor, backgroundColor);
-                            places--;
-                        }
-                    }
-                    break;
-                default:
-                    break;
-                }
-
-                break;
-            case 'h':
-                str++;
-                switch (*str)
-                {
-                case 'd':
-                case 'i':
-                    value.l = (signed short)va_arg(valist, int);
-
-                    if((signed short)value.l < 0)
-                    {
-                        PrintCharacter('-', foregroundColor, backgroundColor);
-                        value.l = (unsigned long)((signed short)value.l * -1);
-                        //value.l ^= (1UL << 15);
-
-                        if((signed short)value.l == 0) //Check for max unsigned value, since the following arithmatic won't work on it after flipping the sign bit
-                        {
-                            PrintString("32768", foregroundColor, backgroundColor); //Check for max unsigned value, since the following arithmatic won't work on it after flipping the sign bit
-                            break;
-                        }
-                    }
-                    places = 0;
-                    value_cpy.l = value.l;
-                    while((signed short)value_cpy.l > 0)
-                    {
-                        value_cpy.l = (signed short)value_cpy.l / 10;
-                        places++;
-                    }
-
-                    if(places == 0)
-                        PrintCharacter('0', foregroundColor, backgroundColor);
-                    else
-                    {
-                        while(places > 0)
-                        {
-                            divisor = 1;
-                            for(i = 1; i < places; i++) divisor *= 10;
-                            p = ((signed short)value.l / divisor) % 10;
-                        
-                            PrintCharacter(p + 48, foregroundColor, backgroundColor);
-                            places--;
-                        }
-                    }
-                    break;
-                case 'o':
-                    value.l = (unsigned short)va_arg(valist, unsigned int);
-
-                    places = 0;
-                    value_cpy.l = value.l;
-                    while((unsigned short)value_cpy.l > 0)
-                    {
-                        value_cpy.l = (unsigned short)value_cpy.l / 8;
-                        places++;
-                    }
-
-                    if(places == 0)
-                        PrintCharacter('0', foregroundColor, backgroundColor);
-                    else
-                    {
-                        while(places > 0)
-                        {
-                            divisor = 1;
-                            for(i = 1; i < places; i++) divisor *= 8;
-                            p = ((unsigned short)value.l / divisor) % 8;
-                        
-                            PrintCharacter(p + 48, foregroundColor, backgroundColor);
-                            places--;
-                        }
-                    }
-                    break;
-                case 's':
-                case 'u':
-                    value.l = (unsigned short)va_arg(valist, unsigned int);
-
-                    places = 0;
-                    value_cpy.l = value.l;
-                    while((unsigned short)value_cpy.l > 0)
-                    {
-                        value_cpy.l = (unsigned short)value_cpy.l / 10;
-                        places++;
-                    }
-
-                    if(places == 0)
-                        PrintCharacter('0', foregroundColor, backgroundColor);
-                    else
-                    {
-                        while(places > 0)
-                        {
-                            divisor = 1;
-                            for(i = 1; i < places; i++) divisor *= 10;
-                            p = ((unsigned short)value.l / divisor) % 10;
-                        
-                            PrintCharacter(p + 48, foregroundColor, backgroundColor);
-                            places--;
-                        }
-                    }
-                    break;
-                case 'x':
-                    value.l = (unsigned short)va_arg(valist, int);
-
-                    places = 0;
-                    value_cpy.l = value.l;
-                    while((unsigned short)value_cpy.l > 0)
-                    {
-                        value_cpy.l = (unsigned short)value_cpy.l / 16;
-                        places++;
-                    }
-
-                    if(places == 0)
-                        PrintCharacter('0', foregroundColor, backgroundColor);
-                    else
-                    {
-                        while(places > 0)
-                        {
-                            divisor = 1;
-                            for(i = 1; i < places; i++) divisor *= 16;
-                            p = ((unsigned short)value.l / divisor) % 16;
-
-                            if(p > 9)
-                                PrintCharacter(p + 87, foregroundColor, backgroundColor);
-                            else
-                                PrintCharacter(p + 48, foregroundColor, backgroundColor);
-                            places--;
-                        }
-                    }
-                    break;
-                case 'X':
-                    value.l = (unsigned short)va_arg(valist, unsigned int);
-
-                    places = 0;
-                    value_cpy.l = value.l;
-                    while((unsigned short)value_cpy.l > 0)
-                    {
-                        value_cpy.l = (unsigned short)value_cpy.l / 16;
-                        places++;
-                    }
-
-                    if(places == 0)
-                        PrintCharacter('0', foregroundColor, backgroundColor);
-                    else
-                    {
-                        while(places > 0)
-                        {
-                            divisor = 1;
-                            for(i = 1; i < places; i++) divisor *= 16;
-                            p = ((unsigned short)value.l / divisor) % 16;
-
-                            if(p > 9)
-                                PrintCharacter(p + 55, foregroundColor, backgroundColor);
-                            else
-                                PrintCharacter(p + 48, foregroundColor, backgroundColor);
-                            places--;
-                        }
-                    }
-                    break;
-                case 'p':
-                case 'n':
-                    break;
-                default:
-                    break;
-                }
-
-                break;
-            case 'd':
-            case 'i':
-                value.l = (signed int)va_arg(valist, int);
-
-                if((signed int)value.l < 0)
-                {
-                    PrintCharacter('-', foregroundColor, backgroundColor);
-                    value.l = (unsigned long)((signed int)value.l * -1);
-                    //value.l ^= (1UL << 31); //Flip sign bit
-
-                    if((signed int)value.l == 0) //Check for max unsigned value, since the following arithmatic won't work on it after flipping the sign bit
-                    {
-                        PrintString("2147483648", foregroundColor, backgroundColor);
-                        break;
-                    }
-                }
-                places = 0;
-                value_cpy.l = value.l;
-                while((signed int)value_cpy.l > 0)
-                {
-                    value_cpy.l = (signed int)value_cpy.l / 10;
-                    places++;
-                }
-
-                if(places == 0)
-                    PrintCharacter('0', foregroundColor, backgroundColor);
-                else
-                {
-                    while(places > 0)
-                    {
-                        divisor = 1;
-                        for(i = 1; i < places; i++) divisor *= 10;
-                        p = ((signed int)value.l / divisor) % 10;
-                        
-                        PrintCharacter(p + 48, foregroundColor, backgroundColor);
-                        places--;
-                    }
-                }
-                break;
-            case 'e':
-            case 'E':
-            case 'f':
-                value.d = va_arg(valist, double);
-                places = 0;
-                
-                if(((float)value.d) < 0.0f)
-                {
-                    PrintCharacter('-', foregroundColor, backgroundColor);
-                    value.d *= -1;
-                }
-
-                value_cpy.d = value.d;
-
-                while((float)value_cpy.d >= 1.0f)
-                {
-                    value_cpy.d = (float)value_cpy.d / 10;
-                    places++;
-                }
-
-                if(places == 0)
-                {
-                    PrintCharacter('0', foregroundColor, backgroundColor);
-                }
-                else
-                {
-                    while(places > 0)
-                    {
-                        divisor = 1;
-                        for(i = 1; i < places; i++) divisor *= 10;
-                        p = (unsigned long)((float)value.d / divisor) % 10;
-
-                        PrintCharacter(p + 48, foregroundColor, backgroundColor);
-                        places--;
-                    }
-                }
-
-
-                PrintCharacter('.', foregroundColor, backgroundColor);
-                places = 0;
-                while(places < 4)
-                {
-                    divisor = 10;
-                    for(i = 0; i < places; i++) divisor *= 10;
-                    p = (unsigned long)((float)value.d * divisor) % 10;
-
-                    PrintCharacter(p + 48, foregroundColor, backgroundColor);
-                    places++;
-                }
-
-
-                break;
-            case 'g':
-                value.d = va_arg(valist, double);
-                places = 0;
-                
-                if(value.d < 0.0)
-                {
-                    PrintCharacter('-', foregroundColor, backgroundColor);
-                    value.d *= -1;
-                }
-
-                value_cpy.d = value.d;
-
-                while(value_cpy.d >= 1.0)
-                {
-                    value_cpy.d = value_cpy.d / 10;
-                    places++;
-                }
-
-                if(places == 0)
-                {
-                    PrintCharacter('0', foregroundColor, backgroundColor);
-                }
-                else
-                {
-                    while(places > 0)
-                    {
-                        divisor = 1;
-                        for(i = 1; i < places; i++) divisor *= 10;
-                        p = (unsigned long)(value.d / divisor) % 10;
-
-                        PrintCharacter(p + 48, foregroundColor, backgroundColor);
-                        places--;
-                    }
-                }
-
-
-                PrintCharacter('.', foregroundColor, backgroundColor);
-                places = 0;
-                while(places < 4)
-                {
-                    divisor = 10;
-                    for(i = 0; i < places; i++) divisor *= 10;
-                    p = (unsigned long)(value.d * divisor) % 10;
-
-                    PrintCharacter(p + 48, foregroundColor, backgroundColor);
-                    places++;
-                }
-
-
-                break;
-            case 'G':
-                break;
-            case 'o':
-                value.l = (unsigned int)va_arg(valist, unsigned int);
-
-                places = 0;
-                value_cpy.l = value.l;
-                while((unsigned int)value_cpy.l > 0)
-                {
-                    value_cpy.l = (unsigned int)value_cpy.l / 8;
-                    places++;
-                }
-
-                if(places == 0)
-                    PrintCharacter('0', foregroundColor, backgroundColor);
-                else
-                {
-                    while(places > 0)
-                    {
-                        divisor = 1;
-                        for(i = 1; i < places; i++) divisor *= 8;
-                        p = ((signed int)value.l / divisor) % 8;
-                        
-                        PrintCharacter(p + 48, foregroundColor, backgroundColor);
-                        places--;
-                    }
-                }
-                break;
-            case 'u':
-                value.l = (unsigned int)va_arg(valist, unsigned int);
-
-                places = 0;
-                value_cpy.l = value.l;
-                while((unsigned int)value_cpy.l > 0)
-                {
-                    value_cpy.l = (unsigned int)value_cpy.l / 10;
-                    places++;
-                }
-
-                if(places == 0)
-                    PrintCharacter('0', foregroundColor, backgroundColor);
-                else
-                {
-                    while(places > 0)
-                    {
-                        divisor = 1;
-                        for(i = 1; i < places; i++) divisor *= 10;
-                        p = ((unsigned int)value.l / divisor) % 10;
-                        
-                        PrintCharacter(p + 48, foregroundColor, backgroundColor);
-                        places--;
-                    }
-                }
-                break;
-            case 'x':
-                value.l = (unsigned int)va_arg(valist, unsigned int);
-
-                places = 0;
-                value_cpy.l = value.l;
-                while((unsigned int)value_cpy.l > 0)
-                {
-                    value_cpy.l = (unsigned int)value_cpy.l / 16;
-                    places++;
-                }
-
-                if(places == 0)
-                    PrintCharacter('0', foregroundColor, backgroundColor);
-                else
-                {
-                    while(places > 0)
-                    {
-                        divisor = 1;
-                        for(i = 1; i < places; i++) divisor *= 16;
-                        p = ((unsigned int)value.l / divisor) % 16;
-                        
-                        if(p > 9)
-                            PrintCharacter(p + 87, foregroundColor, backgroundColor);
-                        else
-                            PrintCharacter(p + 48, foregroundColor, backgroundColor);
-                        places--;
-                    }
-                }
-                break;
-            case 'X':
-                value.l = va_arg(valist, unsigned int);
-
-                places = 0;
-                value_cpy.l = value.l;
-                while((unsigned int)value_cpy.l > 0)
-                {
-                    value_cpy.l = (unsigned int)value_cpy.l / 16;
-                    places++;
-                }
-
-                if(places == 0)
-                    PrintCharacter('0', foregroundColor, backgroundColor);
-                else
-                {
-                    while(places > 0)
-                    {
-                        divisor = 1;
-                        for(i = 1; i < places; i++) divisor *= 16;
-                        p = (value.l / divisor) % 16;
-                        
-                        if(p > 9)
-                            PrintCharacter(p + 55, foregroundColor, backgroundColor);
-                        else
-                            PrintCharacter(p + 48, foregroundColor, backgroundColor);
-                        places--;
-                    }
-                }
-                break;
-            case 'p':
-            case 'n':
-                break;
-            default:
-                break;
-            }
-        }
-        else if(*str == '\n')
+        UINT64 shift = top - mainTextDisplaySettings.renderedTop;
+
+        if((top > mainTextDisplaySettings.renderedTop) && (shift < rows))
         {
-            if(mainTextDisplaySettings.index / colSize >= rowSize - 1)
-            {
-                ScrollUp();
-                mainTextDisplaySettings.index = colSize * (rowSize - 1);
-            }
-            else mainTextDisplaySettings.index = (mainTextDisplaySettings.index / colSize + 1) * colSize;
+            // Move what's still visible up, then only the lines that scrolled in need drawing. Forward copy, so the overlap is fine.
+            CopyMemory(mainTextDisplaySettings.shadowBuffer, mainTextDisplaySettings.shadowBuffer + shift * textHeight * pitch, (rows - shift) * textHeight * pitch * 4);
+            MarkLinesDirty(mainTextDisplaySettings.renderedTop + rows, top + rows);
         }
         else
+            MarkLinesDirty(top, top + rows);
+
+        MarkDirty(0, rows * textHeight);
+        mainTextDisplaySettings.renderedTop = top;
+    }
+
+    UINT64 first = (mainTextDisplaySettings.dirtyFirst > top) ? mainTextDisplaySettings.dirtyFirst : top;
+    UINT64 end = (mainTextDisplaySettings.dirtyEnd < top + rows) ? mainTextDisplaySettings.dirtyEnd : top + rows;
+
+    for(UINT64 line = first; line < end; line++)
+    {
+        UINT32 row = line - top;
+        ConsoleCell * cell = GetLine(line);
+
+        // Lines past the cursor (only on screen before the first scroll) or older than the ring are blank
+        if((line > mainTextDisplaySettings.cursorLine) || (mainTextDisplaySettings.cursorLine - line >= mainTextDisplaySettings.historyLines))
         {
-            PrintCharacter(*str, foregroundColor, backgroundColor);
+            FillMemory32(mainTextDisplaySettings.shadowBuffer + (UINT64)row * textHeight * pitch, ToPixel(mainTextDisplaySettings.backgroundColor), (UINT64)textHeight * pitch);
+            continue;
         }
-        str++;
+
+        for(UINT32 column = 0; column < mainTextDisplaySettings.columns; column++)
+            DrawCell(row, column, &cell[column]);
     }
 
-    va_end(valist);
+    if(first < end)
+        MarkDirty((first - top) * textHeight, (end - top) * textHeight);
+
+    mainTextDisplaySettings.dirtyFirst = 0;
+    mainTextDisplaySettings.dirtyEnd = 0;
 }
 
+void PrintCharacter(unsigned char chr, UINT32 foregroundColor, UINT32 backgroundColor)
+{
+    mainTextDisplaySettings.viewOffset = 0; // New output scrolls the view back to the bottom
+    PutCharacter(chr, foregroundColor, backgroundColor);
+    RenderConsole();
+    FlushDisplay();
+}
 
-void ColorScreen(UINT32 color)
+// Pages through the scrollback: positive goes back into history, negative goes towards the newest output
+void ScrollConsoleView(INT64 lines)
+{
+    UINT64 bottomTop = GetBottomTop();
+    UINT64 oldest = (mainTextDisplaySettings.cursorLine + 1 > mainTextDisplaySettings.historyLines) ? mainTextDisplaySettings.cursorLine + 1 - mainTextDisplaySettings.historyLines : 0;
+    INT64 offset = (INT64)mainTextDisplaySettings.viewOffset + lines;
+
+    if(offset < 0)
+        offset = 0;
+    if((UINT64)offset > bottomTop - oldest)
+        offset = bottomTop - oldest;
+
+    mainTextDisplaySettings.viewOffset = offset;
+    RenderConsole();
+    FlushDisplay();
+}
+
+// Writes a run of characters into the cell ring, a line at a time
+static void PutCharacters(const unsigned char * chars, UINT64 length, UINT32 foregroundColor, UINT32 backgroundColor)
 {
-    UINT32 row, col;
-    UINT32 backporch = mainTextDisplaySettings.defaultGPU.Info->PixelsPerScanLine - mainTextDisplaySettings.defaultGPU.Info->HorizontalResolution; // The area offscreen is the back porch. Sometimes it's 0.
-    for (row = 0; row < mainTextDisplaySettings.defaultGPU.Info->VerticalResolution; row++)
+    while(length > 0)
     {
-        for (col = 0; col < (mainTextDisplaySettings.defaultGPU.Info->PixelsPerScanLine - backporch); col++) // Per UEFI Spec 2.7 Errata A, framebuffer address 0 coincides with the top leftmost pixel. i.e. screen padding is only HorizontalResolution + porch.
+        if(*chars == '\n')
         {
-            *(UINT32*)(mainTextDisplaySettings.defaultGPU.FrameBufferBase + 4 * (mainTextDisplaySettings.defaultGPU.Info->PixelsPerScanLine * row + col)) = color; // The thing at FrameBufferBase is an address pointing to UINT32s. FrameBufferBase itself is a 64-bit number.
+            NewLine();
+            chars++;
+            length--;
+            continue;
         }
-        
+
+        if(mainTextDisplaySettings.cursorColumn == mainTextDisplaySettings.columns)
+            NewLine();
+
+        ConsoleCell * cell = GetLine(mainTextDisplaySettings.cursorLine) + mainTextDisplaySettings.cursorColumn;
+        UINT32 space = mainTextDisplaySettings.columns - mainTextDisplaySettings.cursorColumn;
+        UINT32 count;
+
+        for(count = 0; (count < space) && (count < length) && (chars[count] != '\n'); count++)
+        {
+            cell[count].character = (chars[count] < 128) ? chars[count] : '?'; // The font only has ASCII
+            cell[count].foreground = foregroundColor;
+            cell[count].background = backgroundColor;
+        }
+
+        MarkLinesDirty(mainTextDisplaySettings.cursorLine, mainTextDisplaySettings.cursorLine + 1);
+        mainTextDisplaySettings.cursorColumn += count;
+        chars += count;
+        length -= count;
     }
-}
\ No newline at end of file
+}
+
+// Puts text in the console without drawing it; UpdateConsole() draws everything written since the last update in one go
+void WriteConsole(const unsigned char * chars, UINT64 length, UINT32 foregroundColor, UINT32 backgroundColor)
+{
+    mainTextDisplaySettings.viewOffset = 0;
+    PutCharacters(chars, length, foregroundColor, backgroundColor);
+}
+
+void UpdateConsole(void)
+{
+    RenderConsole();
+    FlushDisplay();
+}
+
+// Goes through the log like everything else, so the text reaches every console= sink and comes out in order with records still in the
+// ring. The log picks the colors.
+void PrintString(unsigned char * str, UINT32 foregroundColor, UINT32 backgroundColor, ...)
+{
+    va_list valist;
+
+    va_start(valist, backgroundColor);
+    LogMessageV(LOG_LEVEL_INFO, str, valist);
+    va_end(valist);
+    DrainLog();
+}
+
+void ColorScreen(UINT32 color)
+{
+    UINT32 height = mainTextDisplaySettings.defaultGPU.Info->VerticalResolution;
+
+    // Per UEFI Spec 2.7 Errata A, framebuffer address 0 coincides with the top leftmost pixel, and each row is PixelsPerScanLine long (HorizontalResolution + porch)
+    FillMemory32(mainTextDisplaySettings.shadowBuffer, ToPixel(color), (UINT64)mainTextDisplaySettings.defaultGPU.Info->PixelsPerScanLine * height);
+
+    MarkDirty(0, height);
+    FlushDisplay();
+}
@@ -21,6 +21,8 @@
 #include "kernel/graphics.h"
 #include "kernel/memory.h"
 #include "kernel/drivers.h"
+#include "kernel/boottime.h"
+#include "kernel/smp.h"
 
 #define STACK_SIZE (1 << 20)
 
@@ -51,11 +53,14 @@ void kernel_main(LOADER_PARAMS * LP) // Loader Parameters
 
     PrintString("Hello!\n", mainTextDisplaySettings.fontColor, mainTextDisplaySettings.backgroundColor);
     PrintString("Stack Address: 0x%lX\n", mainTextDisplaySettings.fontColor, mainTextDisplaySettings.backgroundColor, kernel_stack);
+    PrintString("Free Memory: %lu KiB, Used: %lu KiB\n", mainTextDisplaySettings.fontColor, mainTextDisplaySettings.backgroundColor, GetFreePhysicalPages() << 2, GetUsedPhysicalPages() << 2);
     
+    StartBootPhase(BOOT_PHASE_DRIVERS);
     InitializeDrivers(LP->ConfigTables, LP->Number_of_ConfigTables);
+    EndBootPhase(BOOT_PHASE_DRIVERS);
 
-    while(1)
-    {
+    PrintBootTimings();
 
-    }
+    while(1)
+        WaitForInterrupt();
 }
\ No newline at end of file
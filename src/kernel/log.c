@@ -0,0 +1,282 @@
+/*
+   Copyright 2019 Dylan Green
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "kernel/kernel.h"
+#include "kernel/log.h"
+#include "kernel/format.h"
+#include "kernel/graphics.h"
+#include "kernel/serial.h"
+#include "kernel/options.h"
+#include "kernel/clock.h"
+
+#define LOG_ALIGN(size) (((size) + 7) & ~7ULL)
+
+// In .bss, so it works before there's a memory manager
+KernelLog mainKernelLog;
+
+// Compares the characters from name up to end with an option name
+static bool MatchName(const char * name, const char * end, const char * option)
+{
+    for(; (name < end) && (*option != '\0'); name++, option++)
+    {
+        if(*name != *option)
+            return false;
+    }
+
+    return (name == end) && (*option == '\0');
+}
+
+void InitializeLogSinks(void)
+{
+    uint8_t sinks = 0;
+    const char * console = GetBootOptionString("console", "framebuffer");
+
+    // console=name[,name...]
+    for(const char * name = console; *name != '\0';)
+    {
+        const char * end = name;
+        while((*end != '\0') && (*end != ','))
+            end++;
+
+        if(MatchName(name, end, "framebuffer"))
+            sinks |= LOG_SINK_FRAMEBUFFER;
+        else if(MatchName(name, end, "serial"))
+            sinks |= LOG_SINK_SERIAL;
+        else if(MatchName(name, end, "debugcon"))
+            sinks |= LOG_SINK_DEBUGCON;
+
+        name = (*end != '\0') ? end + 1 : end;
+    }
+
+    if(sinks == 0)
+        sinks = LOG_SINK_FRAMEBUFFER;
+
+    if((sinks & LOG_SINK_SERIAL) && InitializeSerial())
+        mainKernelLog.readySinks |= LOG_SINK_SERIAL;
+    if((sinks & LOG_SINK_DEBUGCON) && InitializeDebugcon())
+        mainKernelLog.readySinks |= LOG_SINK_DEBUGCON;
+
+    // Asked for a headless console that isn't there: fall back to the screen rather than lose everything
+    if(!(sinks & LOG_SINK_FRAMEBUFFER) && (mainKernelLog.readySinks == 0))
+        sinks |= LOG_SINK_FRAMEBUFFER;
+
+    mainKernelLog.sinks = sinks;
+
+    // loglevel=debug|info|warning|error (or 0-3); messages below it are thrown away without being formatted
+    const char * level = GetBootOptionString("loglevel", "debug");
+    const char * levelEnd = level;
+    while(*levelEnd != '\0')
+        levelEnd++;
+
+    if(MatchName(level, levelEnd, "info") || MatchName(level, levelEnd, "1"))
+        mainKernelLog.minimumLevel = LOG_LEVEL_INFO;
+    else if(MatchName(level, levelEnd, "warning") || MatchName(level, levelEnd, "2"))
+        mainKernelLog.minimumLevel = LOG_LEVEL_WARNING;
+    else if(MatchName(level, levelEnd, "error") || MatchName(level, levelEnd, "3"))
+        mainKernelLog.minimumLevel = LOG_LEVEL_ERROR;
+    else
+        mainKernelLog.minimumLevel = LOG_LEVEL_DEBUG;
+}
+
+void LogMessage(uint8_t level, unsigned char * format, ...)
+{
+    va_list valist;
+
+    va_start(valist, format);
+    LogMessageV(level, format, valist);
+    va_end(valist);
+}
+
+void LogMessageV(uint8_t level, unsigned char * format, va_list args)
+{
+    if(level < mainKernelLog.minimumLevel)
+        return;
+
+    unsigned char message[LOG_MAX_MESSAGE];
+    uint64_t length = FormatToBuffer(message, sizeof(message), format, args);
+
+    uint64_t recordSize = LOG_ALIGN(sizeof(LogRecord) + length);
+    uint64_t start = __atomic_load_n(&mainKernelLog.head, __ATOMIC_ACQUIRE);
+    uint64_t offset;
+    uint64_t padding;
+
+    do
+    {
+        offset = start & (LOG_BUFFER_SIZE - 1);
+        padding = (offset + recordSize > LOG_BUFFER_SIZE) ? LOG_BUFFER_SIZE - offset : 0;
+
+        if(start + padding + recordSize - __atomic_load_n(&mainKernelLog.tail, __ATOMIC_ACQUIRE) > LOG_BUFFER_SIZE)
+        {
+            __atomic_fetch_add(&mainKernelLog.dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+    } while(!__atomic_compare_exchange_n(&mainKernelLog.head, &start, start + padding + recordSize, true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+    // A gap too small for a header is skipped by the reader without one
+    if(padding >= sizeof(LogRecord))
+    {
+        LogRecord * pad = (LogRecord *)(mainKernelLog.buffer + offset);
+        pad->length = padding - sizeof(LogRecord);
+        pad->level = LOG_LEVEL_PADDING;
+        __atomic_store_n(&pad->state, LOG_RECORD_COMMITTED, __ATOMIC_RELEASE);
+    }
+
+    LogRecord * record = (LogRecord *)(mainKernelLog.buffer + ((offset + padding) & (LOG_BUFFER_SIZE - 1)));
+    record->timestamp = ReadCycleCounter();
+    record->length = length;
+    record->level = level;
+    CopyMemory(record->text, message, length);
+    __atomic_store_n(&record->state, LOG_RECORD_COMMITTED, __ATOMIC_RELEASE);
+}
+
+static void WriteToSinks(uint8_t sinks, const unsigned char * chars, uint64_t length, UINT32 color)
+{
+    if(sinks & LOG_SINK_FRAMEBUFFER)
+        WriteConsole(chars, length, color, mainTextDisplaySettings.backgroundColor);
+    if(sinks & LOG_SINK_SERIAL)
+        WriteSerial(chars, length);
+    if(sinks & LOG_SINK_DEBUGCON)
+        WriteDebugcon(chars, length);
+}
+
+static void FormatMessage(unsigned char * message, uint64_t size, uint64_t * length, unsigned char * format, ...);
+
+static void WriteLogRecord(uint8_t sinks, LogRecord * record)
+{
+    if(!mainKernelLog.midLine && mainClockSource.frequency) // Once the clock is calibrated, lines start with seconds since the counter started
+    {
+        unsigned char stamp[32];
+        uint64_t length;
+        uint64_t microseconds = CyclesToNanoseconds(record->timestamp) / 1000;
+
+        FormatMessage(stamp, sizeof(stamp), &length, "[%5lu.%06lu] ", microseconds / 1000000, microseconds % 1000000);
+        WriteToSinks(sinks, stamp, length, mainTextDisplaySettings.fontColor);
+    }
+
+    // Only the record that starts a line gets a level tag; the rest of a line built from several LogMessage() calls just continues it
+    if(!mainKernelLog.midLine)
+    {
+        switch(record->level)
+        {
+        case LOG_LEVEL_DEBUG:
+            WriteToSinks(sinks, "[DEBUG] ", 8, mainTextDisplaySettings.highlightColor);
+            break;
+        case LOG_LEVEL_WARNING:
+            WriteToSinks(sinks, "[WARNING] ", 10, mainTextDisplaySettings.highlightColor);
+            break;
+        case LOG_LEVEL_ERROR:
+            WriteToSinks(sinks, "[ERROR] ", 8, mainTextDisplaySettings.highlightColor);
+            break;
+        default:
+            break;
+        }
+    }
+
+    WriteToSinks(sinks, record->text, record->length, mainTextDisplaySettings.fontColor);
+
+    if(record->length)
+        mainKernelLog.midLine = record->text[record->length - 1] != '\n';
+}
+
+static uint8_t GetReadySinks(void)
+{
+    uint8_t ready = mainKernelLog.readySinks;
+
+    if(mainTextDisplaySettings.cells != NULL)
+        ready |= LOG_SINK_FRAMEBUFFER;
+
+    return mainKernelLog.sinks & ready;
+}
+
+static void FormatMessage(unsigned char * message, uint64_t size, uint64_t * length, unsigned char * format, ...)
+{
+    va_list valist;
+
+    va_start(valist, format);
+    *length = FormatToBuffer(message, size, format, valist);
+    va_end(valist);
+}
+
+void DrainLog(void)
+{
+    uint8_t sinks = GetReadySinks();
+
+    if(sinks == 0) // Nowhere to write to yet
+        return;
+
+    if(__atomic_exchange_n(&mainKernelLog.draining, 1, __ATOMIC_ACQUIRE)) // Someone else is already draining (e.g. an interrupt came in during it)
+        return;
+
+    uint64_t tail = mainKernelLog.tail;
+
+    while(tail != __atomic_load_n(&mainKernelLog.head, __ATOMIC_ACQUIRE))
+    {
+        uint64_t offset = tail & (LOG_BUFFER_SIZE - 1);
+        uint64_t size = LOG_BUFFER_SIZE - offset;
+
+        if(size >= sizeof(LogRecord))
+        {
+            LogRecord * record = (LogRecord *)(mainKernelLog.buffer + offset);
+
+            if(__atomic_load_n(&record->state, __ATOMIC_ACQUIRE) != LOG_RECORD_COMMITTED) // Reserved, but still being written
+                break;
+
+            if(record->level != LOG_LEVEL_PADDING)
+                WriteLogRecord(sinks, record);
+
+            size = LOG_ALIGN(sizeof(LogRecord) + record->length);
+        }
+
+        // Free space is kept zeroed, so a reserved record always reads as LOG_RECORD_FREE until its writer commits it
+        SetMemory(mainKernelLog.buffer + offset, 0, size);
+        tail += size;
+        __atomic_store_n(&mainKernelLog.tail, tail, __ATOMIC_RELEASE);
+    }
+
+    uint64_t dropped = __atomic_load_n(&mainKernelLog.dropped, __ATOMIC_RELAXED);
+    if(dropped != mainKernelLog.reportedDropped)
+    {
+        unsigned char message[48];
+        uint64_t length;
+
+        FormatMessage(message, sizeof(message), &length, "%lu log messages dropped\n", dropped - mainKernelLog.reportedDropped);
+        WriteToSinks(sinks, "[WARNING] ", 10, mainTextDisplaySettings.highlightColor);
+        WriteToSinks(sinks, message, length, mainTextDisplaySettings.fontColor);
+        mainKernelLog.reportedDropped = dropped;
+    }
+
+    if(sinks & LOG_SINK_FRAMEBUFFER)
+        UpdateConsole();
+
+    __atomic_store_n(&mainKernelLog.draining, 0, __ATOMIC_RELEASE);
+}
+
+#ifdef DEBUG_PIOUS
+// Left in the ring for the next DrainLog(); only PrintErrorCode() drains straight away, since the kernel is about to stop
+void PrintDebugMessage(unsigned char * str)
+{
+    LogMessage(LOG_LEVEL_DEBUG, "%s", str);
+}
+
+void PrintErrorCode(unsigned long code, unsigned char * message)
+{
+    if(*message != '\0')
+        LogMessage(LOG_LEVEL_ERROR, "%s - Error Code: 0x%lX", message, code);
+    else
+        LogMessage(LOG_LEVEL_ERROR, "Error Code: 0x%lX", code);
+    DrainLog();
+}
+#endif
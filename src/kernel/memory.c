@@ -21,36 +21,515 @@
 #include "kernel/kernel.h"
 #include "kernel/graphics.h"
 #include "kernel/memory.h"
+#include "kernel/options.h"
 
 MemorySettings mainMemorySettings;
 
+#define PAGE_CACHE_SIZE 512 // Free order 0 frames kept on hand so single page allocations and frees are O(1)
+
+#define PAGE_FRAME_NONE      0xFFFFFFFF // End of a free list
+#define PAGE_FRAME_FREE      0x01       // Head of a block that is on a free list
+#define PAGE_FRAME_ALLOCATED 0x02       // Head of an allocated block
+#define PAGE_FRAME_CACHED    0x04       // With PAGE_FRAME_ALLOCATED: an order 0 frame sitting in pageCache, so it's really free
+// Frames with no flags are either reserved, not RAM, or inside a larger block
+
+// Buddy allocator metadata, one per page frame
+typedef struct PageFrame {
+    uint32_t next;  // Free list links (frame numbers), only valid while PAGE_FRAME_FREE
+    uint32_t prev;
+    uint8_t  order; // Block order, only valid on block heads
+    uint8_t  flags;
+    uint16_t pad;
+} PageFrame;
+
+static PageFrame * pageFrames = NULL;
+static uint64_t pageFrameCount = 0;                      // Number of page frames covered by pageFrames
+static uint32_t freeLists[PAGE_MAX_ORDER + 1];           // Head frame of each order's free list
+static uint64_t freeBlockCount[PAGE_MAX_ORDER + 1];
+static uint64_t freePageCount = 0;                       // Includes frames sitting in pageCache
+static uint64_t usedPageCount = 0;
+
+static uint64_t pageCache[PAGE_CACHE_SIZE]; // Frames in here are allocated order 0 blocks as far as the buddy lists are concerned, but are counted as free
+static uint64_t pageCacheCount = 0;
+static uint64_t pageCacheLimit = PAGE_CACHE_SIZE;  // pagecache= boot option; 0 sends every single page straight to the buddy lists
+
+static void PushFreeBlock(uint64_t frame, uint8_t order);
+static void UnlinkFreeBlock(uint64_t frame);
+static uint64_t TakeBlock(uint8_t order);
+static void ReturnBlock(uint64_t frame, uint8_t order);
+static void ReleaseFrames(uint64_t frame, uint64_t count);
+static void ReleaseMemoryType(UINT32 type);
+static void RefillPageCache(void);
+static void FlushPageCache(void);
+
+
+#define FOR_EACH_DESCRIPTOR(Piece) for(Piece = mainMemorySettings.memMap; Piece < (EFI_MEMORY_DESCRIPTOR *)((uint8_t *)mainMemorySettings.memMap + mainMemorySettings.memMapSize); Piece = (EFI_MEMORY_DESCRIPTOR *)((uint8_t *)Piece + mainMemorySettings.memMapDescriptorSize))
+
+static bool IsRamType(UINT32 type)
+{
+    return (type != EfiMemoryMappedIO) &&
+           (type != EfiMemoryMappedIOPortSpace) &&
+           (type != EfiPalCode) &&
+           (type != EfiMaxMemoryType);
+}
+
+// Largest naturally aligned block that starts at frame and fits in count frames
+static uint8_t LargestOrder(uint64_t frame, uint64_t count)
+{
+    uint8_t order = 0;
+    while((order < PAGE_MAX_ORDER) && !(frame & (1ULL << order)) && ((2ULL << order) <= count))
+        order++;
+    return order;
+}
+
+// NOTE: This runs before the display is set up, so nothing in here can print
 void InitializeMemory(UINTN MapSize, UINTN DescriptorSize, EFI_MEMORY_DESCRIPTOR *Map, UINT32 DescriptorVersion)
 {
+    EFI_MEMORY_DESCRIPTOR * Piece;
+    uint64_t maxRamAddress = 0;
+    uint64_t i;
+
     mainMemorySettings.memMap = Map;
     mainMemorySettings.memMapDescriptorVersion = DescriptorVersion;
     mainMemorySettings.memMapDescriptorSize = DescriptorSize;
     mainMemorySettings.memMapSize = MapSize;
+
+    mainMemorySettings.totalSystemRam = 0;
+    mainMemorySettings.usableSystemRam = 0;
+
+    pageCacheLimit = GetBootOptionInteger("pagecache", PAGE_CACHE_SIZE);
+    if(pageCacheLimit > PAGE_CACHE_SIZE)
+        pageCacheLimit = PAGE_CACHE_SIZE;
+
+    // One pass over the map for the totals and the highest RAM address. MMIO can sit far above the end of RAM, so it doesn't count towards the metadata size.
+    FOR_EACH_DESCRIPTOR(Piece)
+    {
+        mainMemorySettings.totalSystemRam += Piece->NumberOfPages << EFI_PAGE_SHIFT;
+        if(IsRamType(Piece->Type))
+        {
+            mainMemorySettings.usableSystemRam += Piece->NumberOfPages << EFI_PAGE_SHIFT;
+            if(Piece->PhysicalStart + (Piece->NumberOfPages << EFI_PAGE_SHIFT) > maxRamAddress)
+                maxRamAddress = Piece->PhysicalStart + (Piece->NumberOfPages << EFI_PAGE_SHIFT);
+        }
+    }
+
+    pageFrameCount = maxRamAddress >> EFI_PAGE_SHIFT;
+    if(pageFrameCount > PAGE_FRAME_NONE) // Frame numbers are 32 bits, which covers 16 TiB
+        pageFrameCount = PAGE_FRAME_NONE;
+    uint64_t metadataPages = EFI_SIZE_TO_PAGES(pageFrameCount * sizeof(PageFrame));
+
+    // Carve the metadata out of the first free range that fits. Memory below 1 MiB is kept for things that need to be there (AP startup code, etc.)
+    EFI_MEMORY_DESCRIPTOR * MetadataPiece = NULL;
+    FOR_EACH_DESCRIPTOR(Piece)
+    {
+        if((Piece->Type == EfiConventionalMemory) && (Piece->NumberOfPages >= metadataPages) && (Piece->PhysicalStart >= (1ULL << 20)))
+        {
+            MetadataPiece = Piece;
+            break;
+        }
+    }
+    if(MetadataPiece == NULL)
+        Abort(MEMORY_ERROR_NO_METADATA_SPACE);
+
+    // UEFI identity maps all RAM, so the physical address can be used directly
+    pageFrames = (PageFrame *)MetadataPiece->PhysicalStart;
+    for(i = 0; i < pageFrameCount; i++)
+    {
+        pageFrames[i].next = PAGE_FRAME_NONE;
+        pageFrames[i].prev = PAGE_FRAME_NONE;
+        pageFrames[i].order = 0;
+        pageFrames[i].flags = 0;
+        pageFrames[i].pad = 0;
+    }
+
+    for(i = 0; i <= PAGE_MAX_ORDER; i++)
+    {
+        freeLists[i] = PAGE_FRAME_NONE;
+        freeBlockCount[i] = 0;
+    }
+
+    freePageCount = 0;
+    usedPageCount = 0;
+    pageCacheCount = 0;
+
+    // Boot services memory still holds the firmware's page tables, so it's left alone until ReclaimBootServicesMemory().
+    // EfiLoaderData holds everything the bootloader handed over (this kernel, LOADER_PARAMS, the memory map, GPU info, the kernel's mappings), so it stays reserved.
+    FOR_EACH_DESCRIPTOR(Piece)
+    {
+        if(Piece == MetadataPiece)
+            ReleaseFrames((Piece->PhysicalStart >> EFI_PAGE_SHIFT) + metadataPages, Piece->NumberOfPages - metadataPages);
+        else if(Piece->Type == EfiConventionalMemory)
+            ReleaseFrames(Piece->PhysicalStart >> EFI_PAGE_SHIFT, Piece->NumberOfPages);
+    }
 }
 
-uint64_t AdjustMemMapSize(uint64_t NumberOfNewDescriptors)
+// Adds EfiBootServicesCode/Data to the allocator. Only call this once nothing depends on firmware structures anymore (i.e. the kernel's own page tables are loaded).
+void ReclaimBootServicesMemory(void)
 {
-    size_t numPages = EFI_SIZE_TO_PAGES(mainMemorySettings.memMapSize + (NumberOfNewDescriptors * mainMemorySettings.memMapDescriptorSize));
-    size_t originalNumPages = EFI_SIZE_TO_PAGES(mainMemorySettings.memMapSize);
+    ReleaseMemoryType(EfiBootServicesCode);
+    ReleaseMemoryType(EfiBootServicesData);
+}
 
-    if(numPages > originalNumPages)
+static void ReleaseMemoryType(UINT32 type)
+{
+    EFI_MEMORY_DESCRIPTOR * Piece;
+
+    FOR_EACH_DESCRIPTOR(Piece)
     {
-        EFI_MEMORY_DESCRIPTOR * Piece;
-        for(Piece = mainMemorySettings.memMap;
-            (uint8_t *)Piece < ((uint8_t *)mainMemorySettings.memMap + mainMemorySettings.memMapSize);
-            Piece = (EFI_MEMORY_DESCRIPTOR*)((uint8_t *)Piece + mainMemorySettings.memMapDescriptorSize))
+        if(Piece->Type == type)
+            ReleaseFrames(Piece->PhysicalStart >> EFI_PAGE_SHIFT, Piece->NumberOfPages);
+    }
+}
+
+// Hands a range of reserved frames to the buddy lists as the largest aligned blocks that fit
+static void ReleaseFrames(uint64_t frame, uint64_t count)
+{
+    if((frame == 0) && count) // Frame 0 is never handed out so that 0 can mean failure
+    {
+        frame++;
+        count--;
+    }
+    if(frame >= pageFrameCount)
+        return;
+    if(frame + count > pageFrameCount)
+        count = pageFrameCount - frame;
+
+    while(count)
+    {
+        uint8_t order = LargestOrder(frame, count);
+        ReturnBlock(frame, order);
+        freePageCount += 1ULL << order;
+        frame += 1ULL << order;
+        count -= 1ULL << order;
+    }
+}
+
+static void PushFreeBlock(uint64_t frame, uint8_t order)
+{
+    pageFrames[frame].flags = PAGE_FRAME_FREE;
+    pageFrames[frame].order = order;
+    pageFrames[frame].prev = PAGE_FRAME_NONE;
+    pageFrames[frame].next = freeLists[order];
+
+    if(freeLists[order] != PAGE_FRAME_NONE)
+        pageFrames[freeLists[order]].prev = frame;
+    freeLists[order] = frame;
+    freeBlockCount[order]++;
+}
+
+static void UnlinkFreeBlock(uint64_t frame)
+{
+    uint8_t order = pageFrames[frame].order;
+
+    if(pageFrames[frame].prev != PAGE_FRAME_NONE)
+        pageFrames[pageFrames[frame].prev].next = pageFrames[frame].next;
+    else
+        freeLists[order] = pageFrames[frame].next;
+
+    if(pageFrames[frame].next != PAGE_FRAME_NONE)
+        pageFrames[pageFrames[frame].next].prev = pageFrames[frame].prev;
+
+    pageFrames[frame].flags = 0;
+    freeBlockCount[order]--;
+}
+
+// Removes a block of the given order from the free lists, splitting a larger one if needed. Returns 0 if nothing is big enough.
+static uint64_t TakeBlock(uint8_t order)
+{
+    uint8_t current = order;
+
+    while((current <= PAGE_MAX_ORDER) && (freeLists[current] == PAGE_FRAME_NONE))
+        current++;
+    if(current > PAGE_MAX_ORDER)
+        return 0;
+
+    uint64_t frame = freeLists[current];
+    UnlinkFreeBlock(frame);
+
+    // Give back the upper halves until the block is the right size
+    while(current > order)
+    {
+        current--;
+        PushFreeBlock(frame + (1ULL << current), current);
+    }
+
+    pageFrames[frame].flags = PAGE_FRAME_ALLOCATED;
+    pageFrames[frame].order = order;
+    return frame;
+}
+
+// Puts a block back on the free lists, merging it with its buddy for as long as the buddy is free and the same size
+static void ReturnBlock(uint64_t frame, uint8_t order)
+{
+    pageFrames[frame].flags = 0;
+
+    while(order < PAGE_MAX_ORDER)
+    {
+        uint64_t buddy = frame ^ (1ULL << order);
+        if((buddy >= pageFrameCount) || (pageFrames[buddy].flags != PAGE_FRAME_FREE) || (pageFrames[buddy].order != order))
+            break;
+
+        UnlinkFreeBlock(buddy);
+        frame &= ~(1ULL << order);
+        order++;
+    }
+
+    PushFreeBlock(frame, order);
+}
+
+static void RefillPageCache(void)
+{
+    uint64_t target = pageCacheLimit / 2; // Leave room in the cache for frees after a refill
+    if(target == 0)
+        target = 1;
+
+    while(pageCacheCount < target)
+    {
+        uint64_t frame = TakeBlock(0);
+        if(frame == 0)
+            break;
+        pageFrames[frame].flags |= PAGE_FRAME_CACHED;
+        pageCache[pageCacheCount++] = frame;
+    }
+}
+
+// Returns every cached frame to the buddy lists so they can coalesce for larger allocations
+static void FlushPageCache(void)
+{
+    while(pageCacheCount)
+    {
+        pageCacheCount--;
+        pageFrames[pageCache[pageCacheCount]].flags &= ~PAGE_FRAME_CACHED;
+        ReturnBlock(pageCache[pageCacheCount], 0);
+    }
+}
+
+uint64_t AllocatePhysicalPage(void)
+{
+    if(pageCacheCount == 0)
+    {
+        RefillPageCache();
+        if(pageCacheCount == 0)
+            return 0;
+    }
+
+    uint64_t frame = pageCache[--pageCacheCount];
+    pageFrames[frame].flags &= ~PAGE_FRAME_CACHED;
+    freePageCount--;
+    usedPageCount++;
+    return frame << EFI_PAGE_SHIFT;
+}
+
+void FreePhysicalPage(uint64_t address)
+{
+    uint64_t frame = address >> EFI_PAGE_SHIFT;
+
+    // A frame that's already in pageCache has PAGE_FRAME_CACHED set too, so freeing it twice is caught here
+    if((frame == 0) || (frame >= pageFrameCount) || (pageFrames[frame].flags != PAGE_FRAME_ALLOCATED) || (pageFrames[frame].order != 0))
+        Abort(MEMORY_ERROR_BAD_FREE);
+
+    if(pageCacheCount < pageCacheLimit)
+    {
+        pageFrames[frame].flags |= PAGE_FRAME_CACHED; // Stays allocated as far as the buddy lists are concerned
+        pageCache[pageCacheCount++] = frame;
+    }
+    else
+        ReturnBlock(frame, 0);
+
+    freePageCount++;
+    usedPageCount--;
+}
+
+// For things that have to sit low in memory, like the AP startup code (below 1 MiB). Searches the frames below limit, so it's slow.
+uint64_t AllocatePhysicalPageBelow(uint64_t limit)
+{
+    uint64_t end = limit >> EFI_PAGE_SHIFT;
+    if(end > pageFrameCount)
+        end = pageFrameCount;
+
+    for(uint8_t attempt = 0; attempt < 2; attempt++)
+    {
+        for(uint64_t frame = 1; frame < end; frame++)
+        {
+            if(pageFrames[frame].flags != PAGE_FRAME_FREE)
+                continue;
+
+            // Keep the first page of the block and give back the upper halves, like TakeBlock()
+            uint8_t order = pageFrames[frame].order;
+            UnlinkFreeBlock(frame);
+            while(order > 0)
             {
-                break;
+                order--;
+                PushFreeBlock(frame + (1ULL << order), order);
             }
-            if((uint8_t *)Piece == ((uint8_t *)mainMemorySettings.memMap + mainMemorySettings.memMapSize))
+
+            pageFrames[frame].flags = PAGE_FRAME_ALLOCATED;
+            pageFrames[frame].order = 0;
+            freePageCount--;
+            usedPageCount++;
+            return frame << EFI_PAGE_SHIFT;
+        }
+
+        FlushPageCache(); // A cached frame might be the only low one
+    }
+
+    return 0;
+}
+
+// Returns a naturally aligned block of 2^order pages
+uint64_t AllocatePhysicalBlock(uint8_t order)
+{
+    if(order > PAGE_MAX_ORDER)
+        return 0;
+
+    uint64_t frame = TakeBlock(order);
+    if((frame == 0) && pageCacheCount)
+    {
+        // Cached frames might be keeping buddies from merging
+        FlushPageCache();
+        frame = TakeBlock(order);
+    }
+    if(frame == 0)
+        return 0;
+
+    freePageCount -= 1ULL << order;
+    usedPageCount += 1ULL << order;
+    return frame << EFI_PAGE_SHIFT;
+}
+
+void FreePhysicalBlock(uint64_t address, uint8_t order)
+{
+    uint64_t frame = address >> EFI_PAGE_SHIFT;
+
+    if((frame == 0) || (frame >= pageFrameCount) || (pageFrames[frame].flags != PAGE_FRAME_ALLOCATED) || (pageFrames[frame].order != order))
+        Abort(MEMORY_ERROR_BAD_FREE);
+
+    ReturnBlock(frame, order);
+    freePageCount += 1ULL << order;
+    usedPageCount -= 1ULL << order;
+}
+
+// Contiguous pages that don't have to be a power of two. The block is rounded up to the next order and the unused tail is given back.
+uint64_t AllocatePhysicalPages(uint64_t count)
+{
+    uint8_t order = 0;
+
+    if(count == 0)
+        return 0;
+    if(count == 1)
+        return AllocatePhysicalPage();
+
+    while((order <= PAGE_MAX_ORDER) && ((1ULL << order) < count))
+        order++;
+
+    uint64_t address = AllocatePhysicalBlock(order);
+    if(address == 0)
+        return 0;
+
+    uint64_t frame = address >> EFI_PAGE_SHIFT;
+    uint64_t end = frame + count;
+    uint64_t blockEnd = frame + (1ULL << order);
+    uint64_t current = frame;
+
+    // Record the used part as the same aligned pieces FreePhysicalPages() will look for
+    pageFrames[frame].flags = 0;
+    while(current < end)
+    {
+        uint8_t pieceOrder = LargestOrder(current, end - current);
+        pageFrames[current].flags = PAGE_FRAME_ALLOCATED;
+        pageFrames[current].order = pieceOrder;
+        current += 1ULL << pieceOrder;
+    }
+
+    while(current < blockEnd)
+    {
+        uint8_t pieceOrder = LargestOrder(current, blockEnd - current);
+        ReturnBlock(current, pieceOrder);
+        current += 1ULL << pieceOrder;
+    }
+
+    freePageCount += blockEnd - end;
+    usedPageCount -= blockEnd - end;
+    return address;
+}
+
+void FreePhysicalPages(uint64_t address, uint64_t count)
+{
+    uint64_t frame = address >> EFI_PAGE_SHIFT;
+    uint64_t end = frame + count;
+    uint64_t current;
+
+    if((frame == 0) || (end > pageFrameCount))
+        Abort(MEMORY_ERROR_BAD_FREE);
+
+    // Check everything before freeing anything
+    for(current = frame; current < end; current += 1ULL << LargestOrder(current, end - current))
+    {
+        if((pageFrames[current].flags != PAGE_FRAME_ALLOCATED) || (pageFrames[current].order != LargestOrder(current, end - current)))
+            Abort(MEMORY_ERROR_BAD_FREE);
+    }
+
+    current = frame;
+    while(current < end)
+    {
+        uint8_t pieceOrder = LargestOrder(current, end - current);
+        ReturnBlock(current, pieceOrder);
+        current += 1ULL << pieceOrder;
+    }
+
+    freePageCount += count;
+    usedPageCount -= count;
+}
+
+uint64_t GetFreePhysicalPages(void)
+{
+    return freePageCount;
+}
+
+uint64_t GetUsedPhysicalPages(void)
+{
+    return usedPageCount;
+}
+
+uint64_t GetFreePhysicalBlocks(uint8_t order)
+{
+    if(order > PAGE_MAX_ORDER)
+        return 0;
+    return freeBlockCount[order];
+}
+
+// Where the run of RAM, or of anything else, that address starts ends (no further than limit). Adjacent RAM descriptors are merged;
+// addresses the memory map doesn't cover aren't RAM.
+uint64_t GetPhysicalRun(uint64_t address, uint64_t limit, bool * ram)
+{
+    EFI_MEMORY_DESCRIPTOR * Piece;
+    uint64_t end = address;
+    bool extended = true;
+
+    while(extended)
+    {
+        extended = false;
+        FOR_EACH_DESCRIPTOR(Piece)
         {
-            Abort(0xFFFFFFFFFFFFFFFF);
+            uint64_t pieceEnd = Piece->PhysicalStart + (Piece->NumberOfPages << EFI_PAGE_SHIFT);
+            if(IsRamType(Piece->Type) && (Piece->PhysicalStart <= end) && (pieceEnd > end))
+            {
+                end = pieceEnd;
+                extended = true;
+            }
         }
     }
+
+    *ram = (end > address);
+    if(!*ram)
+    {
+        end = limit;
+        FOR_EACH_DESCRIPTOR(Piece)
+            if(IsRamType(Piece->Type) && (Piece->PhysicalStart > address) && (Piece->PhysicalStart < end))
+                end = Piece->PhysicalStart;
+    }
+
+    return (end < limit) ? end : limit;
 }
 
 uint64_t GetMaxMappedPhysicalAddress(void)
@@ -58,9 +537,9 @@ uint64_t GetMaxMappedPhysicalAddress(void)
     EFI_MEMORY_DESCRIPTOR * Piece;
     uint64_t currentAddress = 0, maxAddress = 0;
 
-    for(Piece = mainMemorySettings.memMap; Piece < (EFI_MEMORY_DESCRIPTOR *)((uint8_t *)mainMemorySettings.memMap + mainMemorySettings.memMapSize); Piece = (EFI_MEMORY_DESCRIPTOR *)((uint8_t *)Piece + mainMemorySettings.memMapDescriptorSize))
+    FOR_EACH_DESCRIPTOR(Piece)
     {
-        currentAddress = Piece->PhysicalStart + Piece->NumberOfPages << EFI_PAGE_SHIFT;
+        currentAddress = Piece->PhysicalStart + (Piece->NumberOfPages << EFI_PAGE_SHIFT);
         if(currentAddress > maxAddress)
         {
             maxAddress = currentAddress;
@@ -72,35 +551,10 @@ uint64_t GetMaxMappedPhysicalAddress(void)
 
 uint64_t GetUsableSystemRam(void)
 {
-    EFI_MEMORY_DESCRIPTOR * Piece;
-    uint64_t total = 0;
-
-    for(Piece = mainMemorySettings.memMap; Piece < (EFI_MEMORY_DESCRIPTOR *)((uint8_t *)mainMemorySettings.memMap + mainMemorySettings.memMapSize); Piece = (EFI_MEMORY_DESCRIPTOR *)((uint8_t *)Piece + mainMemorySettings.memMapDescriptorSize))
-    {
-        if(
-            (Piece->Type != EfiMemoryMappedIO) &&
-            (Piece->Type != EfiMemoryMappedIOPortSpace) &&
-            (Piece->Type != EfiPalCode) &&
-            (Piece->Type != EfiMaxMemoryType)
-        )
-        {
-            PrintString("Pages found: %d\n", mainTextDisplaySettings.fontColor, mainTextDisplaySettings.backgroundColor, Piece->NumberOfPages);
-            total += Piece->NumberOfPages << EFI_PAGE_SHIFT;
-        }
-    }
-    return total;
+    return mainMemorySettings.usableSystemRam;
 }
 
 uint64_t GetTotalSystemRam(void)
 {
-    EFI_MEMORY_DESCRIPTOR * Piece;
-    uint64_t total = 0;
-
-    for(Piece = mainMemorySettings.memMap; Piece < (EFI_MEMORY_DESCRIPTOR *)((uint8_t *)mainMemorySettings.memMap + mainMemorySettings.memMapSize); Piece = (EFI_MEMORY_DESCRIPTOR *)((uint8_t *)Piece + mainMemorySettings.memMapDescriptorSize))
-    {
-        PrintString("Pages found: %d\n", mainTextDisplaySettings.fontColor, mainTextDisplaySettings.backgroundColor, Piece->NumberOfPages);
-        total += Piece->NumberOfPages << EFI_PAGE_SHIFT;
-    }
-    
-    return total;
-}
\ No newline at end of file
+    return mainMemorySettings.totalSystemRam;
+}
@@ -0,0 +1,206 @@
+/*
+   Copyright 2019 Dylan Green
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "kernel/kernel.h"
+#include "kernel/options.h"
+
+// Static, because the console and memory options are needed before there's an allocator
+static char optionText[BOOT_OPTIONS_MAX_SIZE + 1];
+static BootOption options[BOOT_OPTIONS_SLOTS];
+static uint32_t optionCount = 0;
+
+// FNV-1a
+static uint32_t HashKey(const char * key)
+{
+    uint32_t hash = 0x811C9DC5;
+
+    for(; *key != '\0'; key++)
+        hash = (hash ^ (uint8_t)*key) * 0x01000193;
+
+    return hash;
+}
+
+static bool StringsEqual(const char * a, const char * b)
+{
+    for(; (*a != '\0') && (*a == *b); a++, b++);
+    return *a == *b;
+}
+
+static BootOption * FindSlot(const char * key, uint32_t hash)
+{
+    uint32_t slot = hash & (BOOT_OPTIONS_SLOTS - 1);
+
+    // Linear probing; the table is never more than half full, so there's always an empty slot to stop at
+    while((options[slot].key != NULL) && ((options[slot].hash != hash) || !StringsEqual(options[slot].key, key)))
+        slot = (slot + 1) & (BOOT_OPTIONS_SLOTS - 1);
+
+    return &options[slot];
+}
+
+static void AddOption(const char * key, const char * value)
+{
+    uint32_t hash = HashKey(key);
+    BootOption * option = FindSlot(key, hash);
+
+    if(option->key == NULL)
+    {
+        if(optionCount == BOOT_OPTIONS_SLOTS / 2)
+            return;
+
+        option->key = key;
+        option->hash = hash;
+        optionCount++;
+    }
+
+    option->value = value;
+}
+
+void InitializeBootOptions(const uint16_t * text, uint64_t size)
+{
+    uint64_t length = 0;
+
+    SetMemory(options, 0, sizeof(options));
+    optionCount = 0;
+
+    if(text != NULL)
+    {
+        // Options are plain ASCII, so anything else just becomes '?'
+        for(; (length < size / sizeof(uint16_t)) && (length < BOOT_OPTIONS_MAX_SIZE) && (text[length] != 0); length++)
+            optionText[length] = (text[length] < 128) ? text[length] : '?';
+    }
+    optionText[length] = '\0';
+
+    // Split in place: each key and value gets null terminated where its separator was
+    char * p = optionText;
+    while(*p != '\0')
+    {
+        for(; (*p == ' ') || (*p == '\t'); p++);
+        if(*p == '\0')
+            break;
+
+        char * key = p;
+        char * value = "1";
+
+        for(; (*p != '\0') && (*p != ' ') && (*p != '\t') && (*p != '='); p++);
+        if(*p == '=')
+        {
+            *p++ = '\0';
+            value = p;
+            for(; (*p != '\0') && (*p != ' ') && (*p != '\t'); p++);
+        }
+
+        if(*p != '\0')
+            *p++ = '\0';
+
+        if(*key != '\0')
+            AddOption(key, value);
+    }
+}
+
+static BootOption * GetOption(const char * key)
+{
+    BootOption * option = FindSlot(key, HashKey(key));
+    return (option->key != NULL) ? option : NULL;
+}
+
+bool HasBootOption(const char * key)
+{
+    return GetOption(key) != NULL;
+}
+
+const char * GetBootOptionString(const char * key, const char * defaultValue)
+{
+    BootOption * option = GetOption(key);
+    return option ? option->value : defaultValue;
+}
+
+uint64_t GetBootOptionInteger(const char * key, uint64_t defaultValue)
+{
+    BootOption * option = GetOption(key);
+    if(option == NULL)
+        return defaultValue;
+
+    const char * p = option->value;
+    uint64_t value = 0;
+    bool digits = false;
+
+    if((p[0] == '0') && ((p[1] == 'x') || (p[1] == 'X')))
+    {
+        for(p += 2;; p++, digits = true)
+        {
+            if((*p >= '0') && (*p <= '9'))
+                value = (value << 4) | (*p - '0');
+            else if(((*p | 0x20) >= 'a') && ((*p | 0x20) <= 'f'))
+                value = (value << 4) | ((*p | 0x20) - 'a' + 10);
+            else
+                break;
+        }
+    }
+    else
+    {
+        for(; (*p >= '0') && (*p <= '9'); p++, digits = true)
+            value = value * 10 + (*p - '0');
+    }
+
+    switch(*p)
+    {
+    case 'K':
+    case 'k':
+        value <<= 10;
+        p++;
+        break;
+    case 'M':
+    case 'm':
+        value <<= 20;
+        p++;
+        break;
+    case 'G':
+    case 'g':
+        value <<= 30;
+        p++;
+        break;
+    }
+
+    return (digits && (*p == '\0')) ? value : defaultValue;
+}
+
+bool GetBootOptionBool(const char * key, bool defaultValue)
+{
+    const char * value = GetBootOptionString(key, NULL);
+    if(value == NULL)
+        return defaultValue;
+
+    if(StringsEqual(value, "1") || StringsEqual(value, "yes") || StringsEqual(value, "on") || StringsEqual(value, "true"))
+        return true;
+    if(StringsEqual(value, "0") || StringsEqual(value, "no") || StringsEqual(value, "off") || StringsEqual(value, "false"))
+        return false;
+
+    return defaultValue;
+}
+
+#ifdef DEBUG_PIOUS
+void PrintBootOptions(void)
+{
+    LogMessage(LOG_LEVEL_DEBUG, "Boot options (%u):", optionCount);
+    for(uint32_t i = 0; i < BOOT_OPTIONS_SLOTS; i++)
+    {
+        if(options[i].key != NULL)
+            LogMessage(LOG_LEVEL_DEBUG, " %s=%s", options[i].key, options[i].value);
+    }
+    LogMessage(LOG_LEVEL_DEBUG, "\n");
+    DrainLog();
+}
+#endif
@@ -0,0 +1,239 @@
+/*
+   Copyright 2019 Dylan Green
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "kernel/kernel.h"
+#include "kernel/graphics.h"
+#include "kernel/memory.h"
+#include "kernel/slab.h"
+
+#define SLAB_MAGIC 0x51AB51AB
+
+// Lives at the start of every slab. Objects follow it, so it's padded out to a cache line.
+struct __attribute__((aligned(64))) Slab {
+    Slab        *next;
+    Slab        *prev;
+    ObjectCache *cache;
+    void        *freeList;   // Objects that have been freed back to this slab
+    uint32_t     nextUnused; // Objects past this index have never been handed out, so a new slab doesn't have to be walked to build its free list
+    uint32_t     inUse;
+    uint32_t     magic;
+};
+
+// Power-of-two classes with in-between sizes where rounding up would waste the most
+static const uint32_t sizeClasses[] = {16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048, 3072, 4096, 6144, 8192};
+static const char * sizeClassNames[] = {"size-16", "size-32", "size-48", "size-64", "size-96", "size-128", "size-192", "size-256", "size-384", "size-512", "size-768", "size-1024", "size-1536", "size-2048", "size-3072", "size-4096", "size-6144", "size-8192"};
+
+#define NUM_SIZE_CLASSES (sizeof(sizeClasses) / sizeof(sizeClasses[0]))
+
+static ObjectCache sizeClassCaches[NUM_SIZE_CLASSES];
+static ObjectCache cacheCache;               // Where CreateObjectCache() gets its ObjectCache structs from
+static ObjectCache * allCaches = NULL;
+
+// KernelAllocate() sizes are looked up here in 16-byte steps instead of searching sizeClasses
+static uint8_t sizeClassIndex[SLAB_MAX_OBJECT / SLAB_MIN_OBJECT + 1];
+
+
+static void SetupCache(ObjectCache *cache, const char *name, uint32_t objectSize)
+{
+    cache->name = name;
+    cache->objectSize = (objectSize + SLAB_MIN_OBJECT - 1) & ~(SLAB_MIN_OBJECT - 1);
+    cache->objectsPerSlab = (SLAB_SIZE - sizeof(Slab)) / cache->objectSize;
+    cache->partialSlabs = NULL;
+    cache->fullSlabs = NULL;
+    cache->emptySlab = NULL;
+    cache->objects = 0;
+    cache->slabs = 0;
+    cache->hits = 0;
+    cache->misses = 0;
+
+    cache->next = allCaches;
+    allCaches = cache;
+}
+
+void InitializeSlab(void)
+{
+    uint32_t i;
+    uint32_t class = 0;
+
+    SetupCache(&cacheCache, "object-cache", sizeof(ObjectCache));
+
+    for(i = 0; i < NUM_SIZE_CLASSES; i++)
+        SetupCache(&sizeClassCaches[i], sizeClassNames[i], sizeClasses[i]);
+
+    for(i = 0; i <= SLAB_MAX_OBJECT / SLAB_MIN_OBJECT; i++)
+    {
+        while(sizeClasses[class] < i * SLAB_MIN_OBJECT)
+            class++;
+        sizeClassIndex[i] = class;
+    }
+}
+
+static void PushSlab(Slab **list, Slab *slab)
+{
+    slab->prev = NULL;
+    slab->next = *list;
+    if(*list)
+        (*list)->prev = slab;
+    *list = slab;
+}
+
+static void RemoveSlab(Slab **list, Slab *slab)
+{
+    if(slab->prev)
+        slab->prev->next = slab->next;
+    else
+        *list = slab->next;
+
+    if(slab->next)
+        slab->next->prev = slab->prev;
+}
+
+ObjectCache * CreateObjectCache(const char *name, uint32_t objectSize)
+{
+    if((objectSize == 0) || (objectSize > SLAB_MAX_OBJECT))
+        return NULL;
+
+    ObjectCache * cache = AllocateObject(&cacheCache);
+    if(cache)
+        SetupCache(cache, name, objectSize);
+    return cache;
+}
+
+void * AllocateObject(ObjectCache *cache)
+{
+    Slab * slab = cache->partialSlabs;
+
+    if(slab)
+        cache->hits++;
+    else if(cache->emptySlab)
+    {
+        slab = cache->emptySlab;
+        cache->emptySlab = NULL;
+        PushSlab(&cache->partialSlabs, slab);
+        cache->hits++;
+    }
+    else
+    {
+        slab = (Slab *)AllocatePhysicalBlock(SLAB_ORDER); // Identity mapped
+        if(slab == NULL)
+            return NULL;
+
+        slab->cache = cache;
+        slab->freeList = NULL;
+        slab->nextUnused = 0;
+        slab->inUse = 0;
+        slab->magic = SLAB_MAGIC;
+        PushSlab(&cache->partialSlabs, slab);
+
+        cache->slabs++;
+        cache->misses++;
+    }
+
+    void * object;
+    if(slab->freeList)
+    {
+        object = slab->freeList;
+        slab->freeList = *(void **)object;
+    }
+    else
+    {
+        object = (uint8_t *)slab + sizeof(Slab) + (uint64_t)slab->nextUnused * cache->objectSize;
+        slab->nextUnused++;
+    }
+
+    slab->inUse++;
+    cache->objects++;
+
+    if(slab->inUse == cache->objectsPerSlab)
+    {
+        RemoveSlab(&cache->partialSlabs, slab);
+        PushSlab(&cache->fullSlabs, slab);
+    }
+
+    return object;
+}
+
+void FreeObject(ObjectCache *cache, void *object)
+{
+    Slab * slab = (Slab *)((uint64_t)object & ~(SLAB_SIZE - 1));
+
+    if((object == NULL) || (slab->magic != SLAB_MAGIC) || (slab->cache != cache) || (slab->inUse == 0))
+        Abort(SLAB_ERROR_BAD_FREE);
+
+    if(slab->inUse == cache->objectsPerSlab)
+    {
+        RemoveSlab(&cache->fullSlabs, slab);
+        PushSlab(&cache->partialSlabs, slab);
+    }
+
+    *(void **)object = slab->freeList;
+    slab->freeList = object;
+    slab->inUse--;
+    cache->objects--;
+
+    if(slab->inUse == 0)
+    {
+        RemoveSlab(&cache->partialSlabs, slab);
+
+        // Keep one empty slab around, give any others back
+        if(cache->emptySlab == NULL)
+            cache->emptySlab = slab;
+        else
+        {
+            slab->magic = 0;
+            FreePhysicalBlock((uint64_t)slab, SLAB_ORDER);
+            cache->slabs--;
+        }
+    }
+}
+
+void * KernelAllocate(uint64_t size)
+{
+    if((size == 0) || (size > SLAB_MAX_OBJECT))
+        return NULL;
+
+    return AllocateObject(&sizeClassCaches[sizeClassIndex[(size + SLAB_MIN_OBJECT - 1) / SLAB_MIN_OBJECT]]);
+}
+
+void KernelFree(void *pointer)
+{
+    if(pointer == NULL)
+        return;
+
+    Slab * slab = (Slab *)((uint64_t)pointer & ~(SLAB_SIZE - 1));
+    if(slab->magic != SLAB_MAGIC)
+        Abort(SLAB_ERROR_BAD_FREE);
+
+    FreeObject(slab->cache, pointer);
+}
+
+#ifdef DEBUG_PIOUS
+void PrintObjectCacheStatistics(void)
+{
+    ObjectCache * cache;
+
+    PrintDebugMessage("Object caches (objects, slabs, hits, misses):\n");
+    for(cache = allCaches; cache; cache = cache->next)
+    {
+        if((cache->hits == 0) && (cache->misses == 0)) // Never used
+            continue;
+
+        PrintString("    ", mainTextDisplaySettings.fontColor, mainTextDisplaySettings.backgroundColor);
+        PrintString("%s", mainTextDisplaySettings.fontColor, mainTextDisplaySettings.backgroundColor, cache->name);
+        PrintString(": %lu, %lu, %lu, %lu\n", mainTextDisplaySettings.fontColor, mainTextDisplaySettings.backgroundColor, cache->objects, cache->slabs, cache->hits, cache->misses);
+    }
+}
+#endif
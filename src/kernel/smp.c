@@ -0,0 +1,95 @@
+/*
+   Copyright 2019 Dylan Green
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "kernel/kernel.h"
+#include "kernel/memory.h"
+#include "kernel/slab.h"
+#include "kernel/smp.h"
+
+_Static_assert(__builtin_offsetof(CPUState, perCPUOffset) == CPU_STATE_PER_CPU_OFFSET, "CPU_STATE_PER_CPU_OFFSET is out of date");
+_Static_assert(__builtin_offsetof(CPUState, stackTop) == CPU_STATE_STACK_TOP, "CPU_STATE_STACK_TOP is out of date");
+_Static_assert(__builtin_offsetof(CPUState, hardwareId) == CPU_STATE_HARDWARE_ID, "CPU_STATE_HARDWARE_ID is out of date");
+_Static_assert(__builtin_offsetof(CPUState, arch) == CPU_STATE_ARCH, "CPU_STATE_ARCH is out of date");
+
+// The boot CPU's block is static so it exists before there's an allocator; it runs on kernel_stack, so stackTop stays 0. Its per-CPU
+// variables are the .percpu section itself, hence an offset of 0.
+static CPUState bootCPU = {0, 0, 0, 0, 1, 0, NULL};
+
+SMPInfo mainSMPInfo = {1, 1, 0, {&bootCPU}};
+
+DEFINE_PER_CPU(CPUState *, currentCPU);
+
+// CPUStates are 64 bytes and slab objects start 64 bytes into a 64 KiB slab, so every CPUState gets a cache line to itself
+static ObjectCache * cpuStateCache = NULL;
+
+CPUState * CreateCPUState(uint32_t hardwareId, uint64_t archSize)
+{
+    if(mainSMPInfo.cpuCount == SMP_MAX_CPUS)
+        return NULL;
+
+    if(cpuStateCache == NULL)
+        cpuStateCache = CreateObjectCache("cpu-state", sizeof(CPUState));
+    if(cpuStateCache == NULL)
+        return NULL;
+
+    CPUState * cpu = AllocateObject(cpuStateCache);
+    if(cpu == NULL)
+        return NULL;
+
+    archSize = (archSize + 63) & ~63ULL;
+    uint64_t pages = EFI_SIZE_TO_PAGES(PER_CPU_SIZE + archSize + CPU_STACK_SIZE);
+    uint64_t address = AllocatePhysicalPages(pages);
+    if(address == 0)
+    {
+        FreeObject(cpuStateCache, cpu);
+        return NULL;
+    }
+
+    // [per-CPU variables][arch]...[stack]. The stack goes at the end, so running off it runs into the page below rather than this
+    // CPU's variables.
+    uint8_t * perCPU = (uint8_t *)address;
+    SetMemory(cpu, 0, sizeof(CPUState));
+    SetMemory(perCPU, 0, PER_CPU_SIZE + archSize);
+    cpu->perCPUOffset = (uint64_t)perCPU - (uint64_t)__percpu_start;
+    cpu->stackTop = address + (pages << EFI_PAGE_SHIFT);
+    cpu->index = mainSMPInfo.cpuCount;
+    cpu->hardwareId = hardwareId;
+    cpu->arch = archSize ? (void *)(perCPU + PER_CPU_SIZE) : NULL;
+    *PER_CPU_POINTER(cpu->perCPUOffset, currentCPU) = cpu;
+
+    mainSMPInfo.cpus[mainSMPInfo.cpuCount++] = cpu;
+    return cpu;
+}
+
+void SecondaryCPUMain(CPUState * cpu)
+{
+    __atomic_store_n(&cpu->online, 1, __ATOMIC_RELEASE);
+    __atomic_fetch_add(&mainSMPInfo.onlineCount, 1, __ATOMIC_RELEASE);
+
+    while(1)
+        WaitForInterrupt();
+}
+
+#ifdef DEBUG_PIOUS
+void PrintSMPInfo(void)
+{
+    LogMessage(LOG_LEVEL_DEBUG, "CPUs: %u of %u online (started in %lu us):", mainSMPInfo.onlineCount, mainSMPInfo.cpuCount, mainSMPInfo.startupTime / 1000);
+    for(uint32_t i = 0; i < mainSMPInfo.cpuCount; i++)
+        LogMessage(LOG_LEVEL_DEBUG, mainSMPInfo.cpus[i]->online ? " %u" : " (%u)", mainSMPInfo.cpus[i]->hardwareId);
+    LogMessage(LOG_LEVEL_DEBUG, "\n");
+    DrainLog();
+}
+#endif